@@ -115,7 +115,8 @@ struct file_holder{
     }
     ~file_holder()
     {
-        // at the end, check if the file size is zero.
+        // at the end, check if the file size is zero, after any pending write-behind output is done
+        gz_write_behind::instance().wait_for(file_name.c_str());
         if(std::filesystem::exists(file_name) && !std::filesystem::file_size(file_name))
             std::filesystem::remove(file_name);
     }
@@ -218,6 +219,7 @@ std::string run_auto_track(
                 if(std::filesystem::exists(mapping_file_name))
                     QFile::remove(mapping_file_name.c_str());
             }
+            gz_write_behind::instance().wait_for(fib_file_name.c_str());
             if(!std::filesystem::exists(fib_file_name))
                 return std::string("fib file not generated for ") + file_list[i];
         }
@@ -258,6 +260,8 @@ std::string run_auto_track(
                 continue;
             }
 
+            gz_write_behind::instance().wait_for(trk_file_name.c_str());
+            gz_write_behind::instance().wait_for(template_trk_file_name.c_str());
             bool has_stat_file = std::filesystem::exists(stat_file_name);
             bool has_trk_file = std::filesystem::exists(trk_file_name) &&
                     (!export_template_trk || std::filesystem::exists(template_trk_file_name));
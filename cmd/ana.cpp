@@ -18,6 +18,9 @@
 
 // test example
 // --action=ana --source=20100129_F026Y_WANFANGYUN.src.gz.odf8.f3rec.de0.dti.fib.gz --method=0 --fiber_count=5000
+// merging tracts: --action=ana --source=subject.fib.gz --tract=a.tt.gz,b.tt.gz --output=merged.tt.gz
+// a .tt.gz output is merged out of core, and every input must have the dimension and voxel size of --source
+// (other outputs load the tracts into memory and do not check this)
 bool atl_load_atlas(std::string atlas_name,std::vector<std::shared_ptr<atlas> >& atlas_list);
 bool load_roi(std::shared_ptr<fib_data> handle,std::shared_ptr<RoiMgr> roi_mgr);
 
@@ -111,6 +114,43 @@ bool load_tracts(const char* file_name,std::shared_ptr<TractModel> tract_model,s
         std::cout << "ERROR:" << file_name << " does not exist. terminating..." << std::endl;
         return 1;
     }
+    if(!roi_mgr->report.empty())
+    {
+        // the spatial index allows reading only the tract chunks near the regions
+        TractReader reader;
+        if(reader.open(file_name) && reader.select_region(roi_mgr))
+        {
+            std::cout << "reading " << reader.get_selected_chunk_count() << " tract chunks using the spatial index" << std::endl;
+            tract_model->geo = reader.geo;
+            tract_model->vs = reader.vs;
+            tract_model->report = reader.report;
+            tract_model->parameter_id = reader.parameter_id;
+            std::vector<std::vector<float> > tracts;
+            std::vector<unsigned int> cluster,all_cluster;
+            while(reader.read(tracts,cluster))
+            {
+                // add_tracts skips empty tracts
+                if(cluster.size() == tracts.size())
+                    for(size_t i = 0;i < tracts.size();++i)
+                        if(!tracts[i].empty())
+                            all_cluster.push_back(cluster[i]);
+                tract_model->add_tracts(tracts);
+            }
+            if(!reader.error_msg.empty())
+            {
+                std::cout << "ERROR: " << reader.error_msg << " in " << file_name << std::endl;
+                return false;
+            }
+            if(reader.color)
+                tract_model->set_color(reader.color);
+            // cluster ids as load_from_file assigns them
+            if(all_cluster.size() == tract_model->get_visible_track_count())
+                all_cluster.swap(tract_model->get_cluster_info());
+            std::cout << "filtering tracts using roi/roa/end regions." << std::endl;
+            tract_model->filter_by_roi(roi_mgr);
+            return true;
+        }
+    }
     if(!tract_model->load_from_file(file_name))
     {
         std::cout << "ERROR: cannot read or parse the tractography file :" << file_name << std::endl;
@@ -244,19 +284,37 @@ int ana(void)
         tipl::image<uint32_t,3> accumulate_map(dim);
         for(size_t i = 0;i < tract_files.size();++i)
         {
-            std::shared_ptr<TractModel> tract_model(new TractModel(handle));
-            if(!load_tracts(tract_files[i].c_str(),tract_model,roi_mgr))
+            // stream the tracts so that large files need not fit in memory
+            TractReader reader;
+            reader.vs = handle->vs;
+            if(!reader.open(tract_files[i].c_str()))
+            {
+                std::cout << "ERROR: cannot read or parse the tractography file :" << tract_files[i] << " " << reader.error_msg << std::endl;
                 return 1;
+            }
             std::cout << "accumulating " << tract_files[i] << "..." <<std::endl;
-            std::vector<tipl::vector<3,short> > points;
-            tract_model->to_voxel(points,1.0f);
             tipl::image<char,3> tract_mask(dim);
-            tipl::par_for(points.size(),[&](size_t j)
+            std::vector<std::vector<float> > tracts;
+            while(reader.read(tracts))
+            {
+                TractModel tract_model(handle);
+                tract_model.add_tracts(tracts);
+                if(!roi_mgr->report.empty())
+                    tract_model.filter_by_roi(roi_mgr);
+                std::vector<tipl::vector<3,short> > points;
+                tract_model.to_voxel(points,1.0f);
+                tipl::par_for(points.size(),[&](size_t j)
+                {
+                    tipl::vector<3,short> p = points[j];
+                    if(dim.is_valid(p))
+                        tract_mask[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]=1;
+                });
+            }
+            if(!reader.error_msg.empty())
             {
-                tipl::vector<3,short> p = points[j];
-                if(dim.is_valid(p))
-                    tract_mask[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]=1;
-            });
+                std::cout << "ERROR: " << reader.error_msg << " in " << tract_files[i] << std::endl;
+                return 1;
+            }
             accumulate_map += tract_mask;
         }
         tipl::image<float,3> pdi(accumulate_map);
@@ -271,8 +329,76 @@ int ana(void)
     }
 
 
-    if(QString(output.c_str()).endsWith(".trk.gz") ||
-       QString(output.c_str()).endsWith(".tt.gz"))
+    // merge through the out-of-core tract store so that the tracts need not fit in memory
+    if(QString(output.c_str()).endsWith(".tt.gz"))
+    {
+        auto store = std::make_shared<TractStore>();
+        store->geo = handle->dim;
+        store->vs = handle->vs;
+        std::vector<std::vector<float> > tracts;
+        for(size_t i = 0;i < tract_files.size();++i)
+        {
+            TractReader reader;
+            reader.vs = handle->vs;
+            if(!reader.open(tract_files[i].c_str()))
+            {
+                std::cout << "ERROR: cannot read or parse the tractography file :" << tract_files[i] << " " << reader.error_msg << std::endl;
+                return 1;
+            }
+            if(reader.geo.size() && (reader.geo != handle->dim ||
+               std::fabs(reader.vs[0]-handle->vs[0]) > 0.001f ||
+               std::fabs(reader.vs[1]-handle->vs[1]) > 0.001f ||
+               std::fabs(reader.vs[2]-handle->vs[2]) > 0.001f))
+            {
+                std::cout << "ERROR: " << tract_files[i] << " has a different image dimension or voxel size from " << po.get("source") << std::endl;
+                return 1;
+            }
+            if(i == 0)
+            {
+                store->report = reader.report;
+                store->parameter_id = reader.parameter_id;
+            }
+            if(!roi_mgr->report.empty() && reader.select_region(roi_mgr))
+                std::cout << "reading " << reader.get_selected_chunk_count() << " tract chunks using the spatial index" << std::endl;
+            std::cout << "reading " << tract_files[i] << "..." <<std::endl;
+            while(reader.read(tracts))
+                if(!store->add(tracts,uint16_t(i)))
+                {
+                    std::cout << "ERROR: " << store->error_msg << std::endl;
+                    return 1;
+                }
+            if(!reader.error_msg.empty())
+            {
+                std::cout << "ERROR: " << reader.error_msg << " in " << tract_files[i] << std::endl;
+                return 1;
+            }
+        }
+        if(!roi_mgr->report.empty())
+        {
+            std::cout << "filtering tracts using roi/roa/end regions." << std::endl;
+            if(!store->filter_by_roi(roi_mgr))
+            {
+                std::cout << "ERROR: " << store->error_msg << std::endl;
+                return 1;
+            }
+        }
+        std::cout << "save " << store->size() << " tracts to " << output << std::endl;
+        if(!store->save_to_file(output.c_str()))
+        {
+            std::cout << "ERROR: " << store->error_msg << std::endl;
+            return 1;
+        }
+        // label file naming the clusters, as written by TractModel::save_all
+        {
+            std::ofstream out((output+".txt").c_str());
+            for(const auto& each : tract_files)
+                out << each << std::endl;
+        }
+        std::cout << "file saved at " << output << std::endl;
+        return 0;
+    }
+
+    if(QString(output.c_str()).endsWith(".trk.gz"))
     {
 
         std::vector<std::shared_ptr<TractModel> > tracts;
@@ -0,0 +1,398 @@
+#include <chrono>
+#include <random>
+#include <future>
+#include <atomic>
+#include <filesystem>
+#include "tipl/tipl.hpp"
+#include "libs/gzip_interface.hpp"
+#include "libs/tracking/tract_model.hpp"
+#include "libs/dsi/basic_voxel.hpp"
+#include "libs/dsi/dti_process.hpp"
+#include "program_option.hpp"
+
+// example
+// --action=bench --size=64 --output=bench.json
+// --size: payload size in MB, --chunk_mb: chunk size of the container tests, --seek_count: random reads of the seek tests
+// --stroke_count: mouse strokes of the tract selection tests
+// the DTI fitting test uses the same payload size of DWI
+// --thread_count: threads used to generate the test data, to fit DTI, and to inflate or deflate gz chunks and
+// access point segments. the single disk read-ahead thread of each gz_istream and the write-behind threads are extra
+
+struct BenchRecord
+{
+    std::string name;
+    double size = 0.0;          // payload in MB
+    double wall_time = 0.0;     // in seconds
+    double cpu_time = 0.0;      // in seconds, process-wide
+    int64_t peak_memory = 0;    // peak resident memory above the start of the test, in bytes
+    size_t count = 0;           // operations, e.g. seeks or tracts
+    bool ok = true;
+};
+
+template<typename fun_type>
+bool run_bench(std::vector<BenchRecord>& records,const std::string& name,double size,fun_type&& fun)
+{
+    BenchRecord r;
+    r.name = name;
+    r.size = size;
+    // sample the resident memory while the test runs
+    std::atomic<bool> done(false);
+    int64_t base_memory = get_resident_memory();
+    int64_t peak_memory = base_memory;
+    auto sampler = std::async(std::launch::async,[&]()
+    {
+        while(!done)
+        {
+            peak_memory = std::max<int64_t>(peak_memory,get_resident_memory());
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+    auto start_wall = std::chrono::steady_clock::now();
+    double start_cpu = get_process_cpu_time();
+    r.ok = fun(r.count);
+    r.cpu_time = get_process_cpu_time()-start_cpu;
+    r.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_wall).count();
+    done = true;
+    sampler.get();
+    r.peak_memory = std::max<int64_t>(peak_memory,get_resident_memory())-base_memory;
+    std::cout << name << (r.ok ? "" : " (failed)") << ": " << r.size/r.wall_time << " MB/s"
+              << " cpu " << int(100.0*r.cpu_time/r.wall_time) << "%"
+              << " peak memory " << (r.peak_memory >> 20) << " MB" << std::endl;
+    records.push_back(r);
+    return r.ok;
+}
+
+bool save_bench_json(const std::vector<BenchRecord>& records,double size,unsigned int thread_count,const std::string& file_name)
+{
+    std::ostringstream out;
+    out << "{" << std::endl;
+    out << "  \"version\": \"" << __DATE__ << "\"," << std::endl;
+    out << "  \"size_mb\": " << size << "," << std::endl;
+    out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << "," << std::endl;
+    out << "  \"thread_count\": " << thread_count << "," << std::endl;
+    out << "  \"results\": [" << std::endl;
+    for(size_t i = 0;i < records.size();++i)
+    {
+        const auto& r = records[i];
+        out << "    {\"name\": \"" << r.name << "\""
+            << ", \"ok\": " << (r.ok ? "true" : "false")
+            << ", \"size_mb\": " << r.size
+            << ", \"wall_time\": " << r.wall_time
+            << ", \"cpu_time\": " << r.cpu_time
+            << ", \"mb_per_s\": " << (r.wall_time > 0.0 ? r.size/r.wall_time : 0.0)
+            << ", \"cpu_utilization\": " << (r.wall_time > 0.0 ? r.cpu_time/r.wall_time : 0.0)
+            << ", \"peak_memory\": " << r.peak_memory
+            << ", \"count\": " << r.count
+            << ", \"count_per_s\": " << (r.wall_time > 0.0 ? double(r.count)/r.wall_time : 0.0) << "}"
+            << (i+1 == records.size() ? "":",") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+    if(file_name.empty())
+    {
+        std::cout << out.str();
+        return true;
+    }
+    std::ofstream file(file_name);
+    file << out.str();
+    return file.good();
+}
+
+int bench(void)
+{
+    size_t size_mb = size_t(po.get("size",64));
+    size_t chunk_mb = size_t(po.get("chunk_mb",4));
+    size_t seek_count = size_t(po.get("seek_count",256));
+    size_t stroke_count = size_t(po.get("stroke_count",16));
+    unsigned int thread_count = po.get("thread_count",uint32_t(std::thread::hardware_concurrency()));
+    std::string output = po.get("output");
+    std::string dir = po.get("tmp",std::filesystem::temp_directory_path().string().c_str());
+    std::string gz_file = dir + "/dsi_studio_bench.gz";
+    std::string chunked_file = dir + "/dsi_studio_bench.chunked.gz";
+    std::string mat_file = dir + "/dsi_studio_bench.mat.gz";
+    std::string nii_file = dir + "/dsi_studio_bench.nii.gz";
+    std::string tt_file = dir + "/dsi_studio_bench.tt.gz";
+
+    if(size_mb == 0 || thread_count == 0)
+    {
+        std::cout << "ERROR: please specify a positive --size and --thread_count" << std::endl;
+        return 1;
+    }
+    gz_istream::thread_count = gz_ostream::thread_count = thread_count;
+
+    // synthetic payload: smooth image-like values with noise, compressible to about the ratio of real data
+    std::cout << "generating " << size_mb << " MB of synthetic data" << std::endl;
+    std::vector<float> payload(size_mb << 18);
+    tipl::par_for2(payload.size() >> 16,[&](size_t block,size_t)
+    {
+        std::mt19937 gen(static_cast<uint32_t>(block));
+        std::normal_distribution<float> noise(0.0f,0.05f);
+        for(size_t i = block << 16,end = i+65536;i < end;++i)
+            payload[i] = std::round((std::sin(float(i)*0.001f)+noise(gen))*1024.0f)/1024.0f;
+    },thread_count);
+    const char* buf = reinterpret_cast<const char*>(&payload[0]);
+    size_t buf_size = payload.size()*sizeof(float);
+    const size_t piece = 1 << 20;
+    double size = double(size_mb);
+    std::vector<BenchRecord> records;
+
+    // plain gzip stream
+    run_bench(records,"gz_ostream.write",size,[&](size_t& count)
+    {
+        gz_ostream out;
+        if(!out.open(gz_file.c_str()))
+            return false;
+        for(size_t pos = 0;pos < buf_size;pos += piece,++count)
+            out.write(buf+pos,std::min(piece,buf_size-pos));
+        out.close();
+        return true;
+    });
+    run_bench(records,"gz_istream.read",size,[&](size_t& count)
+    {
+        gz_istream in;
+        if(!in.open(gz_file.c_str()))
+            return false;
+        std::vector<char> data(piece);
+        for(size_t pos = 0;pos < buf_size;pos += piece,++count)
+            if(!in.read(&data[0],std::min(piece,buf_size-pos)))
+                return false;
+        return true;
+    });
+    run_bench(records,"gz_istream.seek",double(seek_count*65536)/double(1 << 20),[&](size_t& count)
+    {
+        gz_istream in;
+        if(!in.open(gz_file.c_str()))
+            return false;
+        std::mt19937 gen(0);
+        std::uniform_int_distribution<size_t> pos(0,buf_size-65536);
+        std::vector<char> data(65536);
+        for(;count < seek_count;++count)
+            if(!in.seek(pos(gen)) || !in.read(&data[0],data.size()))
+                return false;
+        return true;
+    });
+
+    // chunked container, inflated in parallel
+    {
+        size_t old_chunk_size = gz_ostream::chunk_size;
+        gz_ostream::chunk_size = chunk_mb << 20;
+        run_bench(records,"gz_ostream.write_chunked",size,[&](size_t& count)
+        {
+            gz_ostream out;
+            if(!out.open(chunked_file.c_str()))
+                return false;
+            for(size_t pos = 0;pos < buf_size;pos += piece,++count)
+                out.write(buf+pos,std::min(piece,buf_size-pos));
+            out.close();
+            return true;
+        });
+        gz_ostream::chunk_size = old_chunk_size;
+    }
+    run_bench(records,"gz_istream.read_chunked",size,[&](size_t& count)
+    {
+        gz_istream in;
+        if(!in.open(chunked_file.c_str()))
+            return false;
+        std::vector<char> data(buf_size);
+        count = 1;
+        return in.read(&data[0],data.size());
+    });
+    run_bench(records,"gz_istream.seek_chunked",double(seek_count*65536)/double(1 << 20),[&](size_t& count)
+    {
+        gz_istream in;
+        if(!in.open(chunked_file.c_str()))
+            return false;
+        std::mt19937 gen(0);
+        std::uniform_int_distribution<size_t> pos(0,buf_size-65536);
+        std::vector<char> data(65536);
+        for(;count < seek_count;++count)
+            if(!in.seek(pos(gen)) || !in.read(&data[0],data.size()))
+                return false;
+        return true;
+    });
+
+    // mat container
+    run_bench(records,"gz_mat_write",size,[&](size_t& count)
+    {
+        gz_mat_write out(mat_file.c_str());
+        if(!out)
+            return false;
+        count = 1;
+        out.write("payload",&payload[0],1024,uint32_t(payload.size()/1024));
+        return true;
+    });
+    run_bench(records,"gz_mat_read",size,[&](size_t& count)
+    {
+        gz_mat_read in;
+        const float* data = nullptr;
+        unsigned int row,col;
+        count = 1;
+        return in.load_from_file(mat_file.c_str()) && in.read("payload",row,col,data) && size_t(row)*col == payload.size();
+    });
+
+    // nifti
+    {
+        unsigned int width = uint32_t(std::cbrt(double(payload.size())));
+        tipl::image<float,3> I(tipl::geometry<3>(width,width,width));
+        std::copy(payload.begin(),payload.begin()+int64_t(I.size()),I.begin());
+        double nii_size = double(I.size()*sizeof(float))/double(1 << 20);
+        tipl::matrix<4,4,float> trans;
+        initial_LPS_nifti_srow(trans,I.geometry(),tipl::vector<3>(1.0f,1.0f,1.0f));
+        run_bench(records,"gz_nifti.save",nii_size,[&](size_t& count)
+        {
+            count = 1;
+            return gz_nifti::save_to_file(nii_file.c_str(),I,tipl::vector<3>(1.0f,1.0f,1.0f),trans);
+        });
+        run_bench(records,"gz_nifti.load",nii_size,[&](size_t& count)
+        {
+            gz_nifti nii;
+            if(!nii.load_from_file(nii_file.c_str()))
+                return false;
+            tipl::image<float,3> J;
+            nii.toLPS(J);
+            count = 1;
+            return J.size() == I.size();
+        });
+    }
+
+    // TinyTrack codec: random walks of 100 points with a 0.5 voxel step
+    {
+        tipl::geometry<3> geo(256,256,256);
+        size_t tract_count = payload.size()/300;
+        std::vector<std::vector<float> > tracts(tract_count);
+        tipl::par_for2(tract_count,[&](size_t i,size_t)
+        {
+            std::mt19937 gen(static_cast<uint32_t>(i));
+            std::uniform_real_distribution<float> start(64.0f,192.0f),step(-0.29f,0.29f);
+            tracts[i].resize(300);
+            tracts[i][0] = start(gen);
+            tracts[i][1] = start(gen);
+            tracts[i][2] = start(gen);
+            for(size_t j = 3;j < tracts[i].size();++j)
+                tracts[i][j] = tracts[i][j-3]+step(gen);
+        },thread_count);
+        TractModel tract_model(geo,tipl::vector<3>(1.0f,1.0f,1.0f));
+        tract_model.add_tracts(tracts);
+        run_bench(records,"tinytrack.save",size,[&](size_t& count)
+        {
+            count = tract_count;
+            return tract_model.save_tracts_to_file(tt_file.c_str());
+        });
+        run_bench(records,"tinytrack.load",size,[&](size_t& count)
+        {
+            TractModel loaded(geo,tipl::vector<3>(1.0f,1.0f,1.0f));
+            if(!loaded.load_from_file(tt_file.c_str()))
+                return false;
+            count = loaded.get_visible_track_count();
+            return count == tract_count;
+        });
+        run_bench(records,"tinytrack.stream",size,[&](size_t& count)
+        {
+            TractReader reader;
+            std::vector<std::vector<float> > chunk;
+            if(!reader.open(tt_file.c_str()))
+                return false;
+            while(reader.read(chunk))
+                ;
+            count = reader.read_count;
+            return count == tract_count && reader.error_msg.empty();
+        });
+
+        // interactive selection: strokes of 16 view directions across the volume, viewed from below,
+        // the first stroke of each tract count includes building the selection index
+        for(size_t n = tract_count/8;n && n <= tract_count;n *= 2)
+        {
+            TractModel subset(geo,tipl::vector<3>(1.0f,1.0f,1.0f));
+            const auto& all_tracts = static_cast<const TractModel&>(tract_model).get_tracts();
+            std::vector<std::vector<float> > subset_tracts(all_tracts.begin(),all_tracts.begin()+int64_t(n));
+            subset.add_tracts(subset_tracts);
+            tipl::vector<3,float> from_pos(128.0f,128.0f,-256.0f);
+            std::mt19937 gen(0);
+            std::uniform_real_distribution<float> y(64.0f,192.0f);
+            run_bench(records,"tract.select_"+std::to_string(n),double(n*300*sizeof(float))/double(1 << 20),[&](size_t& count)
+            {
+                std::vector<unsigned int> selected;
+                size_t selected_count = 0;
+                for(;count < stroke_count;++count)
+                {
+                    std::vector<tipl::vector<3,float> > dirs;
+                    float y0 = y(gen),y1 = y(gen);
+                    for(int i = 0;i < 16;++i)
+                    {
+                        tipl::vector<3,float> dir(64.0f+128.0f*float(i)/15.0f,y0+(y1-y0)*float(i)/15.0f,128.0f);
+                        dir -= from_pos;
+                        dir.normalize();
+                        dirs.push_back(dir);
+                    }
+                    subset.select(0.0f,dirs,from_pos,selected);
+                    selected_count += size_t(std::count_if(selected.begin(),selected.end(),[](unsigned int v){return v > 0;}));
+                }
+                return selected_count > 0;
+            });
+            std::cout << "tract.select_" << n << ": " << double(records.back().count)/records.back().wall_time << " strokes/s" << std::endl;
+        }
+    }
+
+    // DTI fitting: one b0 and 64 directions at b=1000, prolate tensors of random orientation
+    {
+        const size_t dwi_count = 65;
+        unsigned int width = uint32_t(std::cbrt(double(size_mb << 20)/double(dwi_count*sizeof(unsigned short))));
+        Voxel voxel;
+        voxel.dim = tipl::geometry<3>(width,width,width);
+        voxel.vs = tipl::vector<3>(2.0f,2.0f,2.0f);
+        voxel.mask.resize(voxel.dim);
+        std::fill(voxel.mask.begin(),voxel.mask.end(),1);
+        voxel.other_output = "fa,ad,rd,md";
+        voxel.thread_count = thread_count;
+        voxel.bvalues.push_back(0.0f);
+        voxel.bvectors.push_back(tipl::vector<3>());
+        {
+            std::mt19937 gen(0);
+            std::normal_distribution<float> n;
+            for(size_t i = 1;i < dwi_count;++i)
+            {
+                tipl::vector<3> dir(n(gen),n(gen),n(gen));
+                dir.normalize();
+                voxel.bvalues.push_back(1000.0f);
+                voxel.bvectors.push_back(dir);
+            }
+        }
+        std::vector<std::vector<unsigned short> > dwi(dwi_count,std::vector<unsigned short>(voxel.dim.size()));
+        tipl::par_for2(voxel.dim.size(),[&](size_t index,size_t)
+        {
+            std::mt19937 gen(static_cast<uint32_t>(index));
+            std::normal_distribution<float> n;
+            tipl::vector<3> fiber(n(gen),n(gen),n(gen));
+            fiber.normalize();
+            for(size_t i = 0;i < dwi_count;++i)
+            {
+                float cos_angle = voxel.bvectors[i]*fiber;
+                float adc = 0.0003f+0.0014f*cos_angle*cos_angle;
+                dwi[i][index] = uint16_t(std::max<float>(1.0f,1000.0f*std::exp(-voxel.bvalues[i]*adc)+10.0f*n(gen)));
+            }
+        },thread_count);
+        for(const auto& each : dwi)
+            voxel.dwi_data.push_back(&each[0]);
+        run_bench(records,"dti.fit",double(dwi_count*voxel.dim.size()*sizeof(unsigned short))/double(1 << 20),[&](size_t& count)
+        {
+            Dwi2Tensor dti;
+            dti.init(voxel);
+            count = voxel.dim.size();
+            return !voxel.fib_fa.empty();
+        });
+        std::cout << "dti.fit: " << double(records.back().count)/records.back().wall_time << " voxels/s" << std::endl;
+    }
+
+    for(const auto& file : {gz_file,chunked_file,mat_file,nii_file,tt_file,tt_file+".idx",tt_file+".sidx.gz"})
+        if(std::filesystem::exists(file))
+            std::filesystem::remove(file);
+    if(!save_bench_json(records,size,thread_count,output))
+    {
+        std::cout << "ERROR: cannot write to " << output << std::endl;
+        return 1;
+    }
+    for(const auto& r : records)
+        if(!r.ok)
+            return 1;
+    return 0;
+}
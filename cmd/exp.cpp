@@ -14,9 +14,88 @@
 std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name);
 bool trk2tt(const char* trk_file,const char* tt_file);
 bool tt2trk(const char* tt_file,const char* trk_file);
+// reduce a tract file to maps or tables without loading all tracts
+int exp_tracts(const std::string& file_name)
+{
+    std::istringstream in(po.get("export"));
+    std::string cmd;
+    while(std::getline(in,cmd,','))
+    {
+        TractReader reader;
+        if(!reader.open(file_name.c_str()))
+        {
+            std::cout << "ERROR: " << reader.error_msg << " " << file_name << std::endl;
+            return 1;
+        }
+        if(cmd == "tdi" || cmd == "tdi_end")
+        {
+            if(!reader.geo.size())
+            {
+                std::cout << "ERROR: no image dimension stored in " << file_name << std::endl;
+                return 1;
+            }
+            tipl::image<unsigned int,3> tdi(reader.geo);
+            tipl::matrix<4,4,float> tr,trans;
+            tr.identity();
+            initial_LPS_nifti_srow(trans,reader.geo,reader.vs);
+            std::string output = file_name + "." + cmd + ".nii.gz";
+            if(!reader.get_density_map(tdi,tr,cmd == "tdi_end") ||
+               !gz_nifti::save_to_file(output.c_str(),tdi,reader.vs,trans))
+            {
+                std::cout << "ERROR: cannot export " << output << " " << reader.error_msg << std::endl;
+                return 1;
+            }
+            std::cout << output << " saved from " << reader.read_count << " tracts" << std::endl;
+            continue;
+        }
+        if(cmd == "length")
+        {
+            float bin_size = po.get("bin_size",1.0f);
+            std::vector<size_t> hist;
+            if(!reader.get_length_histogram(hist,bin_size))
+            {
+                std::cout << "ERROR: cannot read tracts " << reader.error_msg << std::endl;
+                return 1;
+            }
+            std::string output = file_name + ".length.txt";
+            std::ofstream out(output.c_str());
+            out << "length(mm)\tcount" << std::endl;
+            for(size_t i = 0;i < hist.size();++i)
+                out << float(i)*bin_size << "\t" << hist[i] << std::endl;
+            std::cout << output << " saved from " << reader.read_count << " tracts" << std::endl;
+            continue;
+        }
+        if(cmd == "index")
+        {
+            if(!reader.save_spatial_index())
+            {
+                std::cout << "ERROR: " << reader.error_msg << std::endl;
+                return 1;
+            }
+            std::cout << "spatial index saved for " << file_name << std::endl;
+            continue;
+        }
+        if(cmd == "count")
+        {
+            std::vector<std::vector<float> > tracts;
+            while(reader.read(tracts))
+                ;
+            std::cout << "number of tracts:" << reader.read_count << std::endl;
+            continue;
+        }
+        std::cout << "ERROR: unsupported export " << cmd << std::endl;
+        return 1;
+    }
+    return 0;
+}
 int exp(void)
 {
     std::string file_name = po.get("source");
+    if(po.has("export") && (QString(file_name.c_str()).endsWith("tt.gz") ||
+                            QString(file_name.c_str()).endsWith("trk.gz") ||
+                            QString(file_name.c_str()).endsWith(".trk") ||
+                            QString(file_name.c_str()).endsWith(".tck")))
+        return exp_tracts(file_name);
     if(QString(file_name.c_str()).endsWith(".trk.gz"))
     {
         std::string output_name = po.get("output");
@@ -128,6 +128,7 @@ int rec(void)
     src.voxel.odf_resolving = po.get("odf_resolving",int(0));
     src.voxel.output_odf = po.get("record_odf",int(0));
     src.voxel.dti_no_high_b = po.get("dti_no_high_b",src.is_human_data());
+    src.voxel.dti_wls = po.get("dti_wls",int(0));
     src.voxel.check_btable = po.get("check_btable",int(src.voxel.dim[2] < src.voxel.dim[0]*2.0 ? 1:0));
     src.voxel.other_output = po.get("other_output","fa,ad,rd,md,nqa,rdi,nrdi");
     src.voxel.max_fiber_number = uint32_t(po.get("num_fiber",int(5)));
@@ -135,6 +136,9 @@ int rec(void)
     src.voxel.thread_count = po.get("thread_count",uint32_t(std::thread::hardware_concurrency()));
     src.voxel.half_sphere = po.get("half_sphere",src.is_dsi_half_sphere() ? 1:0);
     src.voxel.scheme_balance = po.get("scheme_balance",src.need_scheme_balance() ? 1:0);
+    src.voxel.output_profile = po.get("profile",int(0));
+    // directory to keep QSDR registrations for later reconstructions of the same data, not used by default
+    src.voxel.qsdr_cache_dir = po.get("qsdr_cache");
 
 
     {
@@ -142,6 +146,8 @@ int rec(void)
             std::cout << "record ODF in the fib file" << std::endl;
         if(src.voxel.r2_weighted && method_index == 4)
             std::cout << "r2 weighted is used for GQI" << std::endl;
+        if(src.voxel.output_profile)
+            std::cout << "output reconstruction profile to profile.json" << std::endl;
     }
 
     if(po.has("other_image"))
@@ -150,6 +150,85 @@ void export_track_info(std::shared_ptr<fib_data> handle,
             continue;
         }
 
+        // along-tract profiles of several indices in a tidy table for group analysis
+        if(cmd == "profile")
+        {
+            std::vector<std::string> index_list;
+            if(po.has("profile_index"))
+            {
+                std::istringstream in(po.get("profile_index"));
+                std::string index_name;
+                while(std::getline(in,index_name,','))
+                    index_list.push_back(index_name);
+            }
+            else
+                handle->get_index_list(index_list);
+            std::vector<unsigned int> dir_list;
+            {
+                std::istringstream in(po.get("profile_dir","3"));
+                std::string dir;
+                while(std::getline(in,dir,','))
+                {
+                    if(dir.size() != 1 || dir[0] < '0' || dir[0] > '4')
+                    {
+                        std::cout << "ERROR: invalid profile type:" << dir << ". Please specify 0 to 4 in --profile_dir" << std::endl;
+                        continue;
+                    }
+                    dir_list.push_back(uint32_t(dir[0]-'0'));
+                }
+            }
+            std::vector<TractProfile> profiles;
+            for(const auto& index_name : index_list)
+            {
+                if(handle->get_name_index(index_name) == handle->view_item.size())
+                {
+                    std::cout << "cannot find index name:" << index_name << std::endl;
+                    continue;
+                }
+                for(auto dir : dir_list)
+                {
+                    profiles.push_back(TractProfile());
+                    profiles.back().index_name = index_name;
+                    profiles.back().profile_dir = dir;
+                }
+            }
+            if(profiles.empty())
+            {
+                std::cout << "ERROR: no valid profile to calculate" << std::endl;
+                continue;
+            }
+            unsigned int bootstrap = uint32_t(po.get("bootstrap",int(0)));
+            std::cout << "calculating " << profiles.size() << " profiles";
+            if(bootstrap)
+                std::cout << " with " << bootstrap << " bootstrap samples";
+            std::cout << std::endl;
+            tract_model->get_profiles(handle,profiles,po.get("bandwidth",1.0f),bootstrap);
+
+            std::string file_name_stat = file_name + ".profile.tsv";
+            std::cout << "output profiles:" << file_name_stat << std::endl;
+            std::ofstream out(file_name_stat.c_str());
+            if(!out)
+            {
+                std::cout << "ERROR: cannot write to " << file_name_stat << std::endl;
+                continue;
+            }
+            const char* dir_name[] = {"x","y","z","along_tract","tract"};
+            std::string subject = QFileInfo(po.get("source").c_str()).baseName().toStdString();
+            std::string tract = QFileInfo(file_name.c_str()).baseName().toStdString();
+            out << "subject\ttract\tindex\tprofile\tposition\tvalue\tci_lower\tci_upper" << std::endl;
+            for(const auto& profile : profiles)
+                for(size_t j = 0;j < profile.mean.size();++j)
+                {
+                    out << subject << "\t" << tract << "\t" << profile.index_name << "\t"
+                        << dir_name[profile.profile_dir] << "\t" << profile.position[j] << "\t" << profile.mean[j];
+                    if(profile.ci1.empty())
+                        out << "\t\t" << std::endl;
+                    else
+                        out << "\t" << profile.ci1[j] << "\t" << profile.ci2[j] << std::endl;
+                }
+            continue;
+        }
+
         std::string file_name_stat = file_name + "." + cmd;
         // export statistics
         if(QString(cmd.c_str()).startsWith("tdi"))
@@ -506,14 +585,22 @@ int trk_post(std::shared_ptr<fib_data> handle,std::shared_ptr<TractModel> tract_
         std::string cmd = po.get("cluster");
         std::replace(cmd.begin(),cmd.end(),',',' ');
         std::istringstream in(cmd);
-        int method = 0,count = 0,detail = 0;
+        int method = 0,count = 0;
+        float detail = 0.0f;
         std::string name;
         in >> method >> count >> detail >> name;
+        if((method == 0 || method == 3) && !(detail > 0.0f))
+        {
+            std::cout << "ERROR: please specify a positive cluster resolution or distance threshold, e.g. --cluster=3,50,10,output.txt" << std::endl;
+            return 1;
+        }
         std::cout << "cluster method: " << method << std::endl;
         std::cout << "cluster count: " << count << std::endl;
-        std::cout << "cluster resolution (if method is 0) : " << detail << " mm" << std::endl;
+        std::cout << "cluster resolution (if method is 0) or distance threshold (if method is 3) : " << detail << " mm" << std::endl;
+        if(method == 3)
+            std::cout << "cluster order (0:input 1:longest first 2:shuffled) : " << po.get("cluster_order",0) << std::endl;
         std::cout << "run clustering." << std::endl;
-        tract_model->run_clustering(uint8_t(method),uint32_t(count),detail);
+        tract_model->run_clustering(uint8_t(method),uint32_t(count),detail,uint8_t(po.get("cluster_order",0)));
         std::ofstream out(tract_file_name + "." + name);
         std::cout << "cluster label saved to " << name << std::endl;
         std::copy(tract_model->get_cluster_info().begin(),tract_model->get_cluster_info().end(),std::ostream_iterator<int>(out," "));
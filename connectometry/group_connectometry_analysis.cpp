@@ -200,10 +200,10 @@ void group_connectometry_analysis::run_permutation_multithread(unsigned int id,u
         std::fill(subject_pos_corr_null.begin(),subject_pos_corr_null.end(),0);
         std::fill(subject_neg_corr.begin(),subject_neg_corr.end(),0);
         std::fill(subject_pos_corr.begin(),subject_pos_corr.end(),0);
-        cal_hist(neg_corr_track->get_tracts(),subject_neg_corr);
-        cal_hist(neg_null_corr_track->get_tracts(),subject_neg_corr_null);
-        cal_hist(pos_corr_track->get_tracts(),subject_pos_corr);
-        cal_hist(pos_null_corr_track->get_tracts(),subject_pos_corr_null);
+        cal_hist(std::as_const(*neg_corr_track).get_tracts(),subject_neg_corr);
+        cal_hist(std::as_const(*neg_null_corr_track).get_tracts(),subject_neg_corr_null);
+        cal_hist(std::as_const(*pos_corr_track).get_tracts(),subject_pos_corr);
+        cal_hist(std::as_const(*pos_null_corr_track).get_tracts(),subject_pos_corr_null);
         calculate_FDR();
 
         // output distribution values
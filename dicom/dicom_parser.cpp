@@ -286,13 +286,22 @@ bool find_bval_bvec(const char* file_name,QString& bval,QString& bvec)
     return QFileInfo(bval).exists() && QFileInfo(bvec).exists();
 }
 
+void prepare_idx(const char* file_name,std::shared_ptr<gz_istream> in);
+void save_idx(const char* file_name,std::shared_ptr<gz_istream> in);
 bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec)
 {
     tipl::vector<3,float> vs;
-    std::vector<tipl::image<float,3> > dwi_data;
+    // volumes are stored as 16-bit as soon as no rescaling can be needed, which requires
+    // the data type to bound every later volume below the 16-bit limit,
+    // otherwise they are kept in float until the maximum value is known.
+    std::vector<tipl::image<unsigned short,3> > dwi_data;
+    std::vector<tipl::image<float,3> > float_data;
+    float max_value = 0.0f;
     {
         gz_nifti nii;
-        nii.input_stream->buffer_all = true;
+        // access points allow parallel inflate, and read-ahead is bounded instead of buffering the whole file
+        prepare_idx(file_name,nii.input_stream);
+        nii.input_stream->buffer_all = false;
         if(!nii.load_from_file(file_name))
         {
             src_error_msg = nii.error;
@@ -304,11 +313,25 @@ bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >&
             return false;
         }
         dwi_data.resize(nii.dim(4));
+        float_data.resize(nii.dim(4));
         nii.get_voxel_size(vs);
-        // check data range
+        bool bounded = false;
+        {
+            double type_max = 0.0;
+            switch(nii.nif_header2.datatype)
+            {
+                case 2:   type_max = 255.0;break;   // uint8
+                case 4:   type_max = 32767.0;break; // int16
+                case 256: type_max = 127.0;break;   // int8
+                case 512: type_max = 65535.0;break; // uint16
+            }
+            double slope = nii.nif_header2.scl_slope == 0.0 ? 1.0 : double(nii.nif_header2.scl_slope);
+            bounded = type_max > 0.0 && slope > 0.0 &&
+                      slope*type_max+double(nii.nif_header2.scl_inter) <= double(std::numeric_limits<unsigned short>::max()-1);
+        }
+        tipl::image<float,3> data;
         for(unsigned int index = 0;index < nii.dim(4);++index)
         {
-            tipl::image<float,3> data;
             if(!nii.toLPS(data,false))
             {
                 src_error_msg = "Incomplete file. Only ";
@@ -319,42 +342,51 @@ bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >&
                 return false;
             }
             std::replace_if(data.begin(),data.end(),[](float v){return std::isnan(v) || std::isinf(v) || v < 0.0f;},0.0f);
-            dwi_data[index].swap(data);
+            max_value = std::max<float>(max_value,*std::max_element(data.begin(),data.end()));
+            if(!bounded || max_value < 256.0f)
+            {
+                float_data[index] = data;
+                continue;
+            }
+            for(unsigned int i = 0;i < index;++i)
+                if(!float_data[i].empty())
+                {
+                    dwi_data[i] = float_data[i];
+                    tipl::image<float,3>().swap(float_data[i]);
+                }
+            dwi_data[index] = data;
         }
         if(prog_aborted())
         {
             src_error_msg = "Aborted by user.";
             return false;
         }
+        save_idx(file_name,nii.input_stream);
     }
 
 
     // if the imaging value is larger than 16-bit integer, then scale it.
     {
-        float max_value = 0.0f;
-        for(unsigned int index = 0;index < dwi_data.size();++index)
-            max_value = std::max<float>(max_value,*std::max_element(dwi_data[index].begin(),dwi_data[index].end()));
+        float scale = 1.0f;
         if(max_value > float(std::numeric_limits<unsigned short>::max()-1))
-        {
-            float scale = float(std::numeric_limits<unsigned short>::max()-1)/max_value;
-            tipl::par_for(dwi_data.size(),[&](unsigned int index){
-                tipl::multiply_constant(dwi_data[index],scale);
-            });
-        }
+            scale = float(std::numeric_limits<unsigned short>::max()-1)/max_value;
         if(max_value < 256.0f)
         {
             std::cout << "The maximum singal is only " << max_value << std::endl;
-            float scale = 1.0f;
             while(max_value*scale < std::numeric_limits<unsigned short>::max())
                 scale*=32;
             if(scale != 1.0f)
-            {
                 std::cout << "scaling the image by " << scale << std::endl;
-                tipl::par_for(dwi_data.size(),[&](unsigned int index){
-                    tipl::multiply_constant(dwi_data[index],scale);
-                });
-            }
         }
+        tipl::par_for(dwi_data.size(),[&](unsigned int index){
+            if(!float_data[index].empty())
+            {
+                if(scale != 1.0f)
+                    tipl::multiply_constant(float_data[index],scale);
+                dwi_data[index] = float_data[index];
+                tipl::image<float,3>().swap(float_data[index]);
+            }
+        });
     }
     tipl::image<float,4> grad_dev;
     if(QFileInfo(QFileInfo(file_name).absolutePath() + "/grad_dev.nii.gz").exists())
@@ -422,9 +454,7 @@ bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >&
     for(unsigned int index = 0;index < dwi_data.size();++index)
     {
         std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-        tipl::image<float,3> data;
-        data.swap(dwi_data[index]);
-        new_file->image = data;
+        new_file->image.swap(dwi_data[index]);
         new_file->file_name = file_name;
         new_file->file_name += ":";
         new_file->file_name += std::to_string(index);
@@ -18,7 +18,7 @@ win32* {
 
 INCLUDEPATH += ../include
 QMAKE_CXXFLAGS += -wd4244 -wd4267 -wd4018
-LIBS += -lOpenGL32 -lGlu32
+LIBS += -lOpenGL32 -lGlu32 -lPsapi
 RC_ICONS = dsi_studio.ico
 }
 
@@ -174,6 +174,7 @@ SOURCES += main.cpp \
     cmd/reg.cpp \
     auto_track.cpp \
     cmd/atk.cpp \
+    cmd/bench.cpp \
     tracking/device.cpp \
     tracking/devicetablewidget.cpp \
     libs/gzip_interface.cpp
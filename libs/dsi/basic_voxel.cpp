@@ -1,6 +1,93 @@
 #include <boost/math/special_functions/sinc.hpp>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#include <atomic>
 #include "basic_voxel.hpp"
 #include "image_model.hpp"
+
+double get_process_cpu_time(void)
+{
+#ifdef _WIN32
+    FILETIME creation_time,exit_time,kernel_time,user_time;
+    if(!GetProcessTimes(GetCurrentProcess(),&creation_time,&exit_time,&kernel_time,&user_time))
+        return 0.0;
+    auto to_second = [](const FILETIME& t)
+    {
+        return double((uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime)*1.0e-7;
+    };
+    return to_second(kernel_time)+to_second(user_time);
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF,&usage))
+        return 0.0;
+    return double(usage.ru_utime.tv_sec+usage.ru_stime.tv_sec)+
+           double(usage.ru_utime.tv_usec+usage.ru_stime.tv_usec)*1.0e-6;
+#endif
+}
+int64_t get_resident_memory(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS info;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(),&info,sizeof(info)))
+        return 0;
+    return int64_t(info.WorkingSetSize);
+#elif defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if(task_info(mach_task_self(),MACH_TASK_BASIC_INFO,reinterpret_cast<task_info_t>(&info),&count) != KERN_SUCCESS)
+        return 0;
+    return int64_t(info.resident_size);
+#else
+    std::ifstream in("/proc/self/statm");
+    int64_t total_pages = 0,resident_pages = 0;
+    if(!(in >> total_pages >> resident_pages))
+        return 0;
+    return resident_pages*int64_t(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+bool ReconProfiler::save_to_file(const char* file_name) const
+{
+    std::ofstream out(file_name);
+    if(!out)
+        return false;
+    auto quote = [](const std::string& str)
+    {
+        std::string result("\"");
+        for(auto ch : str)
+        {
+            if(ch == '"' || ch == '\\')
+                result += '\\';
+            result += ch;
+        }
+        return result + "\"";
+    };
+    out << "{" << std::endl;
+    out << "  \"version\": " << quote(__DATE__) << "," << std::endl;
+    out << "  \"stages\": [" << std::endl;
+    for(size_t i = 0;i < records.size();++i)
+    {
+        out << "    {\"name\": " << quote(records[i].name)
+            << ", \"wall_time\": " << records[i].wall_time
+            << ", \"cpu_time\": " << records[i].cpu_time
+            << ", \"thread_time\": " << records[i].thread_time
+            << ", \"memory\": " << records[i].memory
+            << ", \"count\": " << records[i].count << "}"
+            << (i+1 == records.size() ? "":",") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+    return out.good();
+}
 float base_function(float theta)
 {
     if(std::fabs(theta) < 0.000001f)
@@ -20,7 +107,10 @@ void Voxel::init(void)
         voxel_data[index].dir.resize(max_fiber_number);
     }
     for (unsigned int index = 0; index < process_list.size(); ++index)
+    {
+        ReconProfiler::scope profile(profiler,profile_stage+":"+process_name[index]+".init");
         process_list[index]->init(*this);
+    }
 }
 
 void Voxel::calculate_sinc_ql(std::vector<float>& sinc_ql)
@@ -91,8 +181,11 @@ void Voxel::load_from_src(ImageModel& image_model)
 bool Voxel::run(void)
 {
     size_t total_voxel = std::accumulate(mask.begin(),mask.end(),size_t(0),[](size_t sum,unsigned char value){return value ? sum+1:sum;});
-    size_t total = 0;
-    bool terminated = false;
+    std::atomic<size_t> total(0);
+    std::atomic<bool> terminated(false);
+    // per-thread accumulated time of each process
+    std::vector<std::vector<double> > run_time(thread_count,std::vector<double>(process_list.size()));
+    ReconProfiler::scope profile(profiler,profile_stage+":run");
     tipl::par_for2(mask.size(),[&](size_t voxel_index,size_t thread_id)
     {
         if(terminated || !mask[voxel_index])
@@ -109,10 +202,29 @@ bool Voxel::run(void)
         }
         voxel_data[thread_id].init();
         voxel_data[thread_id].voxel_index = voxel_index;
+        if(!output_profile)
+        {
+            for (size_t index = 0; index < process_list.size(); ++index)
+                process_list[index]->run(*this,voxel_data[thread_id]);
+            return;
+        }
+        auto& cur_run_time = run_time[thread_id];
         for (size_t index = 0; index < process_list.size(); ++index)
+        {
+            auto start = std::chrono::steady_clock::now();
             process_list[index]->run(*this,voxel_data[thread_id]);
+            cur_run_time[index] += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        }
     },thread_count);
 
+    for (size_t index = 0; output_profile && index < process_list.size(); ++index)
+    {
+        auto& r = profiler.get(profile_stage+":"+process_name[index]+".run");
+        for(const auto& each : run_time)
+            r.thread_time += each[index];
+        r.count += total;
+    }
+
     return !prog_aborted();
 }
 
@@ -120,7 +232,10 @@ bool Voxel::run(void)
 void Voxel::end(gz_mat_write& writer)
 {
     for (size_t index = 0; check_prog(uint32_t(index),uint32_t(process_list.size())); ++index)
+    {
+        ReconProfiler::scope profile(profiler,profile_stage+":"+process_name[index]+".end");
         process_list[index]->end(*this,writer);
+    }
 }
 
 BaseProcess* Voxel::get(unsigned int index)
@@ -3,8 +3,11 @@
 #include <boost/mpl/vector.hpp>
 #include <boost/mpl/for_each.hpp>
 #include <boost/mpl/inherit_linearly.hpp>
+#include <boost/core/demangle.hpp>
 #include <tipl/tipl.hpp>
 #include <string>
+#include <chrono>
+#include <typeinfo>
 #include "tessellated_icosahedron.hpp"
 #include "gzip_interface.hpp"
 #include "prog_interface_static_link.h"
@@ -24,6 +27,59 @@ public:
 
 
 
+// wall time, cpu time, and resident memory change of each reconstruction stage
+struct ProfileRecord
+{
+    std::string name;
+    double wall_time = 0.0;     // in seconds
+    double cpu_time = 0.0;      // in seconds, process-wide
+    double thread_time = 0.0;   // in seconds, summed over threads (voxel-wise run only)
+    int64_t memory = 0;         // change of resident memory in bytes
+    size_t count = 0;
+};
+
+double get_process_cpu_time(void);
+int64_t get_resident_memory(void);
+
+class ReconProfiler
+{
+    std::vector<ProfileRecord> records;
+public:
+    ProfileRecord& get(const std::string& name)
+    {
+        for(auto& r : records)
+            if(r.name == name)
+                return r;
+        records.push_back(ProfileRecord());
+        records.back().name = name;
+        return records.back();
+    }
+    void clear(void){records.clear();}
+    bool save_to_file(const char* file_name) const;
+public:
+    // RAII timer that adds its measurement to the named record
+    class scope{
+        ReconProfiler& profiler;
+        std::string name;
+        std::chrono::steady_clock::time_point start_wall;
+        double start_cpu;
+        int64_t start_memory;
+    public:
+        scope(ReconProfiler& profiler_,const std::string& name_):profiler(profiler_),name(name_),
+            start_wall(std::chrono::steady_clock::now()),
+            start_cpu(get_process_cpu_time()),
+            start_memory(get_resident_memory()){}
+        ~scope(void)
+        {
+            auto& r = profiler.get(name);
+            r.wall_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-start_wall).count();
+            r.cpu_time += get_process_cpu_time()-start_cpu;
+            r.memory += get_resident_memory()-start_memory;
+            ++r.count;
+        }
+    };
+};
+
 struct VoxelData
 {
     size_t voxel_index;
@@ -51,6 +107,7 @@ class Voxel
 {
 private:
     std::vector<std::shared_ptr<BaseProcess> > process_list;
+    std::vector<std::string> process_name;
 public:
     tipl::geometry<3> dim;
     tipl::vector<3> vs;
@@ -92,6 +149,7 @@ public:
     }
 public:// DTI
     bool dti_no_high_b = true;
+    bool dti_wls = false;
 public://used in GQI
     bool odf_resolving = false;
     bool r2_weighted = false;// used in GQI only
@@ -106,6 +164,8 @@ public:// used in QSDR
     tipl::matrix<4,4,float> trans_to_mni;
     std::string primary_template,secondary_template;
     tipl::transformation_matrix<double> qsdr_trans;
+    std::string qsdr_cache_dir; // registration cache is only used if a directory is given
+    std::string qsdr_cache_file;
     bool output_rdi = false;
     bool qsdr = false;
     tipl::vector<3,int> csf_pos1,csf_pos2,csf_pos3,csf_pos4;
@@ -131,6 +191,10 @@ public:
 public:// for template creation
     std::vector<std::vector<float> > template_odfs;
     std::string template_file_name;
+public:// for profiling
+    ReconProfiler profiler;
+    std::string profile_stage;
+    bool output_profile = false;
 public:
     std::vector<VoxelData> voxel_data;
 public:
@@ -139,6 +203,7 @@ public:
     void CreateProcesses(void)
     {
         process_list.clear();
+        process_name.clear();
         boost::mpl::for_each<ProcessList>(boost::ref(*this));
     }
 
@@ -146,6 +211,7 @@ public:
     void operator()(Process&)
     {
         process_list.push_back(std::make_shared<Process>());
+        process_name.push_back(boost::core::demangle(typeid(Process).name()));
     }
 public:
     void init(void);
@@ -228,6 +228,11 @@ bool ImageModel::reconstruction(void)
             << " The diffusion data were reconstructed in the MNI space using q-space diffeomorphic reconstruction (Yeh et al., Neuroimage, 58(1):91-9, 2011) to obtain the spin distribution function (Yeh et al., IEEE TMI, ;29(9):1626-35, 2010). "
             << " A diffusion sampling length ratio of "
             << float(voxel.param[0]) << " was used.";
+            // the registration is cached by the src file name, as the output name changes with the recon parameters
+            voxel.qsdr_cache_file.clear();
+            if(!voxel.qsdr_cache_dir.empty() && !file_name.empty())
+                voxel.qsdr_cache_file = voxel.qsdr_cache_dir + "/" + QFileInfo(file_name.c_str()).fileName().toStdString() + "." +
+                        QFileInfo(voxel.primary_template.c_str()).baseName().toLower().toStdString() + ".qsdr.reg.gz";
             // run gqi to get the spin quantity
 
             // obtain QA map for normalization
@@ -260,7 +265,12 @@ bool ImageModel::reconstruction(void)
         else
             voxel.recon_report << " The tensor metrics were calculated.";
 
-        return save_fib(file_name.find(".fib.gz") == std::string::npos ? file_name + get_file_ext():file_name);
+        std::string output_name = (file_name.find(".fib.gz") == std::string::npos ? file_name + get_file_ext():file_name);
+        if(!save_fib(output_name))
+            return false;
+        if(voxel.output_profile && !voxel.profiler.save_to_file((output_name+".profile.json").c_str()))
+            std::cout << "failed to save reconstruction profile " << output_name << ".profile.json" << std::endl;
+        return true;
     }
     catch (std::exception& e)
     {
@@ -1,9 +1,68 @@
 #ifndef DTI_PROCESS_HPP
 #define DTI_PROCESS_HPP
 #include <cmath>
+#include <atomic>
 #include "basic_voxel.hpp"
 #include "tipl/tipl.hpp"
 
+// closed-form eigen decomposition of a symmetric 3-by-3 matrix (Smith, Commun. ACM, 1961)
+// eigenvalues are sorted in descending order and V stores the eigenvectors row by row.
+// returns false for (nearly) repeated eigenvalues, for which the iterative solver should be used.
+inline bool eigen_decomposition_sym3(const double* A,double* V,double* d)
+{
+    double p1 = A[1]*A[1]+A[2]*A[2]+A[5]*A[5];
+    double q = (A[0]+A[4]+A[8])/3.0;
+    double a0 = A[0]-q,a4 = A[4]-q,a8 = A[8]-q;
+    double p2 = a0*a0+a4*a4+a8*a8+2.0*p1;
+    if(p2 <= 0.0)
+        return false;
+    double p = std::sqrt(p2/6.0);
+    double inv_p = 1.0/p;
+    double b0 = a0*inv_p,b4 = a4*inv_p,b8 = a8*inv_p;
+    double b1 = A[1]*inv_p,b2 = A[2]*inv_p,b5 = A[5]*inv_p;
+    double r = 0.5*(b0*(b4*b8-b5*b5)-b1*(b1*b8-b5*b2)+b2*(b1*b5-b4*b2));
+    double phi = std::acos(std::max<double>(-1.0,std::min<double>(1.0,r)))/3.0;
+    d[0] = q+2.0*p*std::cos(phi);
+    d[2] = q+2.0*p*std::cos(phi+2.0*3.14159265358979323846/3.0);
+    d[1] = 3.0*q-d[0]-d[2];
+
+    // the eigenvector is the largest cross product between the rows of (A - lambda I)
+    auto get_vector = [&](double lambda,double* v)
+    {
+        double r0[3] = {A[0]-lambda,A[1],A[2]};
+        double r1[3] = {A[3],A[4]-lambda,A[5]};
+        double r2[3] = {A[6],A[7],A[8]-lambda};
+        const double* rows[3][2] = {{r0,r1},{r0,r2},{r1,r2}};
+        double max_length = 0.0;
+        for(int i = 0;i < 3;++i)
+        {
+            const double* x = rows[i][0];
+            const double* y = rows[i][1];
+            double c[3] = {x[1]*y[2]-x[2]*y[1],x[2]*y[0]-x[0]*y[2],x[0]*y[1]-x[1]*y[0]};
+            double length = c[0]*c[0]+c[1]*c[1]+c[2]*c[2];
+            if(length > max_length)
+            {
+                max_length = length;
+                std::copy(c,c+3,v);
+            }
+        }
+        // rank of (A - lambda I) must be two for a unique eigenvector
+        if(max_length <= 1.0e-12*p2*p2)
+            return false;
+        double inv_length = 1.0/std::sqrt(max_length);
+        v[0] *= inv_length;
+        v[1] *= inv_length;
+        v[2] *= inv_length;
+        return true;
+    };
+    if(!get_vector(d[0],V) || !get_vector(d[2],V+6))
+        return false;
+    V[3] = V[7]*V[2]-V[8]*V[1];
+    V[4] = V[8]*V[0]-V[6]*V[2];
+    V[5] = V[6]*V[1]-V[7]*V[0];
+    return true;
+}
+
 class Dwi2Tensor : public BaseProcess
 {
     std::vector<float> ad,rd,rd1,rd2,md,txx,txy,txz,tyy,tyz,tzz,ha;
@@ -23,8 +82,12 @@ private:
     std::vector<std::vector<double> > iKtK; // 6-by-6
     std::vector<std::vector<unsigned int> > iKtK_pivot;
     std::vector<double> Kt;
+    std::vector<double> iKtKKt; // 6-by-b_count pseudo-inverse for the unregularized fitting
+    bool has_iKtKKt = false;
+    bool prefitted = false;
     unsigned int b_count;
     std::vector<size_t> b_location;
+    static constexpr size_t tile_size = 64;
 public:
     virtual void init(Voxel& voxel)
     {
@@ -113,77 +176,214 @@ public:
             }
             tipl::mat::lu_decomposition(iKtK[i].begin(),iKtK_pivot[i].begin(),tipl::dyndim(6,6));
         }
-    }
-public:
-    virtual void run(Voxel& voxel, VoxelData& data)
-    {
-        if(voxel.fib_fa.empty())
-            return;
-        std::vector<double> signal(b_count);
+
+        // (KtK)^-1Kt allows fitting a tile of voxels with one matrix product
+        iKtKKt.resize(6*b_count);
+        has_iKtKKt = true;
+        for(unsigned int i = 0;i < b_count && has_iKtKKt;++i)
         {
-            double logs0 = std::log(std::max<double>(1.0,double(data.space.front())));
-            for (size_t i = 0;i < b_count;++i)
-                signal[i] = std::log(std::max<double>(1.0,double(data.space[b_location[i]])));
-            logs0 = std::max<double>(logs0,*std::max_element(signal.begin(),signal.end()));
-            if(logs0 == 0.0)
-                return;
-            for (size_t i = 0;i < b_count;++i)
-                signal[i] = std::max<double>(0.0,logs0-signal[i]);
+            double Kt_col[6],iKtKKt_col[6];
+            for(unsigned int k = 0;k < 6;++k)
+                Kt_col[k] = Kt[k*b_count+i];
+            if(!tipl::mat::lu_solve(iKtK[0].begin(),iKtK_pivot[0].begin(),Kt_col,iKtKKt_col,tipl::dyndim(6,6)))
+                has_iKtKKt = false;
+            for(unsigned int k = 0;k < 6;++k)
+                iKtKKt[k*b_count+i] = iKtKKt_col[k];
         }
-        //  Kt S = Kt K D
-        double KtS[6],tensor_param[6];
-        double tensor[9];
-        double V[9],d[3];
-        tipl::mat::product(Kt.begin(),signal.begin(),KtS,tipl::dyndim(6,b_count),tipl::dyndim(b_count,1));
-        for(unsigned int i = 0;i < iKtK.size();++i)
+
+        if(voxel.dti_wls)
+            voxel.recon_report << " The diffusion tensor was estimated using weighted linear least squares.";
+
+        // without gradient nonlinearity or QSDR, the signals are the raw DWI, and the entire mask
+        // can be fitted here in tiles
+        prefitted = false;
+        if(!voxel.qsdr && voxel.grad_dev.empty() && voxel.dwi_data.size() == voxel.bvalues.size())
         {
-            if(!tipl::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,tipl::dyndim(6,6)))
-                continue;
-            unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
-            for (unsigned int index = 0; index < 9; ++index)
-                tensor[index] = tensor_param[tensor_index[index]];
-            tipl::mat::eigen_decomposition_sym(tensor,V,d,tipl::dim<3,3>());
-            if(d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0)
-                break;
+            std::vector<size_t> voxel_index;
+            voxel_index.reserve(voxel.mask.size());
+            for(size_t index = 0;index < voxel.mask.size();++index)
+                if(voxel.mask[index])
+                    voxel_index.push_back(index);
+            size_t tile_count = (voxel_index.size()+tile_size-1)/tile_size;
+            std::atomic<bool> terminated(false);
+            tipl::par_for2(tile_count,[&](size_t tile,size_t thread_id)
+            {
+                if(terminated)
+                    return;
+                if(thread_id == 0)
+                {
+                    if(prog_aborted())
+                    {
+                        terminated = true;
+                        return;
+                    }
+                    check_prog(uint32_t(tile*100/tile_count),100);
+                }
+                size_t from = tile*tile_size;
+                size_t n = std::min<size_t>(tile_size,voxel_index.size()-from);
+                const size_t* tile_index = &voxel_index[0]+from;
+                fit_tile(voxel,tile_index,n,[&](size_t v,size_t b)
+                {
+                    return double(voxel.dwi_data[b][tile_index[v]]);
+                });
+            },voxel.thread_count);
+            prefitted = true;
         }
-
+    }
+private:
+    void output(Voxel& voxel,size_t voxel_index,const double* tensor,const double* V,double* d)
+    {
         d[0] = std::max(0.0,d[0]);
         d[1] = std::max(0.0,d[1]);
         d[2] = std::max(0.0,d[2]);
 
-        std::copy(V,V+3,voxel.fib_dir[data.voxel_index].begin());
-        voxel.fib_fa[data.voxel_index] = get_fa(float(d[0]),float(d[1]),float(d[2]));
+        std::copy(V,V+3,voxel.fib_dir[voxel_index].begin());
+        voxel.fib_fa[voxel_index] = get_fa(float(d[0]),float(d[1]),float(d[2]));
 
         if(!md.empty())
-            md[data.voxel_index] = 1000.0f*float(d[0]+d[1]+d[2])/3.0f;
+            md[voxel_index] = 1000.0f*float(d[0]+d[1]+d[2])/3.0f;
         if(!ad.empty())
-            ad[data.voxel_index] = 1000.0f*float(d[0]);
+            ad[voxel_index] = 1000.0f*float(d[0]);
         if(!rd1.empty())
-            rd1[data.voxel_index] = 1000.0f*float(d[1]);
+            rd1[voxel_index] = 1000.0f*float(d[1]);
         if(!rd2.empty())
-            rd2[data.voxel_index] = 1000.0f*float(d[2]);
+            rd2[voxel_index] = 1000.0f*float(d[2]);
         if(!rd.empty())
-            rd[data.voxel_index] = 1000.0f*float(d[1]+d[2])/2.0f;
+            rd[voxel_index] = 1000.0f*float(d[1]+d[2])/2.0f;
 
         if(!ha.empty())
         {
-            ha[data.voxel_index] = float(std::acos(std::sqrt(V[0]*V[0]+V[1]*V[1]))*180.0/3.14159265358979323846);
+            ha[voxel_index] = float(std::acos(std::sqrt(V[0]*V[0]+V[1]*V[1]))*180.0/3.14159265358979323846);
             tipl::vector<3> center(float(voxel.dim[0])*0.5f,float(voxel.dim[1])*0.5f,float(voxel.dim[2])*0.5f);
-            center -= tipl::vector<3>(tipl::pixel_index<3>(data.voxel_index,voxel.dim));
+            center -= tipl::vector<3>(tipl::pixel_index<3>(voxel_index,voxel.dim));
             if((center.cross_product(tipl::vector<3>(0.0f,0.0f,1.0f))*tipl::vector<3>(V) < 0) ^
                     (V[2] < 0.0))
-                ha[data.voxel_index] = -ha[data.voxel_index];
+                ha[voxel_index] = -ha[voxel_index];
         }
         if(!txx.empty())
         {
-            txx[data.voxel_index] = float(tensor[0]);
-            txy[data.voxel_index] = float(tensor[1]);
-            txz[data.voxel_index] = float(tensor[2]);
-            tyy[data.voxel_index] = float(tensor[4]);
-            tyz[data.voxel_index] = float(tensor[5]);
-            tzz[data.voxel_index] = float(tensor[8]);
+            txx[voxel_index] = float(tensor[0]);
+            txy[voxel_index] = float(tensor[1]);
+            txz[voxel_index] = float(tensor[2]);
+            tyy[voxel_index] = float(tensor[4]);
+            tyz[voxel_index] = float(tensor[5]);
+            tzz[voxel_index] = float(tensor[8]);
+        }
+    }
+    static void to_tensor(const double* tensor_param,double* tensor)
+    {
+        unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
+        for (unsigned int index = 0; index < 9; ++index)
+            tensor[index] = tensor_param[tensor_index[index]];
+    }
+    // the regularized fitting used when the unregularized tensor is not positive definite
+    void fit_regularized(const std::vector<double>& signal,double* tensor,double* V,double* d)
+    {
+        //  Kt S = Kt K D
+        double KtS[6],tensor_param[6];
+        tipl::mat::product(Kt.begin(),signal.begin(),KtS,tipl::dyndim(6,b_count),tipl::dyndim(b_count,1));
+        for(unsigned int i = 0;i < iKtK.size();++i)
+        {
+            if(!tipl::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,tipl::dyndim(6,6)))
+                continue;
+            to_tensor(tensor_param,tensor);
+            tipl::mat::eigen_decomposition_sym(tensor,V,d,tipl::dim<3,3>());
+            if(d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0)
+                break;
+        }
+    }
+    // one reweighting step using the squared predicted signal as the weighting
+    bool fit_wls(const std::vector<double>& signal,const double* tensor_param,double* tensor,double* V,double* d)
+    {
+        double KtWK[36] = {0.0},KtWS[6] = {0.0},wls_param[6];
+        unsigned int pivot[6];
+        for(unsigned int i = 0;i < b_count;++i)
+        {
+            double predicted = 0.0;
+            for(unsigned int k = 0;k < 6;++k)
+                predicted += Kt[k*b_count+i]*tensor_param[k];
+            double w = std::exp(-2.0*predicted);
+            for(unsigned int k = 0;k < 6;++k)
+            {
+                double wk = w*Kt[k*b_count+i];
+                KtWS[k] += wk*signal[i];
+                for(unsigned int l = 0;l < 6;++l)
+                    KtWK[k*6+l] += wk*Kt[l*b_count+i];
+            }
+        }
+        tipl::mat::lu_decomposition(KtWK,pivot,tipl::dyndim(6,6));
+        if(!tipl::mat::lu_solve(KtWK,pivot,KtWS,wls_param,tipl::dyndim(6,6)))
+            return false;
+        double wls_tensor[9],wls_V[9],wls_d[3];
+        to_tensor(wls_param,wls_tensor);
+        if(!eigen_decomposition_sym3(wls_tensor,wls_V,wls_d) ||
+           wls_d[2] <= 0.0)
+            return false;
+        std::copy(wls_tensor,wls_tensor+9,tensor);
+        std::copy(wls_V,wls_V+9,V);
+        std::copy(wls_d,wls_d+3,d);
+        return true;
+    }
+    // fit n voxels at once, signals are gathered as [b][voxel] so that the log transform
+    // and the pseudo-inverse product run across voxels in contiguous arrays
+    template<typename fun_type>
+    void fit_tile(Voxel& voxel,const size_t* voxel_index,size_t n,fun_type&& get_signal)
+    {
+        std::vector<double> signal(b_count*n),logs0(n),param(6*n);
+        for(size_t v = 0;v < n;++v)
+            logs0[v] = std::log(std::max<double>(1.0,get_signal(v,0)));
+        for(size_t i = 0;i < b_count;++i)
+        {
+            double* s = &signal[i*n];
+            for(size_t v = 0;v < n;++v)
+                s[v] = std::log(std::max<double>(1.0,get_signal(v,b_location[i])));
+            for(size_t v = 0;v < n;++v)
+                logs0[v] = std::max<double>(logs0[v],s[v]);
         }
+        for(size_t i = 0;i < b_count;++i)
+        {
+            double* s = &signal[i*n];
+            for(size_t v = 0;v < n;++v)
+                s[v] = std::max<double>(0.0,logs0[v]-s[v]);
+        }
+        if(has_iKtKKt)
+            for(size_t k = 0;k < 6;++k)
+            {
+                double* p = &param[k*n];
+                for(size_t i = 0;i < b_count;++i)
+                {
+                    const double w = iKtKKt[k*b_count+i];
+                    const double* s = &signal[i*n];
+                    for(size_t v = 0;v < n;++v)
+                        p[v] += w*s[v];
+                }
+            }
 
+        std::vector<double> voxel_signal(b_count);
+        for(size_t v = 0;v < n;++v)
+        {
+            if(logs0[v] == 0.0)
+                continue;
+            double tensor_param[6],tensor[9],V[9],d[3] = {0.0,0.0,0.0};
+            for(size_t k = 0;k < 6;++k)
+                tensor_param[k] = param[k*n+v];
+            for(size_t i = 0;i < b_count;++i)
+                voxel_signal[i] = signal[i*n+v];
+            to_tensor(tensor_param,tensor);
+            if(!has_iKtKKt || !eigen_decomposition_sym3(tensor,V,d) || d[2] <= 0.0)
+                fit_regularized(voxel_signal,tensor,V,d);
+            else
+            if(voxel.dti_wls)
+                fit_wls(voxel_signal,tensor_param,tensor,V,d);
+            output(voxel,voxel_index[v],tensor,V,d);
+        }
+    }
+public:
+    virtual void run(Voxel& voxel, VoxelData& data)
+    {
+        if(voxel.fib_fa.empty() || prefitted)
+            return;
+        fit_tile(voxel,&data.voxel_index,1,[&](size_t,size_t b){return double(data.space[b]);});
     }
     virtual void end(Voxel& voxel,gz_mat_write& mat_writer)
     {
@@ -2,6 +2,7 @@
 #define MNI_RECONSTRUCTION_HPP
 #include <QFileInfo>
 #include <chrono>
+#include <cstring>
 #include "basic_voxel.hpp"
 #include "basic_process.hpp"
 #include "gqi_process.hpp"
@@ -29,6 +30,85 @@ protected:
 protected:
     typedef tipl::const_pointer_image<unsigned short,3> point_image_type;
     std::vector<point_image_type> ptr_images;
+protected: // registration cache
+    static void hash_word(uint64_t& h,uint64_t word)
+    {
+        // FNV-1a on 64-bit words, with a shift so that the high bits also reach the low bits
+        h ^= word;
+        h *= 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    static uint64_t hash_piece(const unsigned char* ptr,size_t size)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        size_t i = 0;
+        for(uint64_t word;i+8 <= size;i += 8)
+        {
+            std::memcpy(&word,ptr+i,8);
+            hash_word(h,word);
+        }
+        for(;i < size;++i)
+            hash_word(h,ptr[i]);
+        return h;
+    }
+    static void hash_bytes(uint64_t& h,const void* data,size_t size)
+    {
+        // pieces of 1 MB are hashed in parallel and then combined in order
+        const size_t piece = size_t(1) << 20;
+        auto ptr = reinterpret_cast<const unsigned char*>(data);
+        std::vector<uint64_t> piece_hash((size+piece-1)/piece);
+        if(piece_hash.size() > 1)
+            tipl::par_for(piece_hash.size(),[&](size_t i)
+            {
+                piece_hash[i] = hash_piece(ptr+i*piece,std::min(piece,size-i*piece));
+            });
+        else
+        if(size)
+            piece_hash[0] = hash_piece(ptr,size);
+        hash_word(h,size);
+        for(auto value : piece_hash)
+            hash_word(h,value);
+    }
+    static void hash_image(uint64_t& h,const tipl::image<float,3>& I)
+    {
+        hash_bytes(h,&I.geometry()[0],sizeof(int)*3);
+        if(!I.empty())
+            hash_bytes(h,&I[0],sizeof(float)*I.size());
+    }
+    bool load_registration(const std::string& file_name,const std::string& key,const tipl::geometry<3>& geo)
+    {
+        gz_mat_read in;
+        if(!in.load_from_file(file_name.c_str()))
+            return false;
+        std::string check_key;
+        in.read("key",check_key);
+        if(check_key != key)
+            return false;
+        const double* affine_ptr = nullptr;
+        const float* dis_ptr = nullptr;
+        unsigned int row,col;
+        if(!in.read("affine",row,col,affine_ptr) || row*col != 12 || !affine_ptr)
+            return false;
+        if(!in.read("cdm_dis",row,col,dis_ptr) || row != 3 || col != geo.size() || !dis_ptr)
+            return false;
+        std::copy(affine_ptr,affine_ptr+12,affine.data);
+        cdm_dis.resize(geo);
+        std::copy(dis_ptr,dis_ptr+row*col,&cdm_dis[0][0]);
+        return true;
+    }
+    void save_registration(const std::string& file_name,const std::string& key)
+    {
+        gz_mat_write out(file_name.c_str());
+        if(!out)
+        {
+            std::cout << "cannot write registration cache " << file_name << std::endl;
+            return;
+        }
+        out.write("key",key);
+        out.write("affine",affine.data,1,12);
+        out.write("dimension",cdm_dis.geometry());
+        out.write("cdm_dis",&cdm_dis[0][0],3,uint32_t(cdm_dis.size()));
+    }
 
 public:
     virtual void init(Voxel& voxel)
@@ -100,10 +180,46 @@ public:
             }
 
 
+            // the registration result depends only on these inputs and is reused if they are unchanged.
+            // VF and VF2 come from the QA map and change with the sampling length ratio, so the key
+            // uses the DWI, b-table, and mask they are computed from instead
+            std::string cache_key;
+            bool cached = false;
+            if(!voxel.qsdr_cache_file.empty())
+            {
+                uint64_t h = 14695981039346656037ULL;
+                for(auto dwi : voxel.dwi_data)
+                    hash_bytes(h,dwi,sizeof(unsigned short)*voxel.dim.size());
+                if(!voxel.bvalues.empty())
+                    hash_bytes(h,&voxel.bvalues[0],sizeof(float)*voxel.bvalues.size());
+                if(!voxel.bvectors.empty())
+                    hash_bytes(h,&voxel.bvectors[0][0],sizeof(float)*3*voxel.bvectors.size());
+                if(!voxel.mask.empty())
+                    hash_bytes(h,&voxel.mask[0],voxel.mask.size());
+                hash_bytes(h,voxel.primary_template.c_str(),voxel.primary_template.size()+1);
+                hash_bytes(h,voxel.secondary_template.c_str(),voxel.secondary_template.size()+1);
+                hash_image(h,VG);
+                hash_image(h,VG2);
+                hash_bytes(h,&VGvs[0],sizeof(float)*3);
+                hash_bytes(h,&VFvs[0],sizeof(float)*3);
+                unsigned char flags[3] = {is_human_template,manual_alignment,dual_modality};
+                hash_bytes(h,flags,sizeof(flags));
+                if(manual_alignment)
+                    hash_bytes(h,voxel.qsdr_trans.data,sizeof(double)*12);
+                std::ostringstream out;
+                out << "qsdr_reg_v3_" << std::hex << h;
+                cache_key = out.str();
+                cached = load_registration(voxel.qsdr_cache_file,cache_key,VG.geometry());
+            }
+
+            if(cached)
+                std::cout << "using registration cached in " << voxel.qsdr_cache_file << std::endl;
+            else
             if(manual_alignment)
                 affine = voxel.qsdr_trans;
             else
             {
+                ReconProfiler::scope profile(voxel.profiler,"qsdr_linear_registration");
                 bool terminated = false;
                 if(!run_prog("linear registration",[&]()
                 {
@@ -153,27 +269,32 @@ public:
             tipl::reg::cdm_pre(VG,VG2,VFF,VFF2);
 
             bool terminated = false;
-
-            if(!run_prog("normalization",[&]()
-                {
-                    tipl::reg::cdm_param param;
-                    if(VFvs[0] < VGvs[0])
-                        param.resolution = 1.0f;
-                    if(dual_modality)
-                    {
-                        std::cout << "using dual QA/ISO templates" << std::endl;
-                        tipl::reg::cdm2(VFF,VFF2,VG,VG2,cdm_dis,terminated,param);
-                        tipl::invert_displacement(cdm_dis);
-                        //tipl::reg::cdm2(VG,VG2,VFF,VFF2,cdm_dis,terminated,param);
-                    }
-                    else
+            if(!cached)
+            {
+                ReconProfiler::scope profile(voxel.profiler,"qsdr_nonlinear_registration");
+                if(!run_prog("normalization",[&]()
                     {
-                        //tipl::reg::cdm(VG,VFF,cdm_dis,terminated,param);
-                        tipl::reg::cdm(VFF,VG,cdm_dis,terminated,param);
-                        tipl::invert_displacement(cdm_dis);
-                    }
-                },terminated))
-                throw std::runtime_error("reconstruction canceled");
+                        tipl::reg::cdm_param param;
+                        if(VFvs[0] < VGvs[0])
+                            param.resolution = 1.0f;
+                        if(dual_modality)
+                        {
+                            std::cout << "using dual QA/ISO templates" << std::endl;
+                            tipl::reg::cdm2(VFF,VFF2,VG,VG2,cdm_dis,terminated,param);
+                            tipl::invert_displacement(cdm_dis);
+                            //tipl::reg::cdm2(VG,VG2,VFF,VFF2,cdm_dis,terminated,param);
+                        }
+                        else
+                        {
+                            //tipl::reg::cdm(VG,VFF,cdm_dis,terminated,param);
+                            tipl::reg::cdm(VFF,VG,cdm_dis,terminated,param);
+                            tipl::invert_displacement(cdm_dis);
+                        }
+                    },terminated))
+                    throw std::runtime_error("reconstruction canceled");
+                if(!voxel.qsdr_cache_file.empty())
+                    save_registration(voxel.qsdr_cache_file,cache_key);
+            }
 
             tipl::image<float,3> VFFF;
             tipl::compose_displacement(VFF,cdm_dis,VFFF);
@@ -38,6 +38,7 @@ void ImageModel::draw_mask(tipl::color_image& buffer,int position)
 
 void ImageModel::calculate_dwi_sum(bool update_mask)
 {
+    ReconProfiler::scope profile(voxel.profiler,update_mask ? "masking":"dwi_sum");
     dwi_sum.clear();
     dwi_sum.resize(voxel.dim);
     tipl::par_for(src_dwi_data.size(),[&](unsigned int index)
@@ -108,18 +109,21 @@ typedef boost::mpl::vector<
 > check_btable_process;
 
 
+tipl::vector<3> flip_fib_dir(const tipl::vector<3>& dir,const unsigned char* order)
+{
+    tipl::vector<3> new_dir(dir[order[0]],dir[order[1]],dir[order[2]]);
+    if(order[3])
+        new_dir[0] = -new_dir[0];
+    if(order[4])
+        new_dir[1] = -new_dir[1];
+    if(order[5])
+        new_dir[2] = -new_dir[2];
+    return new_dir;
+}
 void flip_fib_dir(std::vector<tipl::vector<3> >& fib_dir,const unsigned char* order)
 {
     for(size_t j = 0;j < fib_dir.size();++j)
-    {
-        fib_dir[j] = tipl::vector<3>(fib_dir[j][order[0]],fib_dir[j][order[1]],fib_dir[j][order[2]]);
-        if(order[3])
-            fib_dir[j][0] = -fib_dir[j][0];
-        if(order[4])
-            fib_dir[j][1] = -fib_dir[j][1];
-        if(order[5])
-            fib_dir[j][2] = -fib_dir[j][2];
-    }
+        fib_dir[j] = flip_fib_dir(fib_dir[j],order);
 }
 
 std::vector<size_t> ImageModel::get_sorted_dwi_index(void)
@@ -154,64 +158,187 @@ void ImageModel::flip_b_table(const unsigned char* order)
     }
 }
 
+void ImageModel::reconstruct_original_dti(tipl::image<unsigned char,3>& mask)
+{
+    mask.swap(voxel.mask);
+
+    bool has_rotation = has_image_rotation;
+    has_image_rotation = false;
+
+    auto other_output = voxel.other_output;
+
+    original_src_dwi_data.swap(src_dwi_data);
+    original_dim.swap(voxel.dim);
+    voxel.other_output = std::string();
+
+    reconstruct<check_btable_process>("checking b-table");
+
+    original_src_dwi_data.swap(src_dwi_data);
+    original_dim.swap(voxel.dim);
+    voxel.other_output = other_output;
+
+    mask.swap(voxel.mask);
+    has_image_rotation = has_rotation;
+}
+
+const unsigned char b_table_order[24][6] = {
+                        {0,1,2,0,0,0},
+                        {0,1,2,1,0,0},
+                        {0,1,2,0,1,0},
+                        {0,1,2,0,0,1},
+                        {0,2,1,0,0,0},
+                        {0,2,1,1,0,0},
+                        {0,2,1,0,1,0},
+                        {0,2,1,0,0,1},
+                        {1,0,2,0,0,0},
+                        {1,0,2,1,0,0},
+                        {1,0,2,0,1,0},
+                        {1,0,2,0,0,1},
+                        {1,2,0,0,0,0},
+                        {1,2,0,1,0,0},
+                        {1,2,0,0,1,0},
+                        {1,2,0,0,0,1},
+                        {2,1,0,0,0,0},
+                        {2,1,0,1,0,0},
+                        {2,1,0,0,1,0},
+                        {2,1,0,0,0,1},
+                        {2,0,1,0,0,0},
+                        {2,0,1,1,0,0},
+                        {2,0,1,0,1,0},
+                        {2,0,1,0,0,1}};
+
+/*
+ * Compare b-table permutations against the template fiber orientations on a stratified
+ * subsample of template voxels. The template lattice is split into 8 interleaved strata
+ * (x,y,z parity), and DTI is reconstructed only where the sampled voxels land. After each
+ * stratum, the best permutation is tested against every other permutation using the paired
+ * difference of |cos| across sampled voxels. Sampling stops when the best one is dominant;
+ * otherwise all strata are used, which is the same as the exhaustive comparison.
+ */
+float ImageModel::check_b_table_with_template(std::shared_ptr<fib_data> template_fib,
+                                              const tipl::transformation_matrix<float>& T,
+                                              float* result)
+{
+    const size_t min_sample_count = 2000;
+    const double z_threshold = 5.0;
+    const uint8_t stratum_order[8] = {0,7,1,6,2,5,3,4};
+
+    auto subject_geo = original_dim;
+    std::vector<std::vector<uint32_t> > stratum_subject_index(8);
+    std::vector<std::vector<tipl::vector<3> > > stratum_template_dir(8);
+    {
+        auto template_geo = template_fib->dim;
+        const float* ptr = nullptr;
+        for(tipl::pixel_index<3> index(template_geo);index < template_geo.size();++index)
+        {
+            if(template_fib->dir.fa[0][index.index()] < 0.2f || !(ptr = template_fib->dir.get_dir(index.index(),0)))
+                continue;
+            tipl::vector<3> pos(index);
+            T(pos);
+            pos.round();
+            if(!subject_geo.is_valid(pos))
+                continue;
+            uint8_t stratum = uint8_t((index.x() & 1) | ((index.y() & 1) << 1) | ((index.z() & 1) << 2));
+            stratum_subject_index[stratum].push_back(uint32_t(tipl::pixel_index<3>(pos.begin(),subject_geo).index()));
+            stratum_template_dir[stratum].push_back(tipl::vector<3>(ptr));
+        }
+    }
+    size_t total_sample_count = 0;
+    for(const auto& each : stratum_subject_index)
+        total_sample_count += each.size();
+
+    std::vector<tipl::vector<3> > subject_dir(subject_geo.size());
+    std::vector<char> reconstructed(subject_geo.size());
+    std::vector<std::vector<float> > score(24);
+    std::fill(result,result+24,0.0f);
+    double min_z = 0.0;
+    float margin = 0.0f;
+    for(size_t s = 0;s < 8;++s)
+    {
+        const auto& cur_index = stratum_subject_index[stratum_order[s]];
+        const auto& cur_dir = stratum_template_dir[stratum_order[s]];
+        if(cur_index.empty())
+            continue;
+        // reconstruct DTI only at the subject voxels not yet reconstructed
+        {
+            tipl::image<unsigned char,3> mask(subject_geo);
+            bool need_recon = false;
+            for(auto pos : cur_index)
+                if(!reconstructed[pos])
+                {
+                    mask[pos] = 1;
+                    need_recon = true;
+                }
+            if(need_recon)
+            {
+                reconstruct_original_dti(mask);
+                if(prog_aborted())
+                    return 0.0f;
+                for(size_t pos = 0;pos < mask.size();++pos)
+                    if(mask[pos])
+                    {
+                        subject_dir[pos] = voxel.fib_dir[pos];
+                        reconstructed[pos] = 1;
+                    }
+            }
+        }
+        // evaluate all permutations in parallel
+        tipl::par_for(24,[&](size_t i)
+        {
+            for(size_t j = 0;j < cur_index.size();++j)
+                score[i].push_back(std::abs(flip_fib_dir(subject_dir[cur_index[j]],b_table_order[i])*cur_dir[j]));
+        });
+
+        size_t n = score[0].size();
+        for(size_t i = 0;i < 24;++i)
+            result[i] = float(std::accumulate(score[i].begin(),score[i].end(),0.0)/double(n));
+        size_t best = size_t(std::max_element(result,result+24)-result);
+
+        // paired z score of the best permutation against the runner-up permutations
+        min_z = std::numeric_limits<double>::max();
+        for(size_t i = 0;i < 24;++i)
+        {
+            if(i == best)
+                continue;
+            double sum = 0.0,sum2 = 0.0;
+            for(size_t j = 0;j < n;++j)
+            {
+                double dif = double(score[best][j])-double(score[i][j]);
+                sum += dif;
+                sum2 += dif*dif;
+            }
+            double mean = sum/double(n);
+            double var = std::max<double>(0.0,sum2/double(n)-mean*mean);
+            double z = (var == 0.0 ? (mean > 0.0 ? std::numeric_limits<double>::max() : 0.0) :
+                                      mean/std::sqrt(var/double(n)));
+            min_z = std::min<double>(min_z,z);
+        }
+        float second = 0.0f;
+        for(size_t i = 0;i < 24;++i)
+            if(i != best)
+                second = std::max<float>(second,result[i]);
+        margin = result[best] > 0.0f ? (result[best]-second)/result[best] : 0.0f;
+
+        std::cout << "b-table check sampled " << n << "/" << total_sample_count << " template voxels"
+                  << ", margin=" << int(margin*1000.0f)*0.1f << "%, z=" << min_z << std::endl;
+        if(n >= min_sample_count && min_z > z_threshold && s+1 < 8)
+        {
+            std::cout << "b-table check stopped early with a dominant permutation" << std::endl;
+            break;
+        }
+    }
+    if(min_z <= z_threshold)
+        std::cout << "b-table check used all template voxels due to a small margin" << std::endl;
+
+    voxel.fib_fa.clear();
+    voxel.fib_dir.swap(subject_dir);
+    return margin;
+}
+
 extern std::string fib_template_file_name_2mm;
 std::string ImageModel::check_b_table(void)
 {
-    // reconstruct DTI using original data and b-table
-    {
-        tipl::image<unsigned char,3> mask(original_dim);
-        std::fill(mask.begin(),mask.end(),1);
-        mask.swap(voxel.mask);
-
-        bool has_rotation = has_image_rotation;
-        has_image_rotation = false;
-
-        auto other_output = voxel.other_output;
-
-        original_src_dwi_data.swap(src_dwi_data);
-        original_dim.swap(voxel.dim);
-        voxel.other_output = std::string();
-
-        reconstruct<check_btable_process>("checking b-table");
-
-        original_src_dwi_data.swap(src_dwi_data);
-        original_dim.swap(voxel.dim);
-        voxel.other_output = other_output;
-
-        mask.swap(voxel.mask);
-        has_image_rotation = has_rotation;
-    }
-
-    std::vector<tipl::image<float,3> > fib_fa(1);
-    std::vector<std::vector<tipl::vector<3> > > fib_dir(1);
-    fib_fa[0].swap(voxel.fib_fa);
-    fib_dir[0].swap(voxel.fib_dir);
-
-    const unsigned char order[24][6] = {
-                            {0,1,2,0,0,0},
-                            {0,1,2,1,0,0},
-                            {0,1,2,0,1,0},
-                            {0,1,2,0,0,1},
-                            {0,2,1,0,0,0},
-                            {0,2,1,1,0,0},
-                            {0,2,1,0,1,0},
-                            {0,2,1,0,0,1},
-                            {1,0,2,0,0,0},
-                            {1,0,2,1,0,0},
-                            {1,0,2,0,1,0},
-                            {1,0,2,0,0,1},
-                            {1,2,0,0,0,0},
-                            {1,2,0,1,0,0},
-                            {1,2,0,0,1,0},
-                            {1,2,0,0,0,1},
-                            {2,1,0,0,0,0},
-                            {2,1,0,1,0,0},
-                            {2,1,0,0,1,0},
-                            {2,1,0,0,0,1},
-                            {2,0,1,0,0,0},
-                            {2,0,1,1,0,0},
-                            {2,0,1,0,1,0},
-                            {2,0,1,0,0,1}};
+    ReconProfiler::scope profile(voxel.profiler,"check_b_table");
     const char txt[24][7] = {".012",".012fx",".012fy",".012fz",
                              ".021",".021fx",".021fy",".021fz",
                              ".102",".102fx",".102fy",".102fz",
@@ -249,39 +376,46 @@ std::string ImageModel::check_b_table(void)
     }
 
     float result[24] = {0};
-    float otsu = tipl::segmentation::otsu_threshold(fib_fa[0])*0.6f;
-    auto subject_geo = fib_fa[0].geometry();
-    for(int i = 0;i < 24;++i)// 0 is the current score
+    if(template_fib.get()) // comparing with hcp 2mm template
+    {
+        float margin = check_b_table_with_template(template_fib,T,result);
+        if(prog_aborted())
+            return std::string();
+        std::cout << "b-table confidence margin=" << int(margin*1000.0f)*0.1f << "%" << std::endl;
+    }
+    else
     {
-        auto new_dir(fib_dir);
-        if(i)
-            flip_fib_dir(new_dir[0],order[i]);
+        // reconstruct DTI using original data and b-table
+        tipl::image<unsigned char,3> mask(original_dim);
+        std::fill(mask.begin(),mask.end(),1);
+        reconstruct_original_dti(mask);
 
-        if(template_fib.get()) // comparing with hcp 2mm template
+        std::vector<tipl::image<float,3> > fib_fa(1);
+        std::vector<std::vector<tipl::vector<3> > > fib_dir(1);
+        fib_fa[0].swap(voxel.fib_fa);
+        fib_dir[0].swap(voxel.fib_dir);
+
+        float otsu = tipl::segmentation::otsu_threshold(fib_fa[0])*0.6f;
+        auto subject_geo = fib_fa[0].geometry();
+        for(int i = 0;i < 24;++i)// 0 is the current score
         {
-            double sum_cos = 0.0;
-            size_t ncount = 0;
-            auto tempalte_geo = template_fib->dim;
-            const float* ptr = nullptr;
-            for(tipl::pixel_index<3> index(tempalte_geo);index < tempalte_geo.size();++index)
-            {
-                if(template_fib->dir.fa[0][index.index()] < 0.2f || !(ptr = template_fib->dir.get_dir(index.index(),0)))
-                    continue;
-                tipl::vector<3> pos(index);
-                T(pos);
-                pos.round();
-                if(subject_geo.is_valid(pos))
-                {
-                    sum_cos += std::abs(double(new_dir[0][tipl::pixel_index<3>(pos.begin(),subject_geo).index()]*tipl::vector<3>(ptr)));
-                    ++ncount;
-                }
-            }
-            result[i] = float(sum_cos/double(ncount));
-        }
-        else
-        // for animal studies, use fiber coherence index
+            auto new_dir(fib_dir);
+            if(i)
+                flip_fib_dir(new_dir[0],b_table_order[i]);
+            // for animal studies, use fiber coherence index
             result[i] = evaluate_fib(subject_geo,otsu,fib_fa,[&](uint32_t pos,uint8_t fib){return new_dir[fib][pos];}).first;
+        }
+        fib_fa[0].swap(voxel.fib_fa);
+        fib_dir[0].swap(voxel.fib_dir);
+        long best = long(std::max_element(result,result+24)-result);
+        float second = 0.0f;
+        for(int i = 0;i < 24;++i)
+            if(i != best)
+                second = std::max<float>(second,result[i]);
+        if(result[best] > 0.0f)
+            std::cout << "b-table confidence margin=" << int(1000.0f*(result[best]-second)/result[best])*0.1f << "%" << std::endl;
     }
+
     long best = long(std::max_element(result,result+24)-result);
     for(int i = 0;i < 24;++i)
     {
@@ -298,13 +432,12 @@ std::string ImageModel::check_b_table(void)
     if(result[best] > result[0])
     {
         std::cout << "b-table corrected by " << txt[best] << " for " << file_name << std::endl;
-        flip_b_table(order[best]);
+        flip_b_table(b_table_order[best]);
         voxel.load_from_src(*this);
+        voxel.fib_fa.clear();
+        voxel.fib_dir.clear();
         return txt[best];
     }
-    fib_fa[0].swap(voxel.fib_fa);
-    fib_dir[0].swap(voxel.fib_dir);
-
     return std::string();
 }
 std::vector<std::pair<int,int> > ImageModel::get_bad_slices(void)
@@ -476,6 +609,7 @@ bool ImageModel::run_steps(std::string steps)
 bool ImageModel::command(std::string cmd,std::string param)
 {
     std::cout << cmd << (param.empty() ? "":" param:") << param << std::endl;
+    ReconProfiler::scope profile(voxel.profiler,cmd.find("[Step T2a]") == 0 ? "masking":"preprocessing");
     if(cmd == "[Step T2a][Open]")
     {
         if(!std::filesystem::exists(param))
@@ -1025,6 +1159,72 @@ void apply_distortion_map2(const image_type& v1,
 
 
 
+float mean_square(const tipl::image<float,3>& I)
+{
+    std::vector<double> sum(size_t(I.depth()));
+    tipl::par_for(I.depth(),[&](int z)
+    {
+        auto from = I.begin()+int64_t(z)*int64_t(I.plane_size());
+        double s = 0.0;
+        for(auto iter = from;iter != from+int64_t(I.plane_size());++iter)
+            s += double(*iter)*double(*iter);
+        sum[size_t(z)] = s;
+    });
+    return I.empty() ? 0.0f : float(std::accumulate(sum.begin(),sum.end(),0.0)/double(I.size()));
+}
+
+// gradient scheme at one resolution level, stopped when the residual
+// has not improved by 0.1% in the last 5 iterations.
+// dis_map and residual return the field with the lowest residual
+template<typename image_type>
+size_t distortion_iterate(const image_type& v1,const image_type& v2,
+                          tipl::image<float,3>& dis_map,size_t max_iteration,float& residual)
+{
+    tipl::image<float,3> vv1,vv2,df,gx(v1.geometry()),v1_gx(v1.geometry()),v2_gx(v2.geometry()),best_map;
+    tipl::gradient(v1,v1_gx,1,0);
+    tipl::gradient(v2,v2_gx,1,0);
+    float best_residual = std::numeric_limits<float>::max();
+    float last_improved = best_residual;
+    size_t iter = 0,no_improvement = 0;
+    for(;iter < max_iteration;++iter)
+    {
+        apply_distortion_map2(v1,dis_map,vv1,true);
+        apply_distortion_map2(v2,dis_map,vv2,false);
+        df = vv1;
+        df -= vv2;
+        float cur_residual = mean_square(df);
+        if(cur_residual < best_residual)
+        {
+            best_residual = cur_residual;
+            best_map = dis_map;
+        }
+        if(cur_residual < last_improved*0.999f)
+        {
+            last_improved = cur_residual;
+            no_improvement = 0;
+        }
+        else
+            if(++no_improvement >= 5)
+                break;
+        vv1 += vv2;
+        df *= vv1;
+        tipl::gradient(df,gx,1,0);
+        gx += v1_gx;
+        gx -= v2_gx;
+        tipl::normalize_abs(gx,0.5f);
+        tipl::filter::gaussian(gx);
+        tipl::filter::gaussian(gx);
+        tipl::filter::gaussian(gx);
+        dis_map += gx;
+    }
+    if(!best_map.empty())
+    {
+        dis_map.swap(best_map);
+        residual = best_residual;
+    }
+    return iter;
+}
+
 bool ImageModel::distortion_correction(const char* filename)
 {
     tipl::image<float,3> v2;
@@ -1057,7 +1257,7 @@ bool ImageModel::distortion_correction(const char* filename)
         }
     }
 
-    tipl::image<float,3> v1,vv1,vv2;
+    tipl::image<float,3> v1;
     v1 = tipl::make_image(
         src_dwi_data[size_t(std::min_element(src_bvalues.begin(),src_bvalues.end())-src_bvalues.begin())],voxel.dim);
 
@@ -1079,37 +1279,49 @@ bool ImageModel::distortion_correction(const char* filename)
         }
     }
 
-    tipl::image<float,3> dis_map(v1.geometry()),df,gx(v1.geometry()),v1_gx(v1.geometry()),v2_gx(v2.geometry());
-
-
     tipl::filter::gaussian(v1);
     tipl::filter::gaussian(v2);
 
-    tipl::gradient(v1,v1_gx,1,0);
-    tipl::gradient(v2,v2_gx,1,0);
-
-    get_distortion_map(v2,v1,dis_map);
-    tipl::filter::gaussian(dis_map);
-    tipl::filter::gaussian(dis_map);
-
+    // image pyramid: the displacement is estimated at the coarsest level first,
+    // and each finer level starts from the upsampled field
+    std::vector<tipl::image<float,3> > pyramid1(1),pyramid2(1);
+    pyramid1[0].swap(v1);
+    pyramid2[0].swap(v2);
+    while(pyramid1.back().width() >= 64 && pyramid1.size() < 4)
+    {
+        pyramid1.push_back(tipl::image<float,3>());
+        pyramid2.push_back(tipl::image<float,3>());
+        tipl::downsample_with_padding(pyramid1[pyramid1.size()-2],pyramid1.back());
+        tipl::downsample_with_padding(pyramid2[pyramid2.size()-2],pyramid2.back());
+    }
 
-    for(int iter = 0;iter < 120;++iter)
+    tipl::image<float,3> dis_map;
+    for(int level = int(pyramid1.size())-1;level >= 0;--level)
     {
-        apply_distortion_map2(v1,dis_map,vv1,true);
-        apply_distortion_map2(v2,dis_map,vv2,false);
-        df = vv1;
-        df -= vv2;
-        vv1 += vv2;
-        df *= vv1;
-        tipl::gradient(df,gx,1,0);
-        gx += v1_gx;
-        gx -= v2_gx;
-        tipl::normalize_abs(gx,0.5f);
-        tipl::filter::gaussian(gx);
-        tipl::filter::gaussian(gx);
-        tipl::filter::gaussian(gx);
-        dis_map += gx;
+        ReconProfiler::scope profile(voxel.profiler,"distortion_correction_level"+std::to_string(level));
+        auto start = std::chrono::steady_clock::now();
+        const auto& l1 = pyramid1[size_t(level)];
+        const auto& l2 = pyramid2[size_t(level)];
+        if(dis_map.empty())
+        {
+            dis_map.resize(l1.geometry());
+            get_distortion_map(l2,l1,dis_map);
+            tipl::filter::gaussian(dis_map);
+            tipl::filter::gaussian(dis_map);
+        }
+        else
+        {
+            tipl::upsample_with_padding(dis_map,dis_map,l1.geometry());
+            dis_map *= 2.0f;
+        }
+        float residual = 0.0f;
+        size_t iterations = distortion_iterate(l1,l2,dis_map,120,residual);
+        std::cout << "distortion correction level " << level << " dim=" << l1.geometry()
+                  << " iterations=" << iterations << " residual=" << residual << " time="
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-start).count()
+                  << "ms" << std::endl;
     }
+    tipl::image<float,3> vv1;
 
     std::vector<tipl::image<unsigned short,3> > dwi(src_dwi_data.size());
     for(size_t i = 0;i < src_dwi_data.size();++i)
@@ -1325,6 +1537,7 @@ void save_idx(const char* file_name,std::shared_ptr<gz_istream> in)
 
 bool ImageModel::load_from_file(const char* dwi_file_name)
 {
+    ReconProfiler::scope profile(voxel.profiler,"load");
     file_name = dwi_file_name;
     if(!QFileInfo(dwi_file_name).exists())
     {
@@ -1393,6 +1606,8 @@ bool ImageModel::load_from_file(const char* dwi_file_name)
         return false;
     }
     save_idx(dwi_file_name,mat_reader.in);
+    if(!mat_reader.in->io_summary().empty())
+        std::cout << "file loading: " << mat_reader.in->io_summary() << std::endl;
 
 
     if (!mat_reader.read("dimension",voxel.dim))
@@ -1487,6 +1702,7 @@ bool ImageModel::load_from_file(const char* dwi_file_name)
 
 bool ImageModel::save_fib(const std::string& output_name)
 {
+    ReconProfiler::scope profile(voxel.profiler,"save_fib");
     prog_init p("saving ",std::filesystem::path(output_name).filename().string().c_str());
     gz_mat_write mat_writer(output_name.c_str());
     if(!mat_writer)
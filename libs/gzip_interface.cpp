@@ -1,11 +1,120 @@
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <stdexcept>
 #include <chrono>
+#include <sstream>
+#include <iostream>
+#include "mac_filesystem.hpp"
 #include <stdio.h>
 #include "gzip_interface.hpp"
 
 #define SPAN 8388608L       /* 8MB as the desired distance between access points */
 
 
+static void put_u32(std::vector<unsigned char>& buf,uint32_t value)
+{
+    for(int i = 0;i < 4;++i,value >>= 8)
+        buf.push_back(uint8_t(value & 0xFF));
+}
+static void put_u64(std::vector<unsigned char>& buf,uint64_t value)
+{
+    for(int i = 0;i < 8;++i,value >>= 8)
+        buf.push_back(uint8_t(value & 0xFF));
+}
+static uint64_t get_le(const unsigned char* buf,int size)
+{
+    uint64_t value = 0;
+    for(int i = size-1;i >= 0;--i)
+        value = (value << 8) | buf[i];
+    return value;
+}
+// compress data into one gzip member, optionally carrying a header extra field
+static bool deflate_member(const unsigned char* data,size_t size,std::vector<unsigned char>& out,
+                           std::vector<unsigned char> extra = std::vector<unsigned char>())
+{
+    z_stream strm;
+    strm.zalloc = nullptr;
+    strm.zfree = nullptr;
+    strm.opaque = nullptr;
+    if(deflateInit2(&strm,Z_DEFAULT_COMPRESSION,Z_DEFLATED,31,8,Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    gz_header header;
+    std::fill(reinterpret_cast<char*>(&header),reinterpret_cast<char*>(&header)+sizeof(header),0);
+    header.os = 255;
+    if(!extra.empty())
+    {
+        header.extra = &extra[0];
+        header.extra_len = uInt(extra.size());
+    }
+    deflateSetHeader(&strm,&header);
+    out.resize(deflateBound(&strm,uLong(size))+extra.size()+32);
+    strm.next_in = const_cast<unsigned char*>(data);
+    strm.avail_in = uInt(size);
+    strm.next_out = &out[0];
+    strm.avail_out = uInt(out.size());
+    int ret = deflate(&strm,Z_FINISH);
+    out.resize(out.size()-strm.avail_out);
+    deflateEnd(&strm);
+    return ret == Z_STREAM_END;
+}
+// decompress one gzip member of a known uncompressed size
+static bool inflate_member(const unsigned char* data,size_t size,unsigned char* out,size_t out_size)
+{
+    z_stream strm;
+    strm.zalloc = nullptr;
+    strm.zfree = nullptr;
+    strm.opaque = nullptr;
+    strm.avail_in = 0;
+    strm.next_in = nullptr;
+    if(inflateInit2(&strm,31) != Z_OK)
+        return false;
+    strm.next_in = const_cast<unsigned char*>(data);
+    strm.avail_in = uInt(size);
+    strm.next_out = out;
+    strm.avail_out = uInt(out_size);
+    int ret = inflate(&strm,Z_FINISH);
+    bool result = (ret == Z_STREAM_END && strm.avail_out == 0);
+    inflateEnd(&strm);
+    return result;
+}
+// read the extra field of an empty member written by deflate_member
+static bool read_member_extra(std::ifstream& in,uint64_t pos,std::vector<unsigned char>& extra,uint64_t& next_pos)
+{
+    unsigned char header[12];
+    in.clear();
+    in.seekg(int64_t(pos),std::ios::beg);
+    in.read(reinterpret_cast<char*>(header),12);
+    if(!in || header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || header[3] != 4) // FEXTRA only
+        return false;
+    extra.resize(get_le(header+10,2));
+    unsigned char body[2] = {0,0};
+    in.read(reinterpret_cast<char*>(&extra[0]),int64_t(extra.size()));
+    in.read(reinterpret_cast<char*>(body),2);
+    if(!in || body[0] != 3 || body[1] != 0) // empty deflate block
+        return false;
+    next_pos = pos+12+extra.size()+2+8;
+    return true;
+}
+// locate a subfield in a gzip extra field
+static const unsigned char* find_subfield(const std::vector<unsigned char>& extra,char si1,char si2,size_t& len)
+{
+    for(size_t i = 0;i+4 <= extra.size();i += 4+len)
+    {
+        len = get_le(&extra[i+2],2);
+        if(i+4+len > extra.size())
+            break;
+        if(extra[i] == si1 && extra[i+1] == si2)
+            return &extra[i+4];
+    }
+    return nullptr;
+}
+
+
 /* microseconds
  * time to inflate a full filebuf=300
  * time to start a thread= 50;   (can be 300)
@@ -79,6 +188,9 @@ void inflate_stream::output(void* buf,size_t len)
 bool gz_istream::open(const char* file_name)
 {
     prog_aborted_ = false;
+    gz_write_behind::instance().wait_for(file_name);
+    stats.bytes_read = stats.read_requests = stats.read_time = 0;
+    stats.bytes_inflated = stats.parallel_inflated = stats.stall_time = stats.inflate_time = 0;
     in.open(file_name,std::ios::binary);
     if(!in)
         return false;
@@ -100,15 +212,185 @@ bool gz_istream::open(const char* file_name)
             is_gz = true;
     }
 
+    // uncompressed files are read through the stream and seeked to with delay_read.
+    // They are not memory-mapped: matrix storage belongs to mat_read_base and cannot be a view into a mapping.
     if(!is_gz)
+    {
+        cur_uncompressed = 0;
         return in.good();
+    }
+
+    if(open_chunked())
+        return true;
 
-    file_buf.resize(file_size/size_t(WINSIZE)+1);
+    // an embedded index makes sampling and saving .idx unnecessary
+    if(load_embedded_index())
+        sample_access_point = false;
+
+    block_size = preferred_block_size;
+    prefetch_depth = 4;
+    file_buf.resize(file_size/block_size+1);
     file_buf_ready.resize(file_buf.size());
     initgz();
     return in.good();
 }
 
+bool gz_istream::random_access(const char* file_name)
+{
+    gz_istream probe;
+    // embedded access points are only loaded by open()
+    return probe.open(file_name) && (probe.chunked() || probe.has_access_points());
+}
+
+bool gz_istream::open_chunked(void)
+{
+    is_chunked = false;
+    chunk_uncompressed.clear();
+    chunk_compressed.clear();
+    std::vector<unsigned char> extra;
+    uint64_t pos = 0;
+    size_t len = 0;
+    const unsigned char* ptr = nullptr;
+    if(!read_member_extra(in,0,extra,pos) || !(ptr = find_subfield(extra,'D','C',len)) || len != 12 ||
+       get_le(ptr,4) != GZ_CHUNK_VERSION)
+    {
+        in.clear();
+        in.seekg(0,std::ios::beg);
+        return false;
+    }
+    uint64_t dir_pos = get_le(ptr+4,8);
+    for(pos = dir_pos;pos < file_size;)
+    {
+        if(!read_member_extra(in,pos,extra,pos) || !(ptr = find_subfield(extra,'D','I',len)))
+            break;
+        for(size_t i = 0;i+16 <= len;i += 16)
+        {
+            chunk_uncompressed.push_back(get_le(ptr+i,8));
+            chunk_compressed.push_back(get_le(ptr+i+8,8));
+        }
+    }
+    in.clear();
+    in.seekg(0,std::ios::beg);
+    // the last entry marks the end of data at the directory
+    if(chunk_compressed.empty() || chunk_compressed.back() != dir_pos ||
+       !std::is_sorted(chunk_uncompressed.begin(),chunk_uncompressed.end()) ||
+       !std::is_sorted(chunk_compressed.begin(),chunk_compressed.end()))
+    {
+        std::cout << "invalid chunk directory. read as a gzip stream" << std::endl;
+        chunk_uncompressed.clear();
+        chunk_compressed.clear();
+        return false;
+    }
+    is_chunked = true;
+    cur_uncompressed = 0;
+    cached_chunk = chunk_uncompressed.size();
+    return true;
+}
+
+bool gz_istream::load_embedded_index(void)
+{
+    if(file_size <= GZ_LOCATOR_SIZE)
+        return false;
+    std::vector<unsigned char> extra;
+    uint64_t pos = file_size-GZ_LOCATOR_SIZE;
+    size_t len = 0;
+    const unsigned char* ptr = nullptr;
+    bool result = false;
+    if(read_member_extra(in,pos,extra,pos) && pos == file_size &&
+       (ptr = find_subfield(extra,'D','L',len)) && len == 12)
+    {
+        size_t count = get_le(ptr,4);
+        uint64_t stream_end = get_le(ptr+4,8);
+        std::vector<std::shared_ptr<access_point> > new_points;
+        for(pos = stream_end;new_points.size() < count && pos < file_size-GZ_LOCATOR_SIZE;)
+        {
+            if(!read_member_extra(in,pos,extra,pos) || !(ptr = find_subfield(extra,'D','X',len)) || len != 16+WINSIZE)
+                break;
+            new_points.push_back(std::make_shared<access_point>(get_le(ptr+8,8),get_le(ptr,8),ptr+16));
+        }
+        if(new_points.size() == count)
+        {
+            for(auto p : new_points)
+                points[p->uncompressed_pos] = p;
+            // the deflate stream ends where the index begins
+            file_size = stream_end;
+            result = true;
+        }
+    }
+    in.clear();
+    in.seekg(0,std::ios::beg);
+    return result;
+}
+
+bool gz_istream::read_chunks(size_t from,size_t to,unsigned char* buf)
+{
+    std::vector<unsigned char> compressed_buf(chunk_compressed[to]-chunk_compressed[from]);
+    in.clear();
+    in.seekg(int64_t(chunk_compressed[from]),std::ios::beg);
+    in.read(reinterpret_cast<char*>(&compressed_buf[0]),int64_t(compressed_buf.size()));
+    if(!in)
+        return false;
+    std::atomic<bool> failed(false);
+    tipl::par_for2(to-from,[&](size_t i,size_t)
+    {
+        i += from;
+        if(!inflate_member(&compressed_buf[chunk_compressed[i]-chunk_compressed[from]],
+                           chunk_compressed[i+1]-chunk_compressed[i],
+                           buf+chunk_uncompressed[i]-chunk_uncompressed[from],
+                           chunk_uncompressed[i+1]-chunk_uncompressed[i]))
+            failed = true;
+    },thread_count);
+    return !failed;
+}
+
+bool gz_istream::read_chunked(void* buf_,size_t len)
+{
+    auto buf = reinterpret_cast<unsigned char*>(buf_);
+    size_t chunk_count = chunk_uncompressed.size()-1;
+    if(cur_uncompressed+len > chunk_uncompressed.back())
+        return false;
+    while(len)
+    {
+        if(prog_aborted())
+            return false;
+        size_t index = size_t(std::upper_bound(chunk_uncompressed.begin(),chunk_uncompressed.end(),cur_uncompressed)-
+                              chunk_uncompressed.begin())-1;
+        // whole chunks are inflated in parallel directly to the output, 64 chunks at a time
+        if(cur_uncompressed == chunk_uncompressed[index] && chunk_uncompressed[index+1]-cur_uncompressed <= len)
+        {
+            size_t to = index+1;
+            while(to < chunk_count && to-index < 64 && chunk_uncompressed[to+1]-cur_uncompressed <= len)
+                ++to;
+            size_t size = chunk_uncompressed[to]-cur_uncompressed;
+            if(!read_chunks(index,to,buf))
+                return false;
+            buf += size;
+            len -= size;
+            cur_uncompressed += size;
+            check_prog(cur_uncompressed*100/chunk_uncompressed.back(),100);
+            continue;
+        }
+        // partial chunk goes through the cache
+        if(cached_chunk != index)
+        {
+            cached_chunk_buf.resize(chunk_uncompressed[index+1]-chunk_uncompressed[index]);
+            if(!read_chunks(index,index+1,&cached_chunk_buf[0]))
+            {
+                cached_chunk = chunk_count;
+                return false;
+            }
+            cached_chunk = index;
+        }
+        size_t shift = cur_uncompressed-chunk_uncompressed[index];
+        size_t size = std::min<size_t>(len,cached_chunk_buf.size()-shift);
+        std::copy(cached_chunk_buf.begin()+int64_t(shift),cached_chunk_buf.begin()+int64_t(shift+size),buf);
+        buf += size;
+        len -= size;
+        cur_uncompressed += size;
+    }
+    return true;
+}
+
 void gz_istream::initgz(void)
 {
     cur_uncompressed = 0;
@@ -132,19 +414,24 @@ bool gz_istream::read_each_buf(size_t begin_index,size_t n)
 {
     size_t end_index = std::min<size_t>(file_buf.size(),begin_index+n);
 
-    if(in.tellg() != int64_t(begin_index)*int64_t(WINSIZE))
+    if(in.tellg() != int64_t(begin_index)*int64_t(block_size))
     {
         in.clear();
-        in.seekg(int64_t(begin_index)*int64_t(WINSIZE),std::ios::beg);
+        in.seekg(int64_t(begin_index)*int64_t(block_size),std::ios::beg);
     }
     if(!in)
         return false;
     for(; begin_index < end_index && !terminated && !!in; ++begin_index)
         if(!file_buf_ready[begin_index])
         {
-            std::vector<unsigned char> buf(WINSIZE);
-            in.read(reinterpret_cast<char*>(&buf[0]),WINSIZE);
-            if(in.gcount() != WINSIZE)
+            std::vector<unsigned char> buf(block_size);
+            auto start = std::chrono::steady_clock::now();
+            in.read(reinterpret_cast<char*>(&buf[0]),int64_t(block_size));
+            stats.read_time += uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                        std::chrono::steady_clock::now()-start).count());
+            ++stats.read_requests;
+            stats.bytes_read += uint64_t(in.gcount());
+            if(in.gcount() != int64_t(block_size))
                 buf.resize(size_t(in.gcount()));
             if(buf.empty())
                 return false;
@@ -153,10 +440,10 @@ bool gz_istream::read_each_buf(size_t begin_index,size_t n)
         }
         else
         {
-            int64_t jump_dis = WINSIZE;
+            int64_t jump_dis = int64_t(block_size);
             while(begin_index+1 < end_index && file_buf_ready[begin_index+1])
             {
-                jump_dis += WINSIZE;
+                jump_dis += int64_t(block_size);
                 ++begin_index;
             }
             in.seekg(jump_dis,std::ios::cur);
@@ -209,10 +496,18 @@ bool gz_istream::fetch(void)
 
     if(!file_buf_ready[cur_input_index])
     {
-        // avail_out: number of bytes to be uncompressed, >>16 = /WINSIZE/2
-        size_t num = buffer_all ? file_buf.size() : std::max<size_t>(4,istrm->size_to_extract() >> 16);
+        // read-ahead at least prefetch_depth buffers or half of the remaining output size, up to max_read_ahead
+        size_t num = buffer_all ? file_buf.size() : std::min<size_t>(max_read_ahead/block_size,
+                                    std::max<size_t>(prefetch_depth,istrm->size_to_extract()/block_size/2));
+        bool lagging = reading_buf;
+        auto start = std::chrono::steady_clock::now();
         if(!load_file_buf(num))
             return false;
+        stats.stall_time += uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now()-start).count());
+        // disk reading could not keep up, read further ahead next time
+        if(lagging && prefetch_depth*2*block_size <= max_read_ahead)
+            prefetch_depth *= 2;
     }
 
     if(free_on_read)
@@ -250,12 +545,17 @@ void gz_istream::flush(void)
 
 bool gz_istream::read(void* buf,size_t len)
 {
+    if(is_chunked)
+        return read_chunked(buf,len);
     if(!is_gz)
     {
         if(!good() || prog_aborted())
             return false;
-        in.read(reinterpret_cast<char*>(buf),uint32_t(len));
-        return true;
+        if(cur_uncompressed+len > file_size)
+            return false;
+        in.read(reinterpret_cast<char*>(buf),int64_t(len));
+        cur_uncompressed += len;
+        return !!in;
     }
 
     size_t max_readsize = WINSIZE << 10; // 32 MB
@@ -263,7 +563,8 @@ bool gz_istream::read(void* buf,size_t len)
     {
         if(!reading_buf)
         {
-            size_t num = buffer_all ? file_buf.size() : std::max<size_t>(4,len >> 16); // avail_out: number of bytes to be uncompressed, >>16 = /WINSIZE/2
+            size_t num = buffer_all ? file_buf.size() : std::min<size_t>(max_read_ahead/block_size,
+                                        std::max<size_t>(prefetch_depth,len/block_size/2));
             if(!load_file_buf(num))
                 return false;
         }
@@ -273,15 +574,17 @@ bool gz_istream::read(void* buf,size_t len)
         buf = reinterpret_cast<unsigned char *>(buf) + max_readsize;
     }
 
-    // consider multiple thread reading, at least 64x32K=2MB, has jump points
-    if(len > (WINSIZE << 6) && !sample_access_point && !points.empty())
+    // consider multiple thread reading, at least 64x32K=2MB, has jump points, and a thread to spare
+    if(len > (WINSIZE << 6) && !sample_access_point && !points.empty() &&
+       std::count_if(inflate_thread.begin(),inflate_thread.end(),[](const std::shared_ptr<std::future<void> >& each)
+            {return each->wait_for(std::chrono::seconds(0)) != std::future_status::ready;})+1 < int64_t(thread_count))
     {
         auto result = points.lower_bound(cur_uncompressed+len);
         if(result != points.end() && result->first > cur_uncompressed)
         {
             auto& point = result->second;
             size_t byte_to_skip = point->uncompressed_pos - cur_uncompressed; // this value is between 0 and len
-            size_t next_file_buf_index = point->compressed_pos/WINSIZE;
+            size_t next_file_buf_index = point->compressed_pos/block_size;
 
             // check if all file buffer are ready to be inflated
             bool data_ready = true;
@@ -297,6 +600,7 @@ bool gz_istream::read(void* buf,size_t len)
                 //std::cout << "MULTITHREAD GZ" << std::endl;
                 auto back_upstrm = istrm;
                 back_upstrm->output(buf,byte_to_skip);
+                stats.parallel_inflated += byte_to_skip;
                 size_t index = cur_input_index;
 
                 // start a new thread to inflate data
@@ -335,7 +639,9 @@ bool gz_istream::read(void* buf,size_t len)
     unsigned char *buf32k = nullptr;
 
     istrm->output(buf,len);
-
+    auto start = std::chrono::steady_clock::now();
+    auto stall_time = stats.stall_time;
+    size_t from_uncompressed = cur_uncompressed;
     do{
 
         if(istrm->empty() && !fetch())
@@ -369,6 +675,9 @@ bool gz_istream::read(void* buf,size_t len)
         }
 
     }while(istrm->size_to_extract());
+    stats.bytes_inflated += cur_uncompressed-from_uncompressed;
+    stats.inflate_time += uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                   std::chrono::steady_clock::now()-start).count())-(stats.stall_time-stall_time);
     if(buf32k)
         points[access_uncompressed] = std::make_shared<access_point>(access_uncompressed,access_compressed,buf32k);
     return true;
@@ -377,8 +686,8 @@ bool gz_istream::read(void* buf,size_t len)
 bool gz_istream::jump_to(std::shared_ptr<access_point> p)
 {
     istrm = std::make_shared<inflate_stream>(p);
-    cur_input_index = p->compressed_pos/WINSIZE;
-    cur_input_shift = p->compressed_pos%WINSIZE;
+    cur_input_index = p->compressed_pos/block_size;
+    cur_input_shift = p->compressed_pos%block_size;
     cur_uncompressed = p->uncompressed_pos;
     cur_compressed = p->compressed_pos;
     return true;
@@ -389,9 +698,20 @@ bool gz_istream::seek(size_t offset)
     if(offset == cur_uncompressed)
         return true;
 
+    if(is_chunked)
+    {
+        if(offset > chunk_uncompressed.back())
+            return false;
+        cur_uncompressed = offset;
+        return true;
+    }
+
     if(!is_gz)
     {
+        if(offset > file_size)
+            return false;
         in.seekg(int64_t(offset),std::ios::beg);
+        cur_uncompressed = offset;
         return !!in;
     }
 
@@ -415,8 +735,14 @@ bool gz_istream::seek(size_t offset)
                 return false;
         }
     }
-    std::vector<unsigned char> discard(offset-cur_uncompressed);
-    return read(&discard[0],discard.size());
+    // inflate and discard in pieces of at most 32 MB
+    std::vector<unsigned char> discard(std::min<size_t>(offset-cur_uncompressed,WINSIZE << 10));
+    while(cur_uncompressed < offset)
+        if(!read(&discard[0],std::min<size_t>(discard.size(),offset-cur_uncompressed)))
+            return false;
+    // parallel inflate threads may still write to the discarded data
+    flush();
+    return true;
 }
 bool gz_istream::load_index(const char* file_name)
 {
@@ -449,50 +775,448 @@ bool gz_istream::save_index(const char* file_name)
     }
     return true;
 }
+std::atomic<size_t> gz_istream::preferred_block_size(WINSIZE);
+unsigned int gz_istream::thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+
+void gz_istream::tune_block_size(void)
+{
+    if(stats.read_requests < 64)
+        return;
+    // disk time per 32KB: slow requests (e.g. network file systems) are amortized by larger blocks
+    double time_per_32k = double(stats.read_time)/double(stats.read_requests)*double(WINSIZE)/double(block_size);
+    if(time_per_32k > 500.0 && block_size < (WINSIZE << 5))
+        preferred_block_size = block_size*2;
+    if(time_per_32k < 50.0 && block_size > WINSIZE)
+        preferred_block_size = block_size/2;
+}
+
+std::string gz_istream::io_summary(void) const
+{
+    if(!is_gz || is_chunked)
+        return std::string();
+    std::ostringstream out;
+    uint64_t inflated = stats.bytes_inflated+stats.parallel_inflated;
+    out << "read " << (stats.bytes_read >> 20) << " MB in " << double(stats.read_time)/1000000.0 << " s"
+        << ", inflated " << (inflated >> 20) << " MB in " << double(stats.inflate_time)/1000000.0 << " s"
+        << " (" << (inflated ? stats.parallel_inflated*100/inflated : 0) << "% parallel)"
+        << ", stalled " << double(stats.stall_time)/1000000.0 << " s"
+        << ", block " << (block_size >> 10) << " KB x " << prefetch_depth
+        << (stats.stall_time > stats.inflate_time ? ": disk-bound" : ": cpu-bound");
+    return out.str();
+}
+
 void gz_istream::close(void)
 {
     if(is_gz)
     {
         flush();
         terminate_readfile_thread();
+        tune_block_size();
+        // reported at close to include the delayed reads
+        if(!io_report_name.empty() && !io_summary().empty())
+            std::cout << io_report_name << ": " << io_summary() << std::endl;
+        io_report_name.clear();
     }
     check_prog(0,0);
 }
 
 
 
+static bool sync_file(const std::string& file_name)
+{
+    #ifdef WIN32
+    HANDLE file = CreateFileA(file_name.c_str(),GENERIC_WRITE,FILE_SHARE_READ | FILE_SHARE_WRITE,nullptr,
+                              OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+    bool result = FlushFileBuffers(file);
+    CloseHandle(file);
+    return result;
+    #else
+    int fd = ::open(file_name.c_str(),O_RDONLY);
+    if(fd < 0)
+        return false;
+    bool result = (fsync(fd) == 0);
+    ::close(fd);
+    return result;
+    #endif
+}
+
+gz_write_behind& gz_write_behind::instance(void)
+{
+    static gz_write_behind writer;
+    return writer;
+}
+gz_write_behind::~gz_write_behind(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminated = true;
+        // streams never closed by their owner are finished with what has been queued
+        for(auto& each : streams)
+            each->closing = true;
+    }
+    cv.notify_all();
+    for(auto& each : writers)
+        each.join();
+}
+std::string gz_write_behind::canonical_path(const char* file_name)
+{
+    #ifndef __APPLE__
+    std::error_code ec;
+    auto path = std::filesystem::weakly_canonical(std::filesystem::path(file_name),ec);
+    return ec ? std::string(file_name) : path.string();
+    #else
+    QFileInfo info(file_name);
+    return (info.exists() ? info.canonicalFilePath() : info.absoluteFilePath()).toStdString();
+    #endif
+}
+std::shared_ptr<gz_write_behind::stream> gz_write_behind::open(const char* file_name)
+{
+    // a previous output to the same file has to finish first
+    wait_for(file_name);
+    auto s = std::make_shared<stream>();
+    s->out = std::make_shared<gz_ostream>();
+    s->file_name = file_name;
+    s->path = canonical_path(file_name);
+    if(!s->out->open_direct(file_name))
+        return nullptr;
+    std::lock_guard<std::mutex> lock(mutex);
+    streams.push_back(s);
+    if(writers.size() < max_writer_count && writers.size() < streams.size())
+        writers.push_back(std::thread([this](){run();}));
+    return s;
+}
+void gz_write_behind::run(void)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true)
+    {
+        // any stream with pending blocks, or a closed one to finish, that no other writer holds
+        std::shared_ptr<stream> s;
+        cv.wait(lock,[&]()
+        {
+            for(auto& each : streams)
+                if(!each->busy && (!each->queue.empty() || each->closing))
+                {
+                    s = each;
+                    return true;
+                }
+            return terminated && streams.empty();
+        });
+        if(!s)
+            break;
+        s->busy = true;
+        if(!s->queue.empty())
+        {
+            std::vector<char> buf;
+            buf.swap(s->queue.front());
+            s->queue.pop_front();
+            lock.unlock();
+            if(!s->failed)
+            {
+                try{
+                    s->out->write(&buf[0],buf.size());
+                    if(!s->out->good())
+                        s->failed = true;
+                }
+                catch(...)
+                {
+                    s->failed = true;
+                }
+            }
+            lock.lock();
+            queued_size -= buf.size();
+            s->busy = false;
+            cv.notify_all();
+            continue;
+        }
+        // closed and drained
+        lock.unlock();
+        s->out->close();
+        if(!s->failed && !sync_file(s->file_name))
+            s->failed = true;
+        if(s->failed)
+            std::cout << "ERROR: cannot write " << s->file_name
+                      << ". Please check write permission, directory, and disk space." << std::endl;
+        lock.lock();
+        if(s->failed)
+            failed_files.push_back(s->file_name);
+        streams.remove(s);
+        cv.notify_all();
+    }
+}
+bool gz_write_behind::write(std::shared_ptr<stream> s,std::vector<char>&& buf)
+{
+    if(buf.empty())
+        return !s->failed;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock,[&](){return s->failed || !queued_size || queued_size+buf.size() <= max_queued_size;});
+        if(s->failed)
+            return false;
+        queued_size += buf.size();
+        s->queue.push_back(std::move(buf));
+    }
+    cv.notify_all();
+    return true;
+}
+bool gz_write_behind::write(std::shared_ptr<stream> s,const void* buf,size_t size)
+{
+    // large outputs are copied a piece at a time as the queue drains,
+    // so that the copies never take more than max_queued_size
+    const size_t max_piece = std::max<size_t>(1,std::min<size_t>(max_queued_size/4,size_t(64) << 20));
+    auto ptr = reinterpret_cast<const char*>(buf);
+    do{
+        size_t piece = std::min(size,max_piece);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock,[&](){return s->failed || !queued_size || queued_size+piece <= max_queued_size;});
+            if(s->failed)
+                return false;
+        }
+        // copy outside the lock so that writers keep going
+        if(!write(s,std::vector<char>(ptr,ptr+piece)))
+            return false;
+        ptr += piece;
+        size -= piece;
+    }while(size);
+    return true;
+}
+void gz_write_behind::close(std::shared_ptr<stream> s)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        s->closing = true;
+    }
+    cv.notify_all();
+}
+void gz_write_behind::wait_for(const char* file_name)
+{
+    std::string path = canonical_path(file_name);
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock,[&](){return std::none_of(streams.begin(),streams.end(),
+                            [&](const std::shared_ptr<stream>& s){return s->path == path;});});
+}
+bool gz_write_behind::wait(std::string& error_msg)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock,[&](){return streams.empty();});
+    error_msg.clear();
+    for(const auto& each : failed_files)
+        error_msg += "cannot write " + each + ". Please check write permission, directory, and disk space.\n";
+    failed_files.clear();
+    return error_msg.empty();
+}
+
+size_t gz_ostream::chunk_size = 0;
+unsigned int gz_ostream::thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+
 bool gz_ostream::open(const char* file_name)
+{
+    if(gz_write_behind::instance().enabled)
+    {
+        behind = gz_write_behind::instance().open(file_name);
+        return behind.get();
+    }
+    return open_direct(file_name);
+}
+bool gz_ostream::open_direct(const char* file_name)
 {
     if(is_gz(file_name))
     {
-        handle = gzopen(file_name, "wb");
         std::string idx_name(file_name);
         idx_name += ".idx";
         if(std::ifstream(idx_name.c_str(),std::ios::binary))
             ::remove(idx_name.c_str());
+        if(chunk_size)
+        {
+            out.open(file_name,std::ios::binary);
+            if(!out)
+                return false;
+            is_chunked = true;
+            cur_chunk.clear();
+            pending_chunk.clear();
+            chunk_uncompressed.clear();
+            chunk_compressed.clear();
+            total_uncompressed = 0;
+            // the directory offset is updated at close
+            std::vector<unsigned char> extra{'D','C',12,0},header;
+            put_u32(extra,GZ_CHUNK_VERSION);
+            put_u64(extra,0);
+            if(!deflate_member(nullptr,0,header,extra))
+                return false;
+            out.write(reinterpret_cast<const char*>(&header[0]),int64_t(header.size()));
+            total_compressed = header.size();
+            return out.good();
+        }
+        handle = gzopen(file_name, "wb");
+        gz_file_name = file_name;
+        points.clear();
+        window.clear();
+        total_uncompressed = 0;
+        next_point = SPAN;
         return handle;
     }
     out.open(file_name,std::ios::binary);
     return out.good();
 }
+bool gz_ostream::write_pending_chunks(void)
+{
+    std::vector<std::vector<unsigned char> > compressed_chunk(pending_chunk.size());
+    std::vector<size_t> uncompressed_size(pending_chunk.size());
+    for(size_t i = 0;i < pending_chunk.size();++i)
+        uncompressed_size[i] = pending_chunk[i].size();
+    std::atomic<bool> failed(false);
+    tipl::par_for2(pending_chunk.size(),[&](size_t i,size_t)
+    {
+        if(!deflate_member(&pending_chunk[i][0],pending_chunk[i].size(),compressed_chunk[i]))
+            failed = true;
+        std::vector<unsigned char>().swap(pending_chunk[i]);
+    },thread_count);
+    for(size_t i = 0;i < compressed_chunk.size() && !failed;++i)
+    {
+        chunk_uncompressed.push_back(total_uncompressed);
+        chunk_compressed.push_back(total_compressed);
+        out.write(reinterpret_cast<const char*>(&compressed_chunk[i][0]),int64_t(compressed_chunk[i].size()));
+        total_uncompressed += uncompressed_size[i];
+        total_compressed += compressed_chunk[i].size();
+    }
+    pending_chunk.clear();
+    return !failed && out.good();
+}
+bool gz_ostream::close_chunked(void)
+{
+    if(!cur_chunk.empty())
+        pending_chunk.push_back(std::move(cur_chunk));
+    cur_chunk.clear();
+    bool result = write_pending_chunks();
+    // directory
+    uint64_t dir_pos = total_compressed;
+    chunk_uncompressed.push_back(total_uncompressed);
+    chunk_compressed.push_back(dir_pos);
+    for(size_t i = 0;i < chunk_uncompressed.size() && result;i += GZ_CHUNK_DIR_MAX)
+    {
+        size_t n = std::min<size_t>(GZ_CHUNK_DIR_MAX,chunk_uncompressed.size()-i);
+        std::vector<unsigned char> extra{'D','I'},member;
+        extra.push_back(uint8_t((n*16) & 0xFF));
+        extra.push_back(uint8_t((n*16) >> 8));
+        for(size_t j = i;j < i+n;++j)
+        {
+            put_u64(extra,chunk_uncompressed[j]);
+            put_u64(extra,chunk_compressed[j]);
+        }
+        if(!deflate_member(nullptr,0,member,extra))
+            result = false;
+        else
+            out.write(reinterpret_cast<const char*>(&member[0]),int64_t(member.size()));
+    }
+    // gzip header(10) + XLEN(2) + subfield id and length(4) + version(4)
+    std::vector<unsigned char> dir_pos_buf;
+    put_u64(dir_pos_buf,dir_pos);
+    out.seekp(20,std::ios::beg);
+    out.write(reinterpret_cast<const char*>(&dir_pos_buf[0]),8);
+    is_chunked = false;
+    return result && out.good();
+}
+bool gz_ostream::gz_write(const char* buf,size_t size)
+{
+    const size_t block_size = 104857600;// 100mb
+    while(size)
+    {
+        size_t n = std::min<size_t>(std::min<size_t>(size,block_size),next_point-total_uncompressed);
+        if(gzwrite(handle,buf,uint32_t(n)) <= 0)
+            return false;
+        // keep the preceding 32K as the dictionary of the next access point
+        if(n >= WINSIZE)
+            window.assign(buf+n-WINSIZE,buf+n);
+        else
+        {
+            window.insert(window.end(),buf,buf+n);
+            if(window.size() > WINSIZE)
+                window.erase(window.begin(),window.begin()+int64_t(window.size()-WINSIZE));
+        }
+        buf += n;
+        size -= n;
+        total_uncompressed += n;
+        if(total_uncompressed == next_point)
+        {
+            next_point += SPAN;
+            // a full flush ends the block at a byte boundary where inflate can resume
+            if(gzflush(handle,Z_FULL_FLUSH) != Z_OK)
+                return false;
+            auto compressed_pos = gzoffset(handle);
+            if(compressed_pos > 0 && (points.empty() || uint64_t(compressed_pos) > points.back()->compressed_pos))
+                points.push_back(std::make_shared<access_point>(total_uncompressed,uint64_t(compressed_pos),&window[0]));
+        }
+    }
+    return true;
+}
+bool gz_ostream::write_access_points(void)
+{
+    std::fstream index_out(gz_file_name.c_str(),std::ios::binary | std::ios::in | std::ios::out);
+    if(!index_out)
+        return false;
+    index_out.seekp(0,std::ios::end);
+    uint64_t stream_end = uint64_t(index_out.tellp());
+    std::vector<unsigned char> member;
+    for(auto p : points)
+    {
+        std::vector<unsigned char> extra{'D','X',uint8_t((16+WINSIZE) & 0xFF),uint8_t((16+WINSIZE) >> 8)};
+        put_u64(extra,p->compressed_pos);
+        put_u64(extra,p->uncompressed_pos);
+        extra.insert(extra.end(),p->dict32k,p->dict32k+WINSIZE);
+        if(!deflate_member(nullptr,0,member,extra))
+            return false;
+        index_out.write(reinterpret_cast<const char*>(&member[0]),int64_t(member.size()));
+    }
+    std::vector<unsigned char> extra{'D','L',12,0};
+    put_u32(extra,uint32_t(points.size()));
+    put_u64(extra,stream_end);
+    if(!deflate_member(nullptr,0,member,extra) || member.size() != GZ_LOCATOR_SIZE)
+        return false;
+    index_out.write(reinterpret_cast<const char*>(&member[0]),int64_t(member.size()));
+    return index_out.good();
+}
 void gz_ostream::write(const void* buf_,size_t size)
 {
+    if(behind)
+    {
+        if(!gz_write_behind::instance().write(behind,buf_,size))
+            throw std::runtime_error("Cannot output gz file");
+        return;
+    }
     const char* buf = reinterpret_cast<const char*>(buf_);
-    if(handle)
+    if(is_chunked)
     {
-        const size_t block_size = 104857600;// 100mb
-        while(size > block_size)
+        while(size)
         {
-            if(gzwrite(handle,buf,block_size) <= 0)
+            if(cur_chunk.empty())
+                cur_chunk.reserve(chunk_size);
+            size_t n = std::min<size_t>(size,chunk_size-cur_chunk.size());
+            cur_chunk.insert(cur_chunk.end(),buf,buf+n);
+            buf += n;
+            size -= n;
+            if(cur_chunk.size() == chunk_size)
             {
-                close();
-                throw std::runtime_error("Cannot output gz file");
+                pending_chunk.push_back(std::move(cur_chunk));
+                cur_chunk.clear();
+                if(pending_chunk.size() >= thread_count && !write_pending_chunks())
+                {
+                    close();
+                    throw std::runtime_error("Cannot output gz file");
+                }
             }
-            size -= block_size;
-            buf = buf + block_size;
         }
-        if(gzwrite(handle,buf,uint32_t(size)) <= 0)
+        return;
+    }
+    if(handle)
+    {
+        if(!gz_write(buf,size))
+        {
             close();
+            throw std::runtime_error("Cannot output gz file");
+        }
     }
     else
         if(out)
@@ -500,6 +1224,18 @@ void gz_ostream::write(const void* buf_,size_t size)
 }
 void gz_ostream::flush(void)
 {
+    if(behind)
+        return;
+    if(is_chunked)
+    {
+        // ends the current chunk early, chunk sizes are recorded in the directory
+        if(!cur_chunk.empty())
+            pending_chunk.push_back(std::move(cur_chunk));
+        cur_chunk.clear();
+        write_pending_chunks();
+        out.flush();
+        return;
+    }
     if(handle)
         gzflush(handle,Z_FULL_FLUSH);
     else
@@ -508,10 +1244,22 @@ void gz_ostream::flush(void)
 }
 void gz_ostream::close(void)
 {
+    if(behind)
+    {
+        // returns without waiting, the file is completed and synced in the background
+        gz_write_behind::instance().close(behind);
+        behind.reset();
+        return;
+    }
+    if(is_chunked && !close_chunked())
+        std::cout << "failed to write the chunk directory" << std::endl;
     if(handle)
     {
         gzclose(handle);
         handle = nullptr;
+        if(!points.empty() && !write_access_points())
+            std::cout << "failed to embed access points in " << gz_file_name << std::endl;
+        points.clear();
     }
     if(out)
         out.close();
@@ -8,6 +8,12 @@
 #include "tipl/tipl.hpp"
 #include "prog_interface_static_link.h"
 #include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
 
 #define WINSIZE 32768U      /* sliding window size */
 
@@ -62,10 +68,35 @@ public:
 };
 
 
+/*
+ * Embedded access points (plain gzip stream): the writer fully flushes every SPAN of data and
+ * appends one empty member per flush point after the stream
+ * access point   : empty member, extra subfield "DX" = compressed_pos(u64), uncompressed_pos(u64), dict32k
+ * locator        : last empty member, extra subfield "DL" = point count(u32), first point member offset(u64)
+ */
+#define GZ_LOCATOR_SIZE 38U
+/*
+ * Chunked container: a multi-member gzip file that still decompresses with any gzip tool.
+ * member 0       : empty member, extra subfield "DC" = version(u32), directory offset(u64)
+ * member 1...n   : data chunks, each an independent gzip member
+ * directory      : empty members, extra subfield "DI" = {uncompressed_pos(u64),compressed_pos(u64)}...
+ *                  the last entry marks the end of the data
+ */
+#define GZ_CHUNK_VERSION 1U
+#define GZ_CHUNK_DIR_MAX 4000U  /* directory entries per member, limited by the 64KB extra field */
+
 class gz_istream{
     std::ifstream in;
     std::shared_ptr<inflate_stream> istrm;
     bool is_gz = false;
+private: // chunked container
+    bool is_chunked = false;
+    std::vector<uint64_t> chunk_uncompressed,chunk_compressed;
+    size_t cached_chunk = 0;
+    std::vector<unsigned char> cached_chunk_buf;
+    bool open_chunked(void);
+    bool read_chunks(size_t from,size_t to,unsigned char* buf);
+    bool read_chunked(void* buf,size_t len);
 private:
     size_t file_size = 0;
     size_t cur_input_index = 0;
@@ -80,6 +111,12 @@ private:
     bool read_each_buf(size_t begin_index,size_t n);
 private:
     std::vector<std::shared_ptr<std::future<void> > > inflate_thread;
+private: // adaptive read-ahead
+    size_t block_size = WINSIZE;
+    size_t prefetch_depth = 4;
+    static constexpr size_t max_read_ahead = WINSIZE << 11; // 64 MB of compressed data
+    static std::atomic<size_t> preferred_block_size;
+    void tune_block_size(void);
 private:
     std::vector<std::vector<unsigned char> > file_buf;
     std::vector<bool> file_buf_ready;
@@ -90,6 +127,7 @@ private:
     std::map<uint64_t,std::shared_ptr<access_point>,std::greater<uint64_t> > points;
     std::vector<access_point> access;
     void initgz(void);
+    bool load_embedded_index(void);
     void terminate_readfile_thread(void);
     bool jump_to(std::shared_ptr<access_point> p);
 public:
@@ -99,6 +137,18 @@ public:
     bool load_index(const char* file_name);
     bool save_index(const char* file_name);
     bool has_access_points(void) const {return !points.empty();}
+    // threads inflating chunks or access point segments in parallel, the disk read-ahead thread is not counted
+    static unsigned int thread_count;
+public: // I/O telemetry, times in microseconds
+    struct io_stats{
+        std::atomic<uint64_t> bytes_read{0},read_requests{0},read_time{0}; // disk reads in all threads
+        uint64_t bytes_inflated = 0;       // inflated by the reading thread
+        uint64_t parallel_inflated = 0;    // handed to parallel inflate threads
+        uint64_t stall_time = 0;           // time inflate waited for disk
+        uint64_t inflate_time = 0;
+    } stats;
+    std::string io_summary(void) const;
+    std::string io_report_name; // if set, io_summary is printed with this name when the file is closed
 public:
     ~gz_istream(void){close();}
     bool open(const char* file_name);
@@ -113,15 +163,61 @@ public:
     }
     bool good(void) const
     {
-        return (is_gz ? cur_compressed+8 < file_size : in.good());
+        if(is_chunked)
+            return cur_uncompressed < chunk_uncompressed.back();
+        return (is_gz ? cur_compressed+8 < file_size : cur_uncompressed < file_size && in.good());
     }
+    bool chunked(void) const {return is_chunked;}
     operator bool() const	{return good();}
     bool operator!() const	{return !good();}
+public:
+    // open only the header of a file to see if it can be read at random locations without inflating from the start
+    static bool random_access(const char* file_name);
+};
+
+class gz_ostream;
+// write-behind output: data handed to gz_ostream are queued and written by a bounded pool of background writers
+class gz_write_behind{
+public:
+    struct stream{
+        std::shared_ptr<gz_ostream> out;
+        std::string file_name;
+        std::string path;   // canonical path used to match later reads and writes of the same file
+        std::deque<std::vector<char> > queue;
+        bool closing = false;
+        bool busy = false;  // a writer is working on it, which keeps the blocks of a file in order
+        std::atomic<bool> failed{false};
+    };
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t queued_size = 0;
+    std::list<std::shared_ptr<stream> > streams;
+    std::vector<std::thread> writers;
+    bool terminated = false;
+    std::vector<std::string> failed_files;
+    void run(void);
+    static std::string canonical_path(const char* file_name);
+public:
+    bool enabled = false;
+    size_t max_queued_size = size_t(512) << 20; // writers block when more than 512MB are pending
+    unsigned int max_writer_count = std::max<unsigned int>(1,std::min<unsigned int>(4,std::thread::hardware_concurrency()));
+public:
+    ~gz_write_behind(void);
+    static gz_write_behind& instance(void);
+    std::shared_ptr<stream> open(const char* file_name);
+    bool write(std::shared_ptr<stream> s,const void* buf,size_t size);
+    // takes the buffer without a copy
+    bool write(std::shared_ptr<stream> s,std::vector<char>&& buf);
+    void close(std::shared_ptr<stream> s);
+    void wait_for(const char* file_name);
+    bool wait(std::string& error_msg);
 };
 
 class gz_ostream{
     std::ofstream out;
     gzFile handle;
+    std::shared_ptr<gz_write_behind::stream> behind;
     bool is_gz(const char* file_name)
     {
         std::string filename = file_name;
@@ -132,6 +228,26 @@ class gz_ostream{
             return true;
         return false;
     }
+private: // chunked container
+    bool is_chunked = false;
+    std::vector<unsigned char> cur_chunk;
+    std::vector<std::vector<unsigned char> > pending_chunk;
+    std::vector<uint64_t> chunk_uncompressed,chunk_compressed;
+    uint64_t total_uncompressed = 0,total_compressed = 0;
+    bool write_pending_chunks(void);
+    bool close_chunked(void);
+private: // embedded access points
+    std::string gz_file_name;
+    std::vector<std::shared_ptr<access_point> > points;
+    std::vector<unsigned char> window;
+    uint64_t next_point = 0;
+    bool gz_write(const char* buf,size_t size);
+    bool write_access_points(void);
+public:
+    // chunk size (uncompressed) of the random-access container, 0 writes a plain gzip stream
+    static size_t chunk_size;
+    // threads deflating the chunks of the container, the write-behind threads are not counted
+    static unsigned int thread_count;
 public:
     gz_ostream(void):handle(nullptr){}
     ~gz_ostream(void)
@@ -140,10 +256,12 @@ public:
     }
 public:
     bool open(const char* file_name);
+    bool open_direct(const char* file_name);
     void write(const void* buf_,size_t size);
     void flush(void);
     void close(void);
-    bool good(void) const {return handle ? !gzeof(handle):out.good();}
+    bool good(void) const {return behind ? !behind->failed : (handle ? !gzeof(handle):out.good());}
+    bool chunked(void) const {return is_chunked;}
     operator bool() const	{return good();}
     bool operator!() const	{return !good();}
 
@@ -675,11 +675,17 @@ bool fib_data::load_from_file(const char* file_name)
 
     //  prepare idx file
     prepare_idx(file_name,mat_reader.in);
-    if(mat_reader.in->has_access_points())
+    // uncompressed files, chunked containers, and files with an embedded or .idx index can seek directly,
+    // so matrices are only read when used instead of buffering the whole file as prepare_idx sets.
+    // The stream is not opened yet, so its header is probed here.
+    if(!QString(file_name).endsWith(".gz") || mat_reader.in->has_access_points() ||
+       gz_istream::random_access(file_name))
     {
         mat_reader.delay_read = true;
         mat_reader.in->buffer_all = false;
     }
+    // the I/O summary is printed when the file is closed, after any delayed reads
+    mat_reader.in->io_report_name = "file loading";
     if (!mat_reader.load_from_file(file_name) || prog_aborted())
     {
         error_msg = prog_aborted() ? "Loading process aborted" : "Invalid file format";
@@ -1251,6 +1257,7 @@ bool fib_data::load_track_atlas()
                 tract_data[i][j+2] = p[2];
             }
         });
+        track_atlas->tracts_changed();
     }
     return true;
 }
@@ -1304,7 +1311,7 @@ unsigned int fib_data::find_nearest(const float* trk,unsigned int length,bool co
     if(length <= 6)
         return 9999;
     float best_distance = contain ? 50.0f : false_distance;
-    const auto& tract_data = track_atlas->get_tracts();
+    const auto& tract_data = std::as_const(*track_atlas).get_tracts();
     const auto& tract_cluster = track_atlas->get_cluster_info();
     size_t best_index = tract_data.size();
     if(contain)
@@ -1390,12 +1397,13 @@ bool fib_data::recognize(std::shared_ptr<TractModel>& trk,std::vector<unsigned i
 {
     if(!load_track_atlas())
         return false;
-    result.resize(trk->get_tracts().size());
-    tipl::par_for(trk->get_tracts().size(),[&](size_t i)
+    const auto& tract_data = std::as_const(*trk).get_tracts();
+    result.resize(tract_data.size());
+    tipl::par_for(tract_data.size(),[&](size_t i)
     {
-        if(trk->get_tracts()[i].empty())
+        if(tract_data[i].empty())
             return;
-        result[i] = find_nearest(&(trk->get_tracts()[i][0]),uint32_t(trk->get_tracts()[i].size()),false,tolerance);
+        result[i] = find_nearest(&(tract_data[i][0]),uint32_t(tract_data[i].size()),false,tolerance);
     });
     return true;
 }
@@ -1405,11 +1413,12 @@ bool fib_data::recognize(std::shared_ptr<TractModel>& trk,std::map<float,std::st
     if(!load_track_atlas())
         return false;
     std::vector<float> count(tractography_name_list.size());
-    tipl::par_for(trk->get_tracts().size(),[&](size_t i)
+    const auto& tract_data = std::as_const(*trk).get_tracts();
+    tipl::par_for(tract_data.size(),[&](size_t i)
     {
-        if(trk->get_tracts()[i].empty())
+        if(tract_data[i].empty())
             return;
-        unsigned int index = find_nearest(&(trk->get_tracts()[i][0]),uint32_t(trk->get_tracts()[i].size()),contain,50.0f);
+        unsigned int index = find_nearest(&(tract_data[i][0]),uint32_t(tract_data[i].size()),contain,50.0f);
         if(index < count.size())
             ++count[index];
     });
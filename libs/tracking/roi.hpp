@@ -38,6 +38,15 @@ public:
             roi_filter[uint16_t(new_point.x())][uint16_t(new_point.y())][uint16_t(new_point.z())] = 1;
         }
     }
+    float get_ratio(void) const{return ratio;}
+    void get_points(std::vector<tipl::vector<3,short> >& points) const
+    {
+        for(size_t x = 0;x < roi_filter.size();++x)
+            for(size_t y = 0;y < roi_filter[x].size();++y)
+                for(size_t z = 0;z < roi_filter[x][y].size();++z)
+                    if(roi_filter[x][y][z])
+                        points.push_back(tipl::vector<3,short>(short(x),short(y),short(z)));
+    }
     bool havePoint(float dx,float dy,float dz) const
     {
         short x,y,z;
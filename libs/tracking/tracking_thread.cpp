@@ -171,8 +171,9 @@ void ThreadData::apply_tip(TractModel* handle)
     if (param.tip_iteration == 0 || handle->get_visible_track_count() == 0)
         return;
     float max_length = 0.0f;
-    for(size_t i = 0;i < 20 && i < handle->get_tracts().size();++i)
-        max_length = std::max(max_length,float(handle->get_tracts()[i].size()));
+    const auto& tract_data = std::as_const(*handle).get_tracts();
+    for(size_t i = 0;i < 20 && i < tract_data.size();++i)
+        max_length = std::max(max_length,float(tract_data[i].size()));
     float t_index = float(handle->get_visible_track_count())*max_length/3.0f;
     if(t_index/float(roi_mgr->seeds.size()) > 20.0f || !trk->dt_threshold_name.empty())
         for(size_t i = 0;i < param.tip_iteration;++i)
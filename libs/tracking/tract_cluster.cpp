@@ -1,5 +1,15 @@
 #include <set>
+#include <random>
+#include <numeric>
+#include <unordered_map>
+#include <limits>
+#include <thread>
+#include <iostream>
 #include "tract_cluster.hpp"
+#include "prog_interface_static_link.h"
+#ifndef M_PI
+#define M_PI        3.14159265358979323846
+#endif
 #include "tipl/tipl.hpp"
 
 struct compare_cluster
@@ -191,3 +201,542 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
         }
     });
 }
+
+void TractFeatureClustering::add_tracts(const std::vector<std::vector<float> >& tracks)
+{
+    size_t from = tract_count,first = tract_index.size();
+    for(size_t i = 0;i < tracks.size();++i)
+        if(tracks[i].size() >= 3)
+            tract_index.push_back(uint32_t(from+i));
+    tract_count += tracks.size();
+    features.resize(tract_index.size()*feature_dim);
+    // start point, end point, mid point, and length
+    tipl::par_for(tract_index.size()-first,[&](size_t i)
+    {
+        const auto& t = tracks[tract_index[first+i]-from];
+        float* f = &features[(first+i)*feature_dim];
+        size_t count = t.size();
+        std::copy(t.begin(),t.begin()+3,f);
+        std::copy(t.end()-3,t.end(),f+3);
+        count >>= 1;
+        count -= count%3;
+        if(count < 3)
+            count = 3;
+        std::copy(t.begin()+int(count)-3,t.begin()+int(count),f+6);
+        f[9] = count;
+    });
+}
+
+float TractFeatureClustering::nearest(const float* f,unsigned int& label) const
+{
+    float best = std::numeric_limits<float>::max();
+    for(unsigned int c = 0;c < cluster_number;++c)
+    {
+        const float* m = &mean[c*feature_dim];
+        float d = 0.0f;
+        for(unsigned int k = 0;k < feature_dim && d < best;++k)
+            d += (f[k]-m[k])*(f[k]-m[k]);
+        if(d < best)
+        {
+            best = d;
+            label = c;
+        }
+    }
+    return best;
+}
+
+void TractFeatureClustering::seed_kmeans_pp(void)
+{
+    size_t n = tract_index.size();
+    std::vector<char> seeded(cluster_number);
+    std::vector<size_t> count(cluster_number);
+    mean.clear();
+    mean.resize(cluster_number*feature_dim);
+    // warm start: means of the previous clusters
+    if(warm_start.size() >= tract_count)
+    {
+        for(size_t i = 0;i < n;++i)
+        {
+            unsigned int c = warm_start[tract_index[i]];
+            if(c >= cluster_number)
+                continue;
+            ++count[c];
+            for(unsigned int k = 0;k < feature_dim;++k)
+                mean[c*feature_dim+k] += features[i*feature_dim+k];
+        }
+        for(unsigned int c = 0;c < cluster_number;++c)
+            if(count[c])
+            {
+                seeded[c] = 1;
+                for(unsigned int k = 0;k < feature_dim;++k)
+                    mean[c*feature_dim+k] /= float(count[c]);
+            }
+    }
+    // k-means++ for the rest, drawn from a subsample to keep seeding linear in the tract count
+    std::mt19937 gen(0);
+    std::vector<uint32_t> sample(n);
+    std::iota(sample.begin(),sample.end(),0);
+    if(n > std::max<size_t>(10000,cluster_number*10))
+    {
+        std::shuffle(sample.begin(),sample.end(),gen);
+        sample.resize(std::max<size_t>(10000,cluster_number*10));
+    }
+    std::vector<float> dis(sample.size(),std::numeric_limits<float>::max());
+    auto update_dis = [&](unsigned int c)
+    {
+        const float* m = &mean[c*feature_dim];
+        tipl::par_for(sample.size(),[&](size_t i)
+        {
+            const float* f = &features[sample[i]*feature_dim];
+            float d = 0.0f;
+            for(unsigned int k = 0;k < feature_dim;++k)
+                d += (f[k]-m[k])*(f[k]-m[k]);
+            dis[i] = std::min(dis[i],d);
+        });
+    };
+    for(unsigned int c = 0;c < cluster_number;++c)
+        if(seeded[c])
+            update_dis(c);
+    for(unsigned int c = 0;c < cluster_number;++c)
+    {
+        if(seeded[c])
+            continue;
+        size_t pick = gen()%sample.size();
+        double sum = std::accumulate(dis.begin(),dis.end(),0.0,[](double s,float d)
+                        {return d == std::numeric_limits<float>::max() ? s : s+double(d);});
+        if(sum > 0.0)
+        {
+            double r = std::uniform_real_distribution<double>(0.0,sum)(gen);
+            for(pick = 0;pick+1 < sample.size();++pick)
+                if(dis[pick] != std::numeric_limits<float>::max() && (r -= double(dis[pick])) <= 0.0)
+                    break;
+        }
+        std::copy(&features[sample[pick]*feature_dim],&features[sample[pick]*feature_dim]+feature_dim,&mean[c*feature_dim]);
+        update_dis(c);
+    }
+}
+
+void TractFeatureClustering::run_kmeans(void)
+{
+    // mini-batch k-means with per-center learning rates (Sculley 2010)
+    size_t n = tract_index.size();
+    size_t batch_size = std::min<size_t>(n,std::max<size_t>(1024,cluster_number*4));
+    std::vector<size_t> count(cluster_number);
+    std::vector<uint32_t> batch(batch_size);
+    std::vector<unsigned int> batch_label(batch_size);
+    std::vector<float> batch_dis(batch_size);
+    std::mt19937 gen(0);
+    float scale = 0.0f;// total feature variance used to normalize the center shift
+    {
+        std::vector<double> sum(feature_dim),sum2(feature_dim);
+        for(size_t i = 0;i < n;++i)
+            for(unsigned int k = 0;k < feature_dim;++k)
+            {
+                sum[k] += features[i*feature_dim+k];
+                sum2[k] += double(features[i*feature_dim+k])*features[i*feature_dim+k];
+            }
+        for(unsigned int k = 0;k < feature_dim;++k)
+            scale += float(sum2[k]/n-(sum[k]/n)*(sum[k]/n));
+        scale = std::max<float>(scale,std::numeric_limits<float>::epsilon());
+    }
+    size_t telemetry_from = telemetry.size();
+    for(unsigned int iter = 0;check_prog(iter,max_iteration);++iter)
+    {
+        for(auto& b : batch)
+            b = gen()%n;
+        tipl::par_for(batch_size,[&](size_t i)
+        {
+            batch_dis[i] = nearest(&features[batch[i]*feature_dim],batch_label[i]);
+        });
+        std::vector<float> previous_mean(mean);
+        for(size_t i = 0;i < batch_size;++i)
+        {
+            float* m = &mean[batch_label[i]*feature_dim];
+            const float* f = &features[batch[i]*feature_dim];
+            float eta = 1.0f/float(++count[batch_label[i]]);
+            for(unsigned int k = 0;k < feature_dim;++k)
+                m[k] += eta*(f[k]-m[k]);
+        }
+        float shift = 0.0f;
+        for(size_t j = 0;j < mean.size();++j)
+            shift += (mean[j]-previous_mean[j])*(mean[j]-previous_mean[j]);
+        telemetry.push_back(std::accumulate(batch_dis.begin(),batch_dis.end(),0.0f)/float(batch_size));
+        if(shift/float(cluster_number) < tolerance*scale)
+            break;
+    }
+    if(telemetry.size() > telemetry_from)
+        std::cout << "k-means: " << telemetry.size()-telemetry_from << " iterations, batch inertia: " << telemetry.back() << std::endl;
+    labels.resize(n);
+    tipl::par_for(n,[&](size_t i)
+    {
+        nearest(&features[i*feature_dim],labels[i]);
+    });
+}
+
+void TractFeatureClustering::run_em(void)
+{
+    // EM of a diagonal Gaussian mixture initialized by k-means
+    size_t n = tract_index.size();
+    unsigned int thread_count = std::thread::hardware_concurrency();
+    std::vector<float> variance(cluster_number*feature_dim),weight(cluster_number,1.0f/float(cluster_number));
+    std::vector<float> min_variance(feature_dim);
+    {
+        std::vector<double> sum(feature_dim),sum2(feature_dim);
+        for(size_t i = 0;i < n;++i)
+            for(unsigned int k = 0;k < feature_dim;++k)
+            {
+                sum[k] += features[i*feature_dim+k];
+                sum2[k] += double(features[i*feature_dim+k])*features[i*feature_dim+k];
+            }
+        for(unsigned int k = 0;k < feature_dim;++k)
+            min_variance[k] = std::max<float>(1.0e-3f*float(sum2[k]/n-(sum[k]/n)*(sum[k]/n)),1.0e-6f);
+        for(unsigned int c = 0;c < cluster_number;++c)
+            for(unsigned int k = 0;k < feature_dim;++k)
+                variance[c*feature_dim+k] = std::max<float>(float(sum2[k]/n-(sum[k]/n)*(sum[k]/n)),min_variance[k]);
+    }
+    size_t stat_size = cluster_number*(feature_dim*2+1);
+    std::vector<std::vector<double> > stat(thread_count);
+    std::vector<std::vector<float> > prob(thread_count,std::vector<float>(cluster_number));
+    std::vector<double> log_likelihood(thread_count);
+    double previous = 0.0;
+    size_t telemetry_from = telemetry.size();
+    for(unsigned int iter = 0;check_prog(iter,max_iteration);++iter)
+    {
+        std::vector<float> log_norm(cluster_number);
+        for(unsigned int c = 0;c < cluster_number;++c)
+        {
+            double s = std::log(std::max<float>(weight[c],std::numeric_limits<float>::min()));
+            for(unsigned int k = 0;k < feature_dim;++k)
+                s -= 0.5*std::log(2.0*M_PI*double(variance[c*feature_dim+k]));
+            log_norm[c] = float(s);
+        }
+        for(unsigned int t = 0;t < thread_count;++t)
+        {
+            stat[t].assign(stat_size,0.0);
+            log_likelihood[t] = 0.0;
+        }
+        // E-step and sufficient statistics in one parallel pass
+        tipl::par_for2(n,[&](size_t i,unsigned int thread)
+        {
+            const float* f = &features[i*feature_dim];
+            auto& p = prob[thread];
+            float max_p = -std::numeric_limits<float>::max();
+            for(unsigned int c = 0;c < cluster_number;++c)
+            {
+                const float* m = &mean[c*feature_dim];
+                const float* v = &variance[c*feature_dim];
+                float s = 0.0f;
+                for(unsigned int k = 0;k < feature_dim;++k)
+                    s += (f[k]-m[k])*(f[k]-m[k])/v[k];
+                p[c] = log_norm[c]-0.5f*s;
+                max_p = std::max(max_p,p[c]);
+            }
+            double sum = 0.0;
+            for(auto& each : p)
+                sum += double(each = std::exp(each-max_p));
+            log_likelihood[thread] += double(max_p)+std::log(sum);
+            auto& st = stat[thread];
+            for(unsigned int c = 0;c < cluster_number;++c)
+            {
+                double r = double(p[c])/sum;
+                if(r < 1.0e-8)
+                    continue;
+                double* s = &st[c*(feature_dim*2+1)];
+                s[0] += r;
+                for(unsigned int k = 0;k < feature_dim;++k)
+                {
+                    s[1+k] += r*double(f[k]);
+                    s[1+feature_dim+k] += r*double(f[k])*double(f[k]);
+                }
+            }
+        });
+        for(unsigned int t = 1;t < thread_count;++t)
+        {
+            for(size_t j = 0;j < stat_size;++j)
+                stat[0][j] += stat[t][j];
+            log_likelihood[0] += log_likelihood[t];
+        }
+        // M-step
+        for(unsigned int c = 0;c < cluster_number;++c)
+        {
+            const double* s = &stat[0][c*(feature_dim*2+1)];
+            weight[c] = float(s[0]/double(n));
+            if(s[0] < 1.0e-6)
+                continue;
+            for(unsigned int k = 0;k < feature_dim;++k)
+            {
+                double m = s[1+k]/s[0];
+                mean[c*feature_dim+k] = float(m);
+                variance[c*feature_dim+k] = std::max<float>(float(s[1+feature_dim+k]/s[0]-m*m),min_variance[k]);
+            }
+        }
+        telemetry.push_back(float(log_likelihood[0]/double(n)));
+        if(iter && std::fabs(log_likelihood[0]-previous) < double(tolerance)*std::fabs(previous))
+            break;
+        previous = log_likelihood[0];
+    }
+    if(telemetry.size() > telemetry_from)
+        std::cout << "EM: " << telemetry.size()-telemetry_from << " iterations, log-likelihood: " << telemetry.back() << std::endl;
+    // assign the most probable component
+    labels.resize(n);
+    tipl::par_for(n,[&](size_t i)
+    {
+        const float* f = &features[i*feature_dim];
+        float best = -std::numeric_limits<float>::max();
+        for(unsigned int c = 0;c < cluster_number;++c)
+        {
+            if(weight[c] <= 0.0f)
+                continue;
+            float s = std::log(weight[c]);
+            for(unsigned int k = 0;k < feature_dim;++k)
+            {
+                float v = variance[c*feature_dim+k];
+                s -= 0.5f*(std::log(v)+(f[k]-mean[c*feature_dim+k])*(f[k]-mean[c*feature_dim+k])/v);
+            }
+            if(s > best)
+            {
+                best = s;
+                labels[i] = c;
+            }
+        }
+    });
+}
+
+void TractFeatureClustering::run_clustering(void)
+{
+    telemetry.clear();
+    clusters.clear();
+    if(tract_index.empty())
+        return;
+    cluster_number = std::min<unsigned int>(cluster_number,uint32_t(tract_index.size()));
+    seed_kmeans_pp();
+    run_kmeans();
+    if(use_em)
+        run_em();
+    std::vector<std::vector<unsigned int> > cluster_map(cluster_number);
+    for(size_t i = 0;i < labels.size();++i)
+        cluster_map[labels[i]].push_back(tract_index[i]);
+    for(unsigned int c = 0;c < cluster_number;++c)
+        if(!cluster_map[c].empty())
+        {
+            clusters.push_back(std::make_shared<Cluster>());
+            clusters.back()->tracts.swap(cluster_map[c]);
+            clusters.back()->index = c;
+        }
+    sort_cluster();
+}
+
+QuickBundlesCluster::QuickBundlesCluster(const float* param):
+    threshold(param[0]),point_count(std::max<unsigned int>(2,uint32_t(param[1]))),order(uint8_t(param[2]))
+{
+}
+
+void QuickBundlesCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
+{
+    size_t from = tract_length.size();
+    size_t dim = point_count*3;
+    points.resize(points.size()+tracks.size()*dim);
+    tract_length.resize(tract_length.size()+tracks.size());
+    // resample each tract to equally spaced points along its length
+    tipl::par_for(tracks.size(),[&](size_t i)
+    {
+        const auto& t = tracks[i];
+        float* out = &points[(from+i)*dim];
+        // tracts without a point are marked by a negative length and left out of the clusters
+        if(t.size() < 3)
+        {
+            tract_length[from+i] = -1.0f;
+            return;
+        }
+        size_t n = t.size()/3;
+        std::vector<float> acc(n);
+        for(size_t j = 1;j < n;++j)
+            acc[j] = acc[j-1]+float((tipl::vector<3>(&t[j*3])-tipl::vector<3>(&t[j*3-3])).length());
+        tract_length[from+i] = acc.back();
+        for(size_t k = 0,j = 0;k < point_count;++k,out += 3)
+        {
+            float target = acc.back()*float(k)/float(point_count-1);
+            while(j+2 < n && acc[j+1] < target)
+                ++j;
+            if(n == 1 || acc[j+1] <= acc[j])
+            {
+                std::copy(&t[j*3],&t[j*3]+3,out);
+                continue;
+            }
+            float r = std::min<float>(1.0f,std::max<float>(0.0f,(target-acc[j])/(acc[j+1]-acc[j])));
+            for(size_t d = 0;d < 3;++d)
+                out[d] = t[j*3+d]*(1.0f-r)+t[j*3+3+d]*r;
+        }
+    });
+}
+
+void QuickBundlesCluster::run_clustering(void)
+{
+    clusters.clear();
+    if(!(threshold > 0.0f))
+        return;
+    size_t dim = point_count*3;
+    std::vector<uint32_t> sequence;
+    for(uint32_t i = 0;i < tract_length.size();++i)
+        if(tract_length[i] >= 0.0f)
+            sequence.push_back(i);
+    size_t tract_count = sequence.size();
+    if(order == 1)
+        std::stable_sort(sequence.begin(),sequence.end(),[&](uint32_t l,uint32_t r){return tract_length[l] > tract_length[r];});
+    if(order == 2)
+        std::shuffle(sequence.begin(),sequence.end(),std::mt19937(0));
+
+    // centroids and the grid of their mean points
+    std::vector<float> centroid,sum;
+    std::vector<uint32_t> count;
+    std::vector<int64_t> centroid_cell;
+    std::vector<std::vector<uint32_t> > members;
+    std::unordered_map<int64_t,std::vector<uint32_t> > grid;
+    auto cell_of = [&](const float* p,int dx,int dy,int dz)
+    {
+        float m[3] = {0.0f,0.0f,0.0f};
+        for(size_t k = 0;k < dim;k += 3)
+        {
+            m[0] += p[k];
+            m[1] += p[k+1];
+            m[2] += p[k+2];
+        }
+        int64_t x = int64_t(std::floor(m[0]/float(point_count)/threshold))+dx;
+        int64_t y = int64_t(std::floor(m[1]/float(point_count)/threshold))+dy;
+        int64_t z = int64_t(std::floor(m[2]/float(point_count)/threshold))+dz;
+        return ((x & 0x1FFFFF) << 42) | ((y & 0x1FFFFF) << 21) | (z & 0x1FFFFF);
+    };
+    // MDF between a tract and a centroid, returns false if not below the bound
+    auto mdf = [&](const float* t,const float* c,float bound,float& dis,bool& flip)
+    {
+        float direct = 0.0f,flipped = 0.0f,limit = bound*float(point_count);
+        for(size_t k = 0,r = dim-3;k < dim;k += 3,r -= 3)
+        {
+            direct += std::sqrt((t[k]-c[k])*(t[k]-c[k])+(t[k+1]-c[k+1])*(t[k+1]-c[k+1])+(t[k+2]-c[k+2])*(t[k+2]-c[k+2]));
+            flipped += std::sqrt((t[r]-c[k])*(t[r]-c[k])+(t[r+1]-c[k+1])*(t[r+1]-c[k+1])+(t[r+2]-c[k+2])*(t[r+2]-c[k+2]));
+            if(direct >= limit && flipped >= limit)
+                return false;
+        }
+        flip = flipped < direct;
+        dis = std::min(direct,flipped)/float(point_count);
+        return dis < bound;
+    };
+    // nearest centroid among those passing the filter
+    auto nearest = [&](const float* t,auto filter,uint32_t& best,float& best_dis,bool& best_flip)
+    {
+        for(int dz = -1;dz <= 1;++dz)
+            for(int dy = -1;dy <= 1;++dy)
+                for(int dx = -1;dx <= 1;++dx)
+                {
+                    auto iter = grid.find(cell_of(t,dx,dy,dz));
+                    if(iter == grid.end())
+                        continue;
+                    for(auto c : iter->second)
+                    {
+                        float dis;
+                        bool flip;
+                        if(filter(c) && mdf(t,&centroid[c*dim],best_dis,dis,flip) &&
+                           (dis < best_dis || (dis == best_dis && c < best)))
+                        {
+                            best = c;
+                            best_dis = dis;
+                            best_flip = flip;
+                        }
+                    }
+                }
+    };
+
+    // tracts are searched in parallel against the centroids at the start of each batch, and then
+    // assigned in order. The search result stays exact for the centroids not changed since, so only the
+    // changed ones are searched again, or all of them if the found centroid has changed.
+    // This gives the serial QuickBundles result independent of the thread count.
+    const size_t batch_size = 4096;
+    std::vector<uint32_t> best(batch_size);
+    std::vector<float> best_dis(batch_size);
+    std::vector<char> best_flip(batch_size);
+    std::vector<char> changed;
+    std::vector<uint32_t> changed_list;
+    auto all = [](uint32_t){return true;};
+    auto only_changed = [&](uint32_t c){return changed[c] != 0;};
+    for(size_t from = 0;from < tract_count;from += batch_size)
+    {
+        size_t to = std::min(tract_count,from+batch_size);
+        for(auto c : changed_list)
+            changed[c] = 0;
+        changed_list.clear();
+        tipl::par_for(to-from,[&](size_t i)
+        {
+            bool flip = false;
+            best[i] = uint32_t(-1);
+            best_dis[i] = threshold;
+            nearest(&points[sequence[from+i]*dim],all,best[i],best_dis[i],flip);
+            best_flip[i] = flip;
+        });
+        for(size_t i = 0;i < to-from;++i)
+        {
+            uint32_t tract = sequence[from+i];
+            const float* t = &points[tract*dim];
+            bool flip = best_flip[i];
+            if(best[i] != uint32_t(-1) && changed[best[i]])
+            {
+                best[i] = uint32_t(-1);
+                best_dis[i] = threshold;
+                nearest(t,all,best[i],best_dis[i],flip);
+            }
+            else
+            if(!changed_list.empty())
+                nearest(t,only_changed,best[i],best_dis[i],flip);
+            uint32_t c = best[i];
+            if(c == uint32_t(-1))
+            {
+                c = uint32_t(count.size());
+                count.push_back(0);
+                members.push_back(std::vector<uint32_t>());
+                sum.resize(sum.size()+dim);
+                centroid.resize(centroid.size()+dim);
+                centroid_cell.push_back(cell_of(t,0,0,0));
+                grid[centroid_cell.back()].push_back(c);
+                changed.push_back(0);
+                flip = false;
+            }
+            if(!changed[c])
+            {
+                changed[c] = 1;
+                changed_list.push_back(c);
+            }
+            float* s = &sum[c*dim];
+            if(flip)
+                for(size_t k = 0,r = dim-3;k < dim;k += 3,r -= 3)
+                {
+                    s[k] += t[r];
+                    s[k+1] += t[r+1];
+                    s[k+2] += t[r+2];
+                }
+            else
+                for(size_t k = 0;k < dim;++k)
+                    s[k] += t[k];
+            ++count[c];
+            members[c].push_back(tract);
+            float* cen = &centroid[c*dim];
+            for(size_t k = 0;k < dim;++k)
+                cen[k] = s[k]/float(count[c]);
+            // move the centroid in the grid if its mean point changes cell
+            int64_t cell = cell_of(cen,0,0,0);
+            if(cell != centroid_cell[c])
+            {
+                auto& old_cell = grid[centroid_cell[c]];
+                old_cell.erase(std::find(old_cell.begin(),old_cell.end(),c));
+                grid[cell].push_back(c);
+                centroid_cell[c] = cell;
+            }
+        }
+    }
+    clusters.resize(count.size());
+    for(size_t c = 0;c < count.size();++c)
+    {
+        clusters[c] = std::make_shared<Cluster>();
+        clusters[c]->tracts.swap(members[c]);
+        std::sort(clusters[c]->tracts.begin(),clusters[c]->tracts.end());
+    }
+    sort_cluster();
+}
@@ -32,59 +32,39 @@ public:
     }
 };
 
-template<class method_type>
-class FeatureBasedClutering : public BasicCluster
+/*
+ * Mini-batch k-means or parallel EM of a diagonal Gaussian mixture on the tract features
+ * (start point, end point, mid point, and length). Seeds by k-means++ or, as a warm start,
+ * by the means of a previous clustering. The objective of each iteration is kept in telemetry, only the final value is
+ * printed, and the run stops early
+ * if cancelled from the progress dialog.
+ */
+class TractFeatureClustering : public BasicCluster
 {
-    std::vector<std::vector<double> > features;
-    std::vector<unsigned char> classifications;
-    mutable std::vector<unsigned int> result;
-    method_type clustering_method;
     unsigned int cluster_number;
+    bool use_em;
+private:
+    static const unsigned int feature_dim = 10;
+    std::vector<float> features;
+    std::vector<unsigned int> tract_index;
+    size_t tract_count = 0;
+    std::vector<float> mean;
+    std::vector<unsigned int> labels;
+    void seed_kmeans_pp(void);
+    void run_kmeans(void);
+    void run_em(void);
+    float nearest(const float* f,unsigned int& label) const;
 public:
-    FeatureBasedClutering(const float* param):clustering_method(param[0]),cluster_number(param[0]){}
-    virtual ~FeatureBasedClutering(void) {}
-
+    unsigned int max_iteration = 200;
+    float tolerance = 1.0e-4f;
+    std::vector<unsigned int> warm_start;// previous label of each tract, >= cluster count if none
+    std::vector<float> telemetry;// inertia (k-means) or log-likelihood per tract (EM)
 public:
-    virtual void add_tracts(const std::vector<std::vector<float> >& tracks)
-    {
-        for(int i = 0;i < tracks.size();++i)
-            if(!tracks[i].empty())
-            {
-                const float* points = &tracks[i][0];
-                unsigned int count = tracks[i].size();
-                std::vector<double> feature(10);
-                std::copy(points,points+3,feature.begin());
-                std::copy(points+count-3,points+count,feature.begin()+3);
-                count >>= 1;
-                count -= count%3;
-                std::copy(points+count-3,points+count,feature.begin()+6);
-                feature.back() = count;
-                features.push_back(feature);
-            }
-    }
-    virtual void run_clustering(void)
-    {
-        classifications.resize(features.size());
-        clustering_method(features.begin(),features.end(),10,classifications.begin());
-        std::map<unsigned char,std::vector<unsigned int> > cluster_map;
-        for (unsigned int index = 0;index < classifications.size();++index)
-            cluster_map[classifications[index]].push_back(index);
-		clusters.resize(cluster_map.size());
-                std::map<unsigned char,std::vector<unsigned int> >::iterator iter = cluster_map.begin();
-                std::map<unsigned char,std::vector<unsigned int> >::iterator end = cluster_map.end();
-                for(unsigned int index = 0;iter != end;++iter,++index)
-		{
-            clusters[index] = std::make_shared<Cluster>();
-			clusters[index]->tracts.swap(iter->second);
-			clusters[index]->index= index;
-		}
-		sort_cluster();
-    }
-
+    TractFeatureClustering(const float* param):cluster_number(std::max<unsigned int>(1,uint32_t(param[0]))),use_em(param[1] != 0.0f){}
+    void add_tracts(const std::vector<std::vector<float> >& tracks);
+    void run_clustering(void);
 };
 
-
-
 class TractCluster : public BasicCluster
 {
     tipl::geometry<3> dim;
@@ -115,7 +95,25 @@ public:
 
 };
 
-
-
+/*
+ * QuickBundles: tracts resampled to point_count points join the nearest centroid within the
+ * minimum average direct-flip (MDF) distance, or start a new cluster. Centroids are indexed by
+ * the mean of their points, which differs from that of a tract by no more than their MDF.
+ * Tracts without a point are not assigned to any cluster.
+ * order 0: input order 1: longest first 2: shuffled with a fixed seed
+ */
+class QuickBundlesCluster : public BasicCluster
+{
+    float threshold;
+    unsigned int point_count;
+    unsigned char order;
+private:
+    std::vector<float> points;// point_count*3 for each tract
+    std::vector<float> tract_length;
+public:
+    QuickBundlesCluster(const float* param);
+    void add_tracts(const std::vector<std::vector<float> >& tracks);
+    void run_clustering(void);
+};
 
 #endif//TRACT_CLUSTER_HPP
@@ -2,6 +2,7 @@
 #include <QString>
 #include <QFileInfo>
 #include <QImage>
+#include <QDir>
 #include <fstream>
 #include "mac_filesystem.hpp"
 #include <sstream>
@@ -10,6 +11,14 @@
 #include <set>
 #include <map>
 #include <cmath>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <numeric>
+#include <list>
+#include <mutex>
+#include <queue>
 #include "roi.hpp"
 #include "tract_model.hpp"
 #include "prog_interface_static_link.h"
@@ -46,6 +55,136 @@ void smoothed_tracks(const std::vector<float>& track,std::vector<float>& smoothe
     }
 }
 
+/* spatial sidecar index (<tract file>.sidx.gz) of a tt.gz file
+ * track_chunk  : copy of the chunk table, used to check that the index matches the tract file
+ * dimension    : image dimension of the tracts
+ * block_size   : edge length of the coarse blocks in voxels
+ * block_offset : start of each block's chunk list in block_chunk, plus an end entry
+ * block_chunk  : chunks having tract points in the block
+ */
+struct TractSpatialIndex{
+    static const int block_size = 8;
+    static std::string file_name(const char* tract_file)
+    {
+        return std::string(tract_file)+".sidx.gz";
+    }
+    static void remove(const char* tract_file)
+    {
+        if(std::filesystem::exists(file_name(tract_file)))
+            std::filesystem::remove(file_name(tract_file));
+    }
+    static tipl::geometry<3> block_geo(const tipl::geometry<3>& geo)
+    {
+        return tipl::geometry<3>((geo[0]+block_size-1)/block_size,
+                                 (geo[1]+block_size-1)/block_size,
+                                 (geo[2]+block_size-1)/block_size);
+    }
+    static size_t block_index(float x,float y,float z,const tipl::geometry<3>& bgeo)
+    {
+        int bx = std::clamp<int>(int(std::round(x))/block_size,0,int(bgeo[0])-1);
+        int by = std::clamp<int>(int(std::round(y))/block_size,0,int(bgeo[1])-1);
+        int bz = std::clamp<int>(int(std::round(z))/block_size,0,int(bgeo[2])-1);
+        return size_t(bx)+size_t(bgeo[0])*(size_t(by)+size_t(bgeo[1])*size_t(bz));
+    }
+    static void add_blocks(const std::vector<float>& tract,const tipl::geometry<3>& bgeo,std::vector<uint32_t>& blocks)
+    {
+        for(size_t j = 0;j+2 < tract.size();j += 3)
+            blocks.push_back(uint32_t(block_index(tract[j],tract[j+1],tract[j+2],bgeo)));
+    }
+    static void unique(std::vector<uint32_t>& blocks)
+    {
+        std::sort(blocks.begin(),blocks.end());
+        blocks.erase(std::unique(blocks.begin(),blocks.end()),blocks.end());
+    }
+    static void block_range(float from,float to,int block_count,int& begin,int& end)
+    {
+        // points round to a voxel before finding their block, which stays within [floor(from),ceil(to)]
+        begin = std::clamp<int>(int(std::floor(std::floor(from)/float(block_size))),0,block_count-1);
+        end = std::clamp<int>(int(std::floor(std::ceil(to)/float(block_size))),0,block_count-1)+1;
+    }
+    // mark the blocks overlapped by a box, rounded outward so that every block in between is included
+    static void add_box(const tipl::vector<3>& from,const tipl::vector<3>& to,
+                        const tipl::geometry<3>& bgeo,std::vector<char>& block_hit)
+    {
+        int begin[3],end[3];
+        for(int d = 0;d < 3;++d)
+            block_range(from[d],to[d],int(bgeo[d]),begin[d],end[d]);
+        for(int z = begin[2];z < end[2];++z)
+            for(int y = begin[1];y < end[1];++y)
+                for(int x = begin[0];x < end[0];++x)
+                    block_hit[size_t(x)+size_t(bgeo[0])*(size_t(y)+size_t(bgeo[1])*size_t(z))] = 1;
+    }
+    static void build(const tipl::geometry<3>& bgeo,
+                      const std::vector<std::vector<uint32_t> >& chunk_blocks,
+                      std::vector<uint32_t>& block_offset,std::vector<uint32_t>& block_chunk)
+    {
+        block_offset.assign(bgeo.size()+1,0);
+        for(const auto& blocks : chunk_blocks)
+            for(auto b : blocks)
+                ++block_offset[b+1];
+        for(size_t i = 1;i < block_offset.size();++i)
+            block_offset[i] += block_offset[i-1];
+        block_chunk.resize(block_offset.back());
+        std::vector<uint32_t> pos(block_offset.begin(),block_offset.end()-1);
+        for(size_t c = 0;c < chunk_blocks.size();++c)
+            for(auto b : chunk_blocks[c])
+                block_chunk[pos[b]++] = uint32_t(c);
+    }
+    static bool save(const char* tract_file,const tipl::geometry<3>& geo,
+                     const std::vector<uint32_t>& chunk_info,
+                     const std::vector<std::vector<uint32_t> >& chunk_blocks)
+    {
+        auto bgeo = block_geo(geo);
+        if(!bgeo.size() || chunk_info.empty())
+            return false;
+        std::vector<uint32_t> block_offset,block_chunk;
+        build(bgeo,chunk_blocks,block_offset,block_chunk);
+        gz_mat_write out(file_name(tract_file).c_str());
+        if(!out)
+            return false;
+        uint32_t bs = block_size;
+        out.write("track_chunk",&chunk_info[0],3,uint32_t(chunk_info.size()/3));
+        out.write("dimension",geo);
+        out.write("block_size",&bs,1,1);
+        out.write("block_offset",&block_offset[0],1,uint32_t(block_offset.size()));
+        if(!block_chunk.empty())
+            out.write("block_chunk",&block_chunk[0],1,uint32_t(block_chunk.size()));
+        return true;
+    }
+    // an existing sidecar is kept only if it indexes exactly the chunks just written
+    static void remove_if_stale(const char* tract_file,const tipl::geometry<3>& geo,
+                                const std::vector<uint32_t>& chunk_info,
+                                const std::vector<std::vector<uint32_t> >& chunk_blocks)
+    {
+        if(!std::filesystem::exists(file_name(tract_file)))
+            return;
+        auto bgeo = block_geo(geo);
+        std::vector<uint32_t> block_offset,block_chunk;
+        build(bgeo,chunk_blocks,block_offset,block_chunk);
+        bool matched = false;
+        {
+            gz_mat_read in;
+            tipl::geometry<3> index_geo;
+            unsigned int row = 0,col = 0;
+            const unsigned int *index_chunk_info = nullptr,*bs = nullptr,*index_offset = nullptr,*index_chunk = nullptr;
+            if(in.load_from_file(file_name(tract_file).c_str()))
+            {
+                in.read("dimension",index_geo);
+                matched = index_geo[0] == geo[0] && index_geo[1] == geo[1] && index_geo[2] == geo[2] &&
+                    in.read("track_chunk",row,col,index_chunk_info) && size_t(row)*col == chunk_info.size() &&
+                    std::equal(chunk_info.begin(),chunk_info.end(),index_chunk_info) &&
+                    in.read("block_size",row,col,bs) && *bs == block_size &&
+                    in.read("block_offset",row,col,index_offset) && size_t(row)*col == block_offset.size() &&
+                    std::equal(block_offset.begin(),block_offset.end(),index_offset) &&
+                    (block_chunk.empty() || (in.read("block_chunk",row,col,index_chunk) && size_t(row)*col == block_chunk.size() &&
+                                             std::equal(block_chunk.begin(),block_chunk.end(),index_chunk)));
+            }
+        }
+        if(!matched)
+            remove(tract_file);
+    }
+};
+
 /* 1. spatial resolution of 1/32 voxel spacing.
  * 2. step size between (-127/32 to 128/32) voxels for x,y,z, direction
  */
@@ -62,6 +201,157 @@ class TinyTrack{
     };
 
     public:
+    /* version 2 groups tracts into chunks that are encoded and decoded independently
+     * track_chunk  : block index, byte offset in the block, and tract count of each chunk
+     * track_v2_<n> : blocks of chunks, each chunk stores
+     *                point counts (uint32 x n), first coordinates (int32 x 3n),
+     *                and then for each tract its x, y, and z displacements (int8)
+     */
+    static const size_t tracts_per_chunk = 4096;
+    static void encode_chunk(const std::vector<std::vector<int32_t> >& track32,size_t from,size_t n,char* out)
+    {
+        for(size_t i = 0;i < n;++i,out += 4)
+        {
+            uint32_t count = uint32_t(track32[from+i].size());
+            std::memcpy(out,&count,4);
+        }
+        for(size_t i = 0;i < n;++i,out += 12)
+            std::memcpy(out,&track32[from+i][0],12);
+        for(size_t i = 0;i < n;++i)
+        {
+            const auto& t32 = track32[from+i];
+            size_t step = t32.size()/3-1;
+            for(size_t dim = 0;dim < 3;++dim,out += step)
+                for(size_t j = 0,pos = dim+3;j < step;++j,pos += 3)
+                    out[j] = char(t32[pos]);
+        }
+    }
+    static bool decode_chunk(const char* buf,size_t buf_size,size_t n,std::vector<std::vector<float> >& tract_data,size_t to)
+    {
+        if(n*16 > buf_size)
+            return false;
+        const char* deltas = buf+n*16;
+        std::vector<int32_t> sum;
+        for(size_t i = 0;i < n;++i)
+        {
+            uint32_t count;
+            int32_t first[3];
+            std::memcpy(&count,buf+i*4,4);
+            std::memcpy(first,buf+n*4+i*12,12);
+            size_t step = count/3;
+            if(!step || size_t(deltas-buf)+(step-1)*3 > buf_size)
+                return false;
+            auto& cur_tract = tract_data[to+i];
+            cur_tract.resize(step*3);
+            sum.resize(step);
+            for(size_t dim = 0;dim < 3;++dim,deltas += step-1)
+            {
+                sum[0] = first[dim];
+                for(size_t j = 1;j < step;++j)
+                    sum[j] = sum[j-1]+deltas[j-1];
+                for(size_t j = 0,pos = dim;j < step;++j,pos += 3)
+                    cur_tract[pos] = std::ldexp(float(sum[j]),-5);
+            }
+        }
+        return true;
+    }
+    // version 1 stores tracts back to back, each led by a tract_header, in blocks named track, track1, track2...
+    static std::string block_name(size_t block)
+    {
+        return block ? std::string("track")+std::to_string(block) : std::string("track");
+    }
+    static void encode_tract(const std::vector<int32_t>& t32,char* out)
+    {
+        tract_header hr;
+        hr.h.count = uint32_t(t32.size());
+        hr.h.x = t32[0];
+        hr.h.y = t32[1];
+        hr.h.z = t32[2];
+        std::copy(hr.buf,hr.buf+16,out);
+        out += sizeof(tract_header)-3;
+        for(size_t j = 3;j < t32.size();j++)
+            out[j] = char(t32[j]);
+    }
+    static void scan_block(const char* track_buf,size_t buf_size,std::vector<size_t>& pos)
+    {
+        for(size_t i = 0;i < buf_size;)
+        {
+            pos.push_back(i);
+            i += *reinterpret_cast<const uint32_t*>(track_buf+i);
+            i += sizeof(tract_header)-3;
+        }
+    }
+    static void decode_tract(const char* track_buf,size_t buf_size,size_t pos,std::vector<float>& cur_tract)
+    {
+        tract_header hr;
+        std::copy(track_buf+pos,track_buf+pos+16,hr.buf);
+        if(hr.h.count > buf_size)
+            return;
+        cur_tract.resize(hr.h.count);
+        cur_tract[0] = hr.h.x;
+        cur_tract[1] = hr.h.y;
+        cur_tract[2] = hr.h.z;
+        size_t shift = pos+sizeof(tract_header)-3;
+        for(size_t j = 3;j < cur_tract.size();++j)
+            cur_tract[j] = (cur_tract[j-3] + track_buf[shift+j]);
+        for(size_t j = 0;j < cur_tract.size();++j)
+            cur_tract[j] = std::ldexp(cur_tract[j],-5);
+    }
+    // coordinates in 1/32 voxel, followed by the displacements that fit in int8
+    static void to_track32(const std::vector<float>& tract,std::vector<int32_t>& t32)
+    {
+        t32.resize(tract.size());
+        // all coordinates multiply by 32 and convert to integer
+        for(size_t j = 0;j < t32.size();j++)
+            t32[j] = int(std::round(std::ldexp(tract[j],5)));
+        // Calculate coordinate displacement, skipping the first coordinate
+        for(size_t j = t32.size()-1;j >= 3;j--)
+            t32[j] -= t32[j-3];
+
+        // check if there is a leap, skipping the first coordinate
+        bool has_leap = false;
+        for(size_t j = 3;j < t32.size();j++)
+            if(t32[j] < -127 || t32[j] > 127)
+            {
+                has_leap = true;
+                break;
+            }
+        // if there is a leap, interpolate it
+        if(has_leap)
+        {
+            std::vector<int32_t> new_t32;
+            new_t32.reserve(t32.size());
+            for(size_t j = 0;j < t32.size();j += 3)
+            {
+                int32_t x = t32[j];
+                int32_t y = t32[j+1];
+                int32_t z = t32[j+2];
+                bool interpolated = false;
+                while(j && (x < -127 || x > 127 || y < -127 || y > 127 || z < -127 || z > 127))
+                {
+                    x /= 2;
+                    y /= 2;
+                    z /= 2;
+                    interpolated = true;
+                }
+                if(interpolated)
+                {
+                    t32[j] -= x;
+                    t32[j+1] -= y;
+                    t32[j+2] -= z;
+                    j -= 3;
+                }
+                new_t32.push_back(x);
+                new_t32.push_back(y);
+                new_t32.push_back(z);
+            }
+            new_t32.swap(t32);
+        }
+    }
+    static size_t encoded_size(const std::vector<int32_t>& t32)
+    {
+        return sizeof(tract_header)+t32.size()-3;
+    }
     static bool save_to_file(const char* file_name,
                              tipl::geometry<3> geo,
                              tipl::vector<3> vs,
@@ -93,91 +383,86 @@ class TinyTrack{
         {
             if(id == 0)
                 check_prog(i,tract_data.size());
-            auto& t32 = track32[i];
-            t32.resize(tract_data[i].size());
-            // all coordinates multiply by 32 and convert to integer
-            for(size_t j = 0;j < t32.size();j++)
-                t32[j] = int(std::round(std::ldexp(tract_data[i][j],5)));
-            // Calculate coordinate displacement, skipping the first coordinate
-            for(size_t j = t32.size()-1;j >= 3;j--)
-                t32[j] -= t32[j-3];
-
-            // check if there is a leap, skipping the first coordinate
-            bool has_leap = false;
-            for(size_t j = 3;j < t32.size();j++)
-                if(t32[j] < -127 || t32[j] > 127)
-                {
-                    has_leap = true;
-                    break;
-                }
-            // if there is a leap, interpolate it
-            if(has_leap)
+            to_track32(tract_data[i],track32[i]);
+            buf_size[i] = encoded_size(track32[i]);
+        });
+        set_title((std::string("saving to ")+std::filesystem::path(file_name).filename().string()).c_str());
+
+        if(!TractModel::chunked_tt)
+        {
+            for(size_t block = 0,cur_track_block = 0;check_prog(cur_track_block,track32.size());++block)
             {
-                std::vector<int32_t> new_t32;
-                new_t32.reserve(t32.size());
-                for(size_t j = 0;j < t32.size();j += 3)
+                // record write position for each track
+                size_t total_size = 0;
+                std::vector<size_t> pos;
+                for(size_t i = cur_track_block;i < track32.size();++i)
                 {
-                    int32_t x = t32[j];
-                    int32_t y = t32[j+1];
-                    int32_t z = t32[j+2];
-                    bool interpolated = false;
-                    while(j && (x < -127 || x > 127 || y < -127 || y > 127 || z < -127 || z > 127))
-                    {
-                        x /= 2;
-                        y /= 2;
-                        z /= 2;
-                        interpolated = true;
-                    }
-                    if(interpolated)
-                    {
-                        t32[j] -= x;
-                        t32[j+1] -= y;
-                        t32[j+2] -= z;
-                        j -= 3;
-                    }
-                    new_t32.push_back(x);
-                    new_t32.push_back(y);
-                    new_t32.push_back(z);
+                    pos.push_back(total_size);
+                    total_size += buf_size[i];
+                    if(total_size > 134217728) // 128 mb
+                        break;
                 }
-                new_t32.swap(t32);
+                std::vector<char> out_buf(total_size);
+                tipl::par_for(pos.size(),[&](size_t i)
+                {
+                    encode_tract(track32[cur_track_block+i],&out_buf[pos[i]]);
+                });
+                out.write(block_name(block).c_str(),&out_buf[0],total_size,1);
+                cur_track_block += pos.size();
             }
-            buf_size[i] = sizeof(tract_header)+t32.size()-3;
-        });
-        set_title((std::string("saving to ")+std::filesystem::path(file_name).filename().string()).c_str());
-        for(size_t block = 0,cur_track_block = 0;check_prog(cur_track_block,track32.size());++block)
+            TractSpatialIndex::remove(file_name);
+            return true;
+        }
+
+        // assign chunks to blocks of at most 128 mb
+        size_t chunk_count = (track32.size()+tracts_per_chunk-1)/tracts_per_chunk;
+        std::vector<uint32_t> chunk_info(chunk_count*3); // block, offset in block, tract count
+        std::vector<size_t> block_size;
+        for(size_t c = 0,offset = 0;c < chunk_count;++c)
         {
-            // record write position for each track
-            size_t total_size = 0;
-            std::vector<size_t> pos;
-            for(size_t i = cur_track_block;i < track32.size();++i)
+            size_t from = c*tracts_per_chunk;
+            size_t to = std::min(track32.size(),from+tracts_per_chunk);
+            size_t size = 0;
+            for(size_t i = from;i < to;++i)
+                size += buf_size[i];
+            if(block_size.empty() || offset+size > 134217728) // 128 mb
             {
-                pos.push_back(total_size);
-                total_size += buf_size[i];
-                if(total_size > 134217728) // 128 mb
-                    break;
+                block_size.push_back(0);
+                offset = 0;
             }
-
-            std::vector<char> out_buf(total_size);
-            tipl::par_for(pos.size(),[&](size_t i)
+            chunk_info[c*3] = uint32_t(block_size.size()-1);
+            chunk_info[c*3+1] = uint32_t(offset);
+            chunk_info[c*3+2] = uint32_t(to-from);
+            offset += size;
+            block_size.back() = offset;
+        }
+        if(chunk_count)
+            out.write("track_chunk",&chunk_info[0],3,uint32_t(chunk_count));
+        for(size_t block = 0;check_prog(block,block_size.size());++block)
+        {
+            std::vector<char> out_buf(block_size[block]);
+            tipl::par_for(chunk_count,[&](size_t c)
             {
-                auto& t32 = track32[cur_track_block+i];
-                auto out = &out_buf[pos[i]];
-                tract_header hr;
-                hr.h.count = uint32_t(t32.size());
-                hr.h.x = t32[0];
-                hr.h.y = t32[1];
-                hr.h.z = t32[2];
-                std::copy(hr.buf,hr.buf+16,out);
-                out += sizeof(tract_header)-3;
-                for(size_t j = 3;j < t32.size();j++)
-                    out[j] = char(t32[j]);
+                if(chunk_info[c*3] == block)
+                    encode_chunk(track32,c*tracts_per_chunk,chunk_info[c*3+2],&out_buf[chunk_info[c*3+1]]);
             });
-
-            if(block == 0)
-                out.write("track",&out_buf[0],total_size,1);
+            out.write((std::string("track_v2_")+std::to_string(block)).c_str(),&out_buf[0],uint32_t(out_buf.size()),1);
+        }
+        if(TractModel::spatial_index || std::filesystem::exists(TractSpatialIndex::file_name(file_name)))
+        {
+            auto bgeo = TractSpatialIndex::block_geo(geo);
+            std::vector<std::vector<uint32_t> > chunk_blocks(chunk_count);
+            tipl::par_for(chunk_count,[&](size_t c)
+            {
+                for(size_t i = c*tracts_per_chunk,end = i+chunk_info[c*3+2];i < end;++i)
+                    TractSpatialIndex::add_blocks(tract_data[i],bgeo,chunk_blocks[c]);
+                TractSpatialIndex::unique(chunk_blocks[c]);
+            });
+            if(!TractModel::spatial_index)
+                TractSpatialIndex::remove_if_stale(file_name,geo,chunk_info,chunk_blocks);
             else
-                out.write((std::string("track")+std::to_string(block)).c_str(),&out_buf[0],total_size,1);
-            cur_track_block += pos.size();
+            if(!TractSpatialIndex::save(file_name,geo,chunk_info,chunk_blocks))
+                std::cout << "cannot save spatial index for " << file_name << std::endl;
         }
         return true;
     }
@@ -207,6 +492,44 @@ class TinyTrack{
             std::copy(cluster,cluster+tract_cluster.size(),tract_cluster.begin());
         }
 
+        if(in.has("track_chunk"))
+        {
+            const unsigned int* chunk_info = nullptr;
+            if(!in.read("track_chunk",row,col,chunk_info) || row != 3)
+                return false;
+            size_t chunk_count = col;
+            std::vector<size_t> chunk_tract_index(chunk_count+1);
+            for(size_t c = 0;c < chunk_count;++c)
+                chunk_tract_index[c+1] = chunk_tract_index[c]+chunk_info[c*3+2];
+            size_t add_tract_index = tract_data.size();
+            tract_data.resize(add_tract_index+chunk_tract_index.back());
+            std::atomic<bool> failed(false);
+            for(size_t c = 0;c < chunk_count && !failed;)
+            {
+                // decode all chunks of a block in parallel
+                uint32_t block = chunk_info[c*3];
+                const char* track_buf = nullptr;
+                if(!in.read((std::string("track_v2_")+std::to_string(block)).c_str(),row,col,track_buf))
+                    return false;
+                size_t buf_size = size_t(row)*size_t(col);
+                size_t end = c;
+                while(end < chunk_count && chunk_info[end*3] == block)
+                    ++end;
+                tipl::par_for(end-c,[&](size_t i)
+                {
+                    i += c;
+                    size_t offset = chunk_info[i*3+1];
+                    size_t size = (i+1 < end ? chunk_info[i*3+4] : buf_size)-offset;
+                    if(offset > buf_size || !decode_chunk(track_buf+offset,size,chunk_info[i*3+2],
+                                                          tract_data,add_tract_index+chunk_tract_index[i]))
+                        failed = true;
+                });
+                c = end;
+            }
+            save_idx(file_name,in.in);
+            return !failed;
+        }
+
         for(unsigned int block = 0;1;block++)
         {
             const char* track_buf = nullptr;
@@ -225,30 +548,12 @@ class TinyTrack{
             }
             size_t buf_size = size_t(row)*size_t(col);
             std::vector<size_t> pos;
-            for(size_t i = 0;i < buf_size;)
-            {
-                pos.push_back(i);
-                i += *reinterpret_cast<const uint32_t*>(track_buf+i);
-                i += sizeof(tract_header)-3;
-            }
+            scan_block(track_buf,buf_size,pos);
             size_t add_tract_index = tract_data.size();
             tract_data.resize(add_tract_index+pos.size());
             tipl::par_for(pos.size(),[&](size_t i)
             {
-                auto& cur_tract = tract_data[i+add_tract_index];
-                tract_header hr;
-                std::copy(&track_buf[pos[i]],&track_buf[pos[i]]+16,hr.buf);
-                if(hr.h.count > buf_size)
-                    return;
-                cur_tract.resize(hr.h.count);
-                cur_tract[0] = hr.h.x;
-                cur_tract[1] = hr.h.y;
-                cur_tract[2] = hr.h.z;
-                size_t shift = pos[i]+sizeof(tract_header)-3;
-                for(size_t j = 3;j < cur_tract.size();++j)
-                    cur_tract[j] = (cur_tract[j-3] + track_buf[shift+j]);
-                for(size_t j = 0;j < cur_tract.size();++j)
-                    cur_tract[j] = std::ldexp(cur_tract[j],-5);
+                decode_tract(track_buf,buf_size,pos[i],tract_data[i+add_tract_index]);
             });
         }
 
@@ -316,6 +621,50 @@ struct TrackVis
         version = 2;
         hdr_size = 1000;
     }
+    bool read_header(gz_istream& in,std::string& info)
+    {
+        if(!in.read((char*)this,1000))
+            return false;
+        info = reserved;
+        if(info.find(' ') != std::string::npos)
+            info.clear();
+        return true;
+    }
+    bool read_tract(gz_istream& in,
+                    std::vector<std::vector<float> >& loaded_tract_data,
+                    std::vector<unsigned int>& loaded_tract_cluster,
+                    const tipl::vector<3>& vs)
+    {
+        unsigned int n_point;
+        if(!in.read((char*)&n_point,sizeof(int)))
+            return false;
+        unsigned int index_shift = 3 + n_scalars;
+        std::vector<float> tract(index_shift*n_point + n_properties);
+        if(!in.read((char*)&*tract.begin(),sizeof(float)*tract.size()))
+            return false;
+
+        loaded_tract_data.push_back(std::move(std::vector<float>(n_point*3)));
+        const float *from = &*tract.begin();
+        float *to = &*loaded_tract_data.back().begin();
+        for (unsigned int i = 0;i < n_point;++i,from += index_shift,to += 3)
+        {
+            float x = from[0]/vs[0];
+            float y = from[1]/vs[1];
+            float z = from[2]/vs[2];
+            if(voxel_order[1] == 'R')
+                to[0] = dim[0]-x-1;
+            else
+                to[0] = x;
+            if(voxel_order[1] == 'A')
+                to[1] = dim[1]-y-1;
+            else
+                to[1] = y;
+            to[2] = z;
+        }
+        if(n_properties == 1)
+            loaded_tract_cluster.push_back(from[0]);
+        return true;
+    }
     bool load_from_file(const char* file_name,
                 std::vector<std::vector<float> >& loaded_tract_data,
                 std::vector<unsigned int>& loaded_tract_cluster,
@@ -324,45 +673,14 @@ struct TrackVis
     {
         prog_init p("loading ",std::filesystem::path(file_name).filename().string().c_str());
         gz_istream in;
-        if (!in.open(file_name))
+        if (!in.open(file_name) || !read_header(in,info))
             return false;
-        in.read((char*)this,1000);
         unsigned int track_number = n_count;
-        info = reserved;
-        if(info.find(' ') != std::string::npos)
-            info.clear();
         if(!track_number) // number is not stored
             track_number = 100000000;
         for (unsigned int index = 0;!(!in) && check_prog(index,track_number);++index)
-        {
-            unsigned int n_point;
-            in.read((char*)&n_point,sizeof(int));
-            unsigned int index_shift = 3 + n_scalars;
-            std::vector<float> tract(index_shift*n_point + n_properties);
-            if(!in.read((char*)&*tract.begin(),sizeof(float)*tract.size()))
+            if(!read_tract(in,loaded_tract_data,loaded_tract_cluster,vs))
                 break;
-
-            loaded_tract_data.push_back(std::move(std::vector<float>(n_point*3)));
-            const float *from = &*tract.begin();
-            float *to = &*loaded_tract_data.back().begin();
-            for (unsigned int i = 0;i < n_point;++i,from += index_shift,to += 3)
-            {
-                float x = from[0]/vs[0];
-                float y = from[1]/vs[1];
-                float z = from[2]/vs[2];
-                if(voxel_order[1] == 'R')
-                    to[0] = dim[0]-x-1;
-                else
-                    to[0] = x;
-                if(voxel_order[1] == 'A')
-                    to[1] = dim[1]-y-1;
-                else
-                    to[1] = y;
-                to[2] = z;
-            }
-            if(n_properties == 1)
-                loaded_tract_cluster.push_back(from[0]);
-        }
         return true;
     }
     static bool save_to_file(const char* file_name,
@@ -418,8 +736,12 @@ struct TrackVis
 struct Tck{
     tipl::vector<3> vs;
     tipl::geometry<3> geo;
-    bool load_from_file(const char* file_name,
-                        std::vector<std::vector<float> >& loaded_tract_data)
+    std::ifstream in;
+    std::vector<uint32_t> buf;
+    size_t buf_pos = 0;
+    std::vector<float> cur_track;
+    bool end_reached = false;
+    bool open(const char* file_name)
     {
         unsigned int offset = 0;
         {
@@ -452,193 +774,1104 @@ struct Tck{
                 }
             }
         }
-
-        std::ifstream in(file_name,std::ios::binary);
+        in.open(file_name,std::ios::binary);
         if(!in)
             return false;
-        in.seekg(0,std::ios::end);
-        unsigned int total_size = uint32_t(in.tellg());
         in.seekg(offset,std::ios::beg);
-        std::vector<unsigned int> buf((total_size-offset)/4);
-        in.read((char*)&*buf.begin(),total_size-offset-16);// 16 skip the final inf
-        for(unsigned int index = 0;index < buf.size();)
+        return true;
+    }
+    // read up to count tracts, returns false when no more tract is available
+    bool read(std::vector<std::vector<float> >& loaded_tract_data,size_t count)
+    {
+        size_t read_count = 0;
+        while(!end_reached && read_count < count)
         {
-            unsigned int end = std::find(buf.begin()+index,buf.end(),0x7FC00000)-buf.begin(); // NaN
-            if(end-index > 3)
+            if(buf_pos >= buf.size())
+            {
+                buf.resize(3*65536);
+                in.read(reinterpret_cast<char*>(&buf[0]),std::streamsize(buf.size()*4));
+                buf.resize(size_t(in.gcount())/12*3);
+                buf_pos = 0;
+                if(buf.empty())
+                {
+                    end_reached = true;
+                    break;
+                }
+            }
+            for(;buf_pos < buf.size() && read_count < count;buf_pos += 3)
             {
-                std::vector<float> track(end-index);
-                std::copy((const float*)&*buf.begin() + index,
-                          (const float*)&*buf.begin() + end,
-                          track.begin());
-                loaded_tract_data.push_back(std::move(track));
-                tipl::divide_constant(loaded_tract_data.back().begin(),loaded_tract_data.back().end(),vs[0]);
+                if(buf[buf_pos] == 0x7F800000) // inf
+                {
+                    end_reached = true;
+                    break;
+                }
+                if(buf[buf_pos] != 0x7FC00000) // NaN
+                {
+                    const float* p = reinterpret_cast<const float*>(&buf[buf_pos]);
+                    cur_track.insert(cur_track.end(),p,p+3);
+                    continue;
+                }
+                if(cur_track.size() > 3)
+                {
+                    tipl::divide_constant(cur_track.begin(),cur_track.end(),vs[0]);
+                    loaded_tract_data.push_back(std::move(cur_track));
+                    ++read_count;
+                }
+                cur_track.clear();
             }
-            index = end+3;
         }
-        return true;
+        return read_count > 0;
+    }
+    bool load_from_file(const char* file_name,
+                        std::vector<std::vector<float> >& loaded_tract_data)
+    {
+        if(!open(file_name))
+            return false;
+        read(loaded_tract_data,std::numeric_limits<size_t>::max());
+        return true;
+    }
+
+};
+
+
+
+bool tt2trk(const char* tt_file,const char* trk_file)
+{
+    std::vector<std::vector<float> > tract_data;
+    std::vector<uint16_t> cluster;
+    std::string report,pid;
+    tipl::vector<3> vs;
+    tipl::geometry<3> geo;
+    unsigned int color = default_tract_color;
+    if(!TinyTrack::load_from_file(tt_file,tract_data,cluster,geo,vs,report,pid,color))
+    {
+        std::cout << "cannot read file:" << tt_file << std::endl;
+        return false;
+    }
+    std::vector<std::vector<float> > scalar;
+    return TrackVis::save_to_file(trk_file,geo,vs,tract_data,scalar,report,color);
+}
+
+bool trk2tt(const char* trk_file,const char* tt_file)
+{
+    TrackVis vis;
+    std::vector<std::vector<float> > loaded_tract_data;
+    std::vector<unsigned int> loaded_tract_cluster;
+    std::string info;
+    tipl::vector<3> vs(1.0f,1.0f,1.0f);
+    tipl::geometry<3> geo;
+    if(!vis.load_from_file(trk_file,loaded_tract_data,loaded_tract_cluster,info,vs))
+    {
+        std::cout << "cannot read file:" << trk_file << std::endl;
+        return false;
+    }
+    unsigned int color = default_tract_color;
+    unsigned int new_color = *(uint32_t*)(vis.reserved+440);
+    if(new_color)
+        color = new_color;
+
+    std::copy(vis.voxel_size,vis.voxel_size+3,vs.begin());
+    std::copy(vis.dim,vis.dim+3,geo.begin());
+    for(size_t index = 0;index < loaded_tract_data.size();++index)
+        for(size_t i = 0;i < loaded_tract_data[index].size();i += 3)
+        {
+            loaded_tract_data[index][i] /= vs[0];
+            loaded_tract_data[index][i+1] /= vs[1];
+            loaded_tract_data[index][i+2] /= vs[2];
+        }
+    std::string p_id;
+    std::vector<uint16_t> cluster(loaded_tract_cluster.begin(),loaded_tract_cluster.end());
+    return TinyTrack::save_to_file(tt_file,geo,vs,loaded_tract_data,cluster,info,p_id,color);
+}
+//---------------------------------------------------------------------------
+void shift_track_for_tck(std::vector<std::vector<float> >& loaded_tract_data,tipl::geometry<3>& geo)
+{
+    tipl::vector<3> min_xyz(0.0f,0.0f,0.0f),max_xyz(0.0f,0.0f,0.0f);
+    tipl::par_for(loaded_tract_data.size(),[&](size_t i)
+    {
+        for(unsigned int k = 0;k < 3;++k)
+        for(size_t j = k;j < loaded_tract_data[i].size();j += 3)
+        {
+            if(loaded_tract_data[i][j] < min_xyz[k])
+                min_xyz[k] = loaded_tract_data[i][j];
+            if(loaded_tract_data[i][j] > max_xyz[k])
+                max_xyz[k] = loaded_tract_data[i][j];
+        }
+    });
+    for(unsigned int k = 0;k < 3;++k)
+    {
+        geo[k] = uint32_t(max_xyz[k]-min_xyz[k]+2);
+        min_xyz[k] -= 1;
+    }
+    tipl::par_for(loaded_tract_data.size(),[&](size_t i)
+    {
+        for(unsigned int k = 0;k < 2;++k)
+        for(size_t j = k;j < loaded_tract_data[i].size();j += 3)
+            loaded_tract_data[i][j] = max_xyz[k] - loaded_tract_data[i][j];
+        for(size_t j = 2;j < loaded_tract_data[i].size();j += 3)
+            loaded_tract_data[i][j] -= min_xyz[2];
+    });
+}
+bool load_fib_from_tracks(const char* file_name,tipl::image<float,3>& I,tipl::vector<3>& vs)
+{
+    tipl::geometry<3> geo;
+    std::vector<std::vector<float> > loaded_tract_data;
+    if(QString(file_name).endsWith("tck"))
+    {
+        Tck tck;
+        tck.vs = tipl::vector<3>(1.0f,1.0f,1.0f);
+        if(!tck.load_from_file(file_name,loaded_tract_data))
+        {
+            std::cout << "cannot read file:" << file_name << std::endl;
+            return false;
+        }
+        shift_track_for_tck(loaded_tract_data,geo);
+    }
+    else
+    if(QString(file_name).endsWith("trk.gz") || QString(file_name).endsWith("trk"))
+    {
+        TrackVis vis;
+        std::vector<unsigned int> loaded_tract_cluster;
+        std::string info;
+        if(!vis.load_from_file(file_name,loaded_tract_data,loaded_tract_cluster,info,vs))
+        {
+            std::cout << "cannot read file:" << file_name << std::endl;
+            return false;
+        }
+        std::copy(vis.voxel_size,vis.voxel_size+3,vs.begin());
+        std::copy(vis.dim,vis.dim+3,geo.begin());
+    }
+    else
+        if(QString(file_name).endsWith("tt.gz"))
+        {
+            std::vector<unsigned short> loaded_tract_cluster;
+            std::string report,pid;
+            unsigned int color;
+            if(!TinyTrack::load_from_file(file_name,loaded_tract_data,loaded_tract_cluster,geo,vs,report,pid,color))
+            {
+                std::cout << "cannot read file:" << file_name << std::endl;
+                return false;
+            }
+        }
+    else
+        return false;
+    I.clear();
+    I.resize(geo);
+    tipl::par_for(loaded_tract_data.size(),[&](size_t i)
+    {
+        for(size_t j = 0;j < loaded_tract_data[i].size();j += 3)
+        {
+            int x = int(std::round(loaded_tract_data[i][j]));
+            int y = int(std::round(loaded_tract_data[i][j+1]));
+            int z = int(std::round(loaded_tract_data[i][j+2]));
+            if(geo.is_valid(x,y,z))
+                I[tipl::pixel_index<3>(x,y,z,geo).index()]++;
+        }
+    });
+    return true;
+}
+//---------------------------------------------------------------------------
+// reads the matrices of a mat file one at a time, the data go to a buffer reused by the caller
+struct MatRecord{
+    uint32_t type = 0,rows = 0,cols = 0;
+    std::string name;
+    bool read_header(gz_istream& in)
+    {
+        uint32_t header[5];
+        if(!in.read(header,20) || header[3] || !header[4] || header[4] > 1024 || type_size(header[0]) == 0)
+            return false;
+        type = header[0];
+        rows = header[1];
+        cols = header[2];
+        std::vector<char> buf(header[4]);
+        if(!in.read(&buf[0],buf.size()))
+            return false;
+        name = std::string(buf.begin(),std::find(buf.begin(),buf.end(),0));
+        return true;
+    }
+    bool read_data(gz_istream& in,std::vector<char>& data) const
+    {
+        data.resize(data_size());
+        return data.empty() || in.read(&data[0],data.size());
+    }
+    static size_t type_size(uint32_t type)
+    {
+        const size_t size[6] = {8,4,4,2,2,1};
+        return type%100/10 < 6 ? size[type%100/10] : 0;
+    }
+    size_t size(void) const{return size_t(rows)*size_t(cols);}
+    size_t data_size(void) const{return size()*type_size(type);}
+    double value(const std::vector<char>& data,size_t i) const
+    {
+        const char* p = &data[0];
+        switch(type%100/10)
+        {
+            case 0: return reinterpret_cast<const double*>(p)[i];
+            case 1: return double(reinterpret_cast<const float*>(p)[i]);
+            case 2: return double(reinterpret_cast<const int32_t*>(p)[i]);
+            case 3: return double(reinterpret_cast<const int16_t*>(p)[i]);
+            case 4: return double(reinterpret_cast<const uint16_t*>(p)[i]);
+        }
+        return double(reinterpret_cast<const uint8_t*>(p)[i]);
+    }
+    static std::string text(const std::vector<char>& data)
+    {
+        return std::string(data.begin(),std::find(data.begin(),data.end(),0));
+    }
+};
+
+bool TractReader::open(const char* file_name)
+{
+    pending.clear();
+    pending_cluster.clear();
+    pending_pos = 0;
+    read_count = 0;
+    fill = nullptr;
+    error_msg.clear();
+    chunk_info.clear();
+    chunk_selected.clear();
+    chunk_tract_index = std::vector<size_t>(1,0);
+    if(!std::filesystem::exists(file_name))
+    {
+        error_msg = "file does not exist";
+        return false;
+    }
+    if(QString(file_name).endsWith("tt.gz"))
+    {
+        // the matrices are read in file order, and only one tract block or the selected chunks are kept in memory.
+        // gz_mat_read is not used because it keeps every matrix it has read until closed.
+        auto in = std::make_shared<gz_istream>();
+        if(!in->open(file_name))
+        {
+            error_msg = "cannot open file";
+            return false;
+        }
+        // meta data are stored before the tracts
+        auto record = std::make_shared<MatRecord>();
+        std::vector<unsigned int> cluster;
+        std::vector<char> data;
+        while(record->read_header(*in) && record->name.find("track") != 0)
+        {
+            if(!record->read_data(*in,data))
+                break;
+            if(record->name == "dimension" && record->size() == 3)
+                geo = tipl::geometry<3>(int(record->value(data,0)),int(record->value(data,1)),int(record->value(data,2)));
+            if(record->name == "voxel_size" && record->size() == 3)
+                vs = tipl::vector<3>(float(record->value(data,0)),float(record->value(data,1)),float(record->value(data,2)));
+            if(record->name == "report")
+                report = MatRecord::text(data);
+            if(record->name == "parameter_id")
+                parameter_id = MatRecord::text(data);
+            if(record->name == "color" && record->size())
+                color = uint32_t(record->value(data,0));
+            if(record->name == "cluster")
+                for(size_t i = 0;i < record->size();++i)
+                    cluster.push_back(uint32_t(record->value(data,i)));
+        }
+        if(record->name == "track_chunk")
+        {
+            if(record->rows != 3 || !record->read_data(*in,data))
+            {
+                error_msg = "invalid tract chunk table";
+                return false;
+            }
+            for(size_t i = 0;i < record->size();++i)
+                chunk_info.push_back(uint32_t(record->value(data,i)));
+            if(!record->read_header(*in))
+                record->name.clear();
+        }
+        if(record->name.find("track") != 0)
+        {
+            error_msg = "no tract data found";
+            return false;
+        }
+        this->file_name = file_name;
+        if(!chunk_info.empty())
+        {
+            // version 2: the chunk table locates each chunk, so unselected chunks are skipped by seeking forward
+            for(size_t i = 0;i < chunk_info.size();i += 3)
+                chunk_tract_index.push_back(chunk_tract_index.back()+chunk_info[i+2]);
+            fill = [this,in,record,cluster,block = size_t(0),block_pos = in->tell(),block_end = in->tell()+record->data_size(),
+                    cur = size_t(0),buf = std::vector<std::vector<char> >()]
+                   (std::vector<std::vector<float> >& tracts,std::vector<unsigned int>& tract_cluster) mutable
+            {
+                size_t chunk_count = chunk_info.size()/3;
+                std::vector<size_t> chunks,tract_index(1,0);
+                buf.resize(std::thread::hardware_concurrency());
+                for(;cur < chunk_count && chunks.size() < buf.size();++cur)
+                {
+                    if(!chunk_selected.empty() && !chunk_selected[cur])
+                        continue;
+                    // blocks and chunks are in file order
+                    while(block < chunk_info[cur*3])
+                    {
+                        if(!in->seek(block_end) || !record->read_header(*in) || record->name.find("track_v2_") != 0)
+                        {
+                            error_msg = "cannot read tract block";
+                            return false;
+                        }
+                        ++block;
+                        block_pos = in->tell();
+                        block_end = block_pos+record->data_size();
+                    }
+                    size_t from = block_pos+chunk_info[cur*3+1];
+                    size_t to = (cur+1 < chunk_count && chunk_info[cur*3+3] == block) ?
+                                block_pos+chunk_info[cur*3+4] : block_end;
+                    auto& chunk_buf = buf[chunks.size()];
+                    chunk_buf.resize(to > from ? to-from : 0);
+                    if(chunk_buf.empty() || to > block_end || !in->seek(from) || !in->read(&chunk_buf[0],chunk_buf.size()))
+                    {
+                        error_msg = "cannot read tract chunk";
+                        return false;
+                    }
+                    chunks.push_back(cur);
+                    tract_index.push_back(tract_index.back()+chunk_info[cur*3+2]);
+                }
+                if(chunks.empty())
+                    return false;
+                tracts.resize(tract_index.back());
+                std::atomic<bool> failed(false);
+                tipl::par_for(chunks.size(),[&](size_t i)
+                {
+                    if(!TinyTrack::decode_chunk(&buf[i][0],buf[i].size(),chunk_info[chunks[i]*3+2],tracts,tract_index[i]))
+                        failed = true;
+                });
+                if(failed)
+                {
+                    error_msg = "corrupted tract data";
+                    return false;
+                }
+                if(!cluster.empty())
+                    for(size_t i = 0;i < chunks.size();++i)
+                        for(size_t j = 0,k = chunk_tract_index[chunks[i]];j < chunk_info[chunks[i]*3+2];++j,++k)
+                            tract_cluster.push_back(k < cluster.size() ? cluster[k] : 0);
+                return true;
+            };
+            return true;
+        }
+        // version 1: blocks named track, track1, track2..., the tracts of each block are decoded in parallel
+        fill = [this,in,record,cluster,data = std::vector<char>(),pos = std::vector<size_t>(),
+                cur = size_t(0),scanned = false,filled = size_t(0)]
+               (std::vector<std::vector<float> >& tracts,std::vector<unsigned int>& tract_cluster) mutable
+        {
+            while(cur >= pos.size())
+            {
+                if(scanned && (!record->read_header(*in) || record->name.find("track") != 0))
+                    return false;
+                scanned = true;
+                if(!record->read_data(*in,data))
+                {
+                    error_msg = "cannot read tract block";
+                    return false;
+                }
+                pos.clear();
+                cur = 0;
+                if(!data.empty())
+                    TinyTrack::scan_block(&data[0],data.size(),pos);
+            }
+            size_t n = std::min(chunk_size,pos.size()-cur);
+            tracts.resize(n);
+            tipl::par_for(n,[&](size_t i)
+            {
+                TinyTrack::decode_tract(&data[0],data.size(),pos[cur+i],tracts[i]);
+            });
+            cur += n;
+            for(size_t i = 0;i < n;++i,++filled)
+                if(filled < cluster.size())
+                    tract_cluster.push_back(cluster[filled]);
+            return true;
+        };
+        return true;
+    }
+    if(QString(file_name).endsWith("trk.gz") || QString(file_name).endsWith("trk"))
+    {
+        auto in = std::make_shared<gz_istream>();
+        auto trk = std::make_shared<TrackVis>();
+        if(!in->open(file_name) || !trk->read_header(*in,parameter_id))
+        {
+            error_msg = "cannot read trk header";
+            return false;
+        }
+        // the tracts are converted to voxel coordinates using vs, as TractModel::load_from_file does
+        std::copy(trk->dim,trk->dim+3,geo.begin());
+        if(*(uint32_t*)(trk->reserved+440))
+            color = *(uint32_t*)(trk->reserved+440);
+        if(!parameter_id.empty())
+        {
+            report = "\nThis tractography was generated using the following parameters: ";
+            TrackingParam param;
+            if(param.set_code(parameter_id))
+                report += param.get_report();
+        }
+        fill = [this,in,trk](std::vector<std::vector<float> >& tracts,std::vector<unsigned int>& tract_cluster)
+        {
+            size_t n = 0;
+            while(n < chunk_size && trk->read_tract(*in,tracts,tract_cluster,vs))
+                ++n;
+            return n > 0;
+        };
+        return true;
+    }
+    if(QString(file_name).endsWith("tck"))
+    {
+        auto tck = std::make_shared<Tck>();
+        tck->vs = vs;
+        if(!tck->open(file_name))
+        {
+            error_msg = "cannot open file";
+            return false;
+        }
+        vs = tck->vs;
+        geo = tck->geo;
+        fill = [this,tck](std::vector<std::vector<float> >& tracts,std::vector<unsigned int>&)
+        {
+            return tck->read(tracts,chunk_size);
+        };
+        return true;
+    }
+    if(QString(file_name).endsWith(".txt"))
+    {
+        auto in = std::make_shared<std::ifstream>(file_name);
+        if(!*in)
+        {
+            error_msg = "cannot open file";
+            return false;
+        }
+        // a line with a single value is the cluster of the preceding tract, as written by save_all
+        fill = [this,in,line = std::string(),has_line = false]
+               (std::vector<std::vector<float> >& tracts,std::vector<unsigned int>& tract_cluster) mutable
+        {
+            size_t n = 0;
+            while(has_line || std::getline(*in,line))
+            {
+                has_line = false;
+                std::istringstream str(line);
+                std::vector<float> tract((std::istream_iterator<float>(str)),std::istream_iterator<float>());
+                if(tract.size() == 1)
+                {
+                    if(tract_cluster.size()+1 == tracts.size())
+                        tract_cluster.push_back(uint32_t(tract[0]));
+                    continue;
+                }
+                if(tract.size() < 3)
+                    continue;
+                // keep the line for the next call so that its cluster line stays with it
+                if(n == chunk_size)
+                {
+                    has_line = true;
+                    break;
+                }
+                tracts.push_back(std::move(tract));
+                ++n;
+            }
+            return n > 0;
+        };
+        return true;
+    }
+    if(QString(file_name).endsWith(".mat"))
+    {
+        // mat files keep all tracts in one matrix, which is loaded as a whole
+        auto in = std::make_shared<gz_mat_read>();
+        const float* buf = nullptr;
+        const unsigned int* length = nullptr;
+        const unsigned int* cluster = nullptr;
+        unsigned int row,col;
+        if(!in->load_from_file(file_name) || !in->read("tracts",row,col,buf) || !in->read("length",row,col,length))
+        {
+            error_msg = "cannot read tracts from the mat file";
+            return false;
+        }
+        size_t count = col;
+        in->read("cluster",row,col,cluster);
+        fill = [this,in,buf,length,cluster,count,index = size_t(0)]
+               (std::vector<std::vector<float> >& tracts,std::vector<unsigned int>& tract_cluster) mutable
+        {
+            size_t n = 0;
+            for(;n < chunk_size && index < count;++n,++index)
+            {
+                tracts.push_back(std::vector<float>(buf,buf+length[index]*3));
+                buf += length[index]*3;
+                if(cluster)
+                    tract_cluster.push_back(cluster[index]);
+            }
+            return n > 0;
+        };
+        return true;
+    }
+    error_msg = "unsupported tract file format";
+    return false;
+}
+bool TractReader::save_spatial_index(void)
+{
+    if(chunk_info.empty() || read_count)
+    {
+        error_msg = "spatial index requires a newly opened tt.gz file saved in chunks (--tract_chunk=1 or --tract_index=1)";
+        return false;
+    }
+    auto bgeo = TractSpatialIndex::block_geo(geo);
+    std::vector<std::vector<uint32_t> > chunk_blocks(chunk_info.size()/3);
+    std::vector<std::vector<float> > tracts;
+    size_t chunk = 0;
+    while(read(tracts))
+    {
+        size_t first_chunk = chunk;
+        for(size_t i = 0,index = read_count-tracts.size();i < tracts.size();++i,++index)
+        {
+            while(index >= chunk_tract_index[chunk+1])
+                ++chunk;
+            TractSpatialIndex::add_blocks(tracts[i],bgeo,chunk_blocks[chunk]);
+        }
+        tipl::par_for(chunk-first_chunk+1,[&](size_t c)
+        {
+            TractSpatialIndex::unique(chunk_blocks[first_chunk+c]);
+        });
+    }
+    if(!error_msg.empty())
+        return false;
+    if(!TractSpatialIndex::save(file_name.c_str(),geo,
+                                std::vector<uint32_t>(chunk_info.begin(),chunk_info.end()),chunk_blocks))
+    {
+        error_msg = "cannot save spatial index";
+        return false;
+    }
+    return true;
+}
+bool TractReader::select_region(std::shared_ptr<RoiMgr> roi_mgr)
+{
+    // a selected tract passes every group, and a group is passed by passing any of its regions.
+    // one or two end regions must each hold an end point, more end regions only need to hold them together
+    std::vector<std::vector<std::shared_ptr<Roi> > > regions;
+    for(const auto& roi : roi_mgr->inclusive)
+        regions.push_back(std::vector<std::shared_ptr<Roi> >(1,roi));
+    if(roi_mgr->end.size() <= 2)
+        for(const auto& roi : roi_mgr->end)
+            regions.push_back(std::vector<std::shared_ptr<Roi> >(1,roi));
+    else
+        regions.push_back(roi_mgr->end);
+    std::string index_file = TractSpatialIndex::file_name(file_name.c_str());
+    if(chunk_info.empty() || regions.empty() || read_count || !std::filesystem::exists(index_file))
+        return false;
+    gz_mat_read in;
+    if(!in.load_from_file(index_file.c_str()))
+        return false;
+    auto bgeo = TractSpatialIndex::block_geo(geo);
+    tipl::geometry<3> index_geo;
+    unsigned int row,col;
+    const unsigned int *index_chunk_info = nullptr,*bs = nullptr,*block_offset = nullptr,*block_chunk = nullptr;
+    in.read("dimension",index_geo);
+    if(!in.read("track_chunk",row,col,index_chunk_info) || size_t(row)*col != chunk_info.size() ||
+       !std::equal(chunk_info.begin(),chunk_info.end(),index_chunk_info) ||
+       !in.read("block_size",row,col,bs) || *bs != TractSpatialIndex::block_size ||
+       index_geo[0] != geo[0] || index_geo[1] != geo[1] || index_geo[2] != geo[2] ||
+       !in.read("block_offset",row,col,block_offset) || size_t(row)*col != bgeo.size()+1)
+    {
+        std::cout << "spatial index does not match " << file_name << std::endl;
+        return false;
+    }
+    in.read("block_chunk",row,col,block_chunk);
+
+    // a tract passing a region voxel has a point inside the voxel box, so the blocks overlapped by the box are needed
+    size_t chunk_count = chunk_info.size()/3;
+    std::vector<char> selected(chunk_count,1);
+    for(const auto& group : regions)
+    {
+        std::vector<char> block_hit(bgeo.size());
+        for(const auto& roi : group)
+        {
+            std::vector<tipl::vector<3,short> > points;
+            roi->get_points(points);
+            float r = 0.5f/roi->get_ratio();
+            for(const auto& p : points)
+            {
+                tipl::vector<3> pos(p[0],p[1],p[2]);
+                pos /= roi->get_ratio();
+                tipl::vector<3> from(pos),to(pos);
+                from -= tipl::vector<3>(r,r,r);
+                to += tipl::vector<3>(r,r,r);
+                TractSpatialIndex::add_box(from,to,bgeo,block_hit);
+            }
+        }
+        std::vector<char> chunk_hit(chunk_count);
+        for(size_t b = 0;b < block_hit.size();++b)
+            if(block_hit[b] && block_chunk)
+                for(size_t k = block_offset[b];k < block_offset[b+1];++k)
+                    chunk_hit[block_chunk[k]] = 1;
+        for(size_t c = 0;c < chunk_count;++c)
+            selected[c] &= chunk_hit[c];
+    }
+    chunk_selected.swap(selected);
+    return true;
+}
+size_t TractReader::get_selected_chunk_count(void) const
+{
+    if(chunk_selected.empty())
+        return chunk_info.size()/3;
+    return size_t(std::count(chunk_selected.begin(),chunk_selected.end(),1));
+}
+bool TractReader::read(std::vector<std::vector<float> >& tracts,std::vector<unsigned int>& cluster)
+{
+    tracts.clear();
+    cluster.clear();
+    if(pending_pos >= pending.size())
+    {
+        pending.clear();
+        pending_cluster.clear();
+        pending_pos = 0;
+        do{
+            if(!fill || !fill(pending,pending_cluster))
+                return false;
+        }while(pending.empty());
+    }
+    size_t n = std::min(chunk_size,pending.size()-pending_pos);
+    std::move(pending.begin()+int64_t(pending_pos),pending.begin()+int64_t(pending_pos+n),std::back_inserter(tracts));
+    if(pending_cluster.size() == pending.size())
+        cluster.assign(pending_cluster.begin()+int64_t(pending_pos),pending_cluster.begin()+int64_t(pending_pos+n));
+    pending_pos += n;
+    read_count += n;
+    return true;
+}
+void accumulate_density_map(const std::vector<std::vector<float> >& tract_data,tipl::image<unsigned int,3>& mapping,
+                            const tipl::matrix<4,4,float>& transformation,bool endpoint);
+bool TractReader::get_density_map(tipl::image<unsigned int,3>& mapping,
+                                  const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    std::vector<std::vector<float> > tracts;
+    while(read(tracts))
+        accumulate_density_map(tracts,mapping,transformation,endpoint);
+    return read_count && error_msg.empty();
+}
+bool TractReader::get_length_histogram(std::vector<size_t>& hist,float bin_size)
+{
+    std::vector<std::vector<float> > tracts;
+    while(read(tracts))
+    {
+        std::vector<float> length(tracts.size());
+        tipl::par_for(tracts.size(),[&](size_t i)
+        {
+            for (size_t j = 3;j < tracts[i].size();j += 3)
+                length[i] += float(tipl::vector<3,float>(
+                    vs[0]*(tracts[i][j]-tracts[i][j-3]),
+                    vs[1]*(tracts[i][j+1]-tracts[i][j-2]),
+                    vs[2]*(tracts[i][j+2]-tracts[i][j-1])).length());
+        });
+        for(auto l : length)
+        {
+            size_t bin = size_t(l/bin_size);
+            if(bin >= hist.size())
+                hist.resize(bin+1);
+            ++hist[bin];
+        }
+    }
+    return read_count && error_msg.empty();
+}
+// tracts shorter than two points are not filtered
+bool pass_roi(const RoiMgr& roi_mgr,const std::vector<float>& tract)
+{
+    if(tract.size() < 6)
+        return true;
+    if(!roi_mgr.have_include(&(tract[0]),uint32_t(tract.size())) ||
+       !roi_mgr.fulfill_end_point(tipl::vector<3,float>(tract[0],tract[1],tract[2]),
+                                  tipl::vector<3,float>(tract[tract.size()-3],
+                                                        tract[tract.size()-2],
+                                                        tract[tract.size()-1])))
+        return false;
+    if(!roi_mgr.exclusive.empty())
+    {
+        for(unsigned int i = 0;i < tract.size();i+=3)
+            if(roi_mgr.is_excluded_point(tipl::vector<3,float>(tract[i],tract[i+1],tract[i+2])))
+                return false;
+    }
+    return true;
+}
+
+struct TractStoreFile{
+    std::string file_name;
+    std::fstream io;
+    uint64_t end = 0;
+    // file position, byte size, and tract count of each chunk
+    std::vector<uint64_t> chunk_pos;
+    std::vector<uint32_t> chunk_bytes,chunk_count;
+    std::vector<size_t> chunk_tract_index = std::vector<size_t>(1,0);
+    // decoded chunks, the most recently used at the back
+    std::list<std::pair<size_t,std::shared_ptr<const std::vector<std::vector<float> > > > > cache;
+    size_t cache_memory = 0;
+    std::mutex lock;
+    ~TractStoreFile(void)
+    {
+        if(io.is_open())
+            io.close();
+        if(!file_name.empty())
+            std::remove(file_name.c_str());
+    }
+    bool write(const std::vector<std::vector<float> >& tracts)
+    {
+        if(!io.is_open())
+        {
+            file_name = QDir::tempPath().toStdString()+"/dsi_studio_tracts_"+
+                        std::to_string(reinterpret_cast<uintptr_t>(this))+"_"+
+                        std::to_string(std::chrono::steady_clock::now().time_since_epoch().count())+".bin";
+            io.open(file_name.c_str(),std::ios::in|std::ios::out|std::ios::binary|std::ios::trunc);
+            if(!io)
+                return false;
+        }
+        std::vector<std::vector<int32_t> > track32(tracts.size());
+        tipl::par_for(tracts.size(),[&](size_t i)
+        {
+            TinyTrack::to_track32(tracts[i],track32[i]);
+        });
+        size_t bytes = 0;
+        for(const auto& t32 : track32)
+            bytes += TinyTrack::encoded_size(t32);
+        std::vector<char> buf(bytes);
+        TinyTrack::encode_chunk(track32,0,track32.size(),&buf[0]);
+        io.seekp(int64_t(end));
+        if(!io.write(&buf[0],int64_t(buf.size())))
+            return false;
+        chunk_pos.push_back(end);
+        chunk_bytes.push_back(uint32_t(bytes));
+        chunk_count.push_back(uint32_t(tracts.size()));
+        chunk_tract_index.push_back(chunk_tract_index.back()+tracts.size());
+        end += bytes;
+        return true;
+    }
+    bool read_bytes(size_t chunk,std::vector<char>& buf)
+    {
+        buf.resize(chunk_bytes[chunk]);
+        io.seekg(int64_t(chunk_pos[chunk]));
+        return bool(io.read(&buf[0],int64_t(buf.size())));
+    }
+    std::shared_ptr<const std::vector<std::vector<float> > > read(size_t chunk)
+    {
+        std::lock_guard<std::mutex> lock_guard(lock);
+        for(auto iter = cache.begin();iter != cache.end();++iter)
+            if(iter->first == chunk)
+            {
+                cache.splice(cache.end(),cache,iter);
+                return cache.back().second;
+            }
+        std::vector<char> buf;
+        auto tracts = std::make_shared<std::vector<std::vector<float> > >(chunk_count[chunk]);
+        if(!read_bytes(chunk,buf) ||
+           !TinyTrack::decode_chunk(&buf[0],buf.size(),chunk_count[chunk],*tracts,0))
+            return std::shared_ptr<const std::vector<std::vector<float> > >();
+        size_t memory = 0;
+        for(const auto& t : *tracts)
+            memory += t.size()*sizeof(float);
+        // drop the least recently used chunks, those still in use are released by their users
+        while(!cache.empty() && cache_memory+memory > TractStore::memory_budget)
+        {
+            for(const auto& t : *cache.front().second)
+                cache_memory -= t.size()*sizeof(float);
+            cache.pop_front();
+        }
+        cache.push_back(std::make_pair(chunk,tracts));
+        cache_memory += memory;
+        return tracts;
     }
-
 };
 
-
-
-bool tt2trk(const char* tt_file,const char* trk_file)
+size_t TractStore::memory_budget = size_t(2048) << 20;
+TractStore::TractStore(void):file(std::make_shared<TractStoreFile>()){}
+void TractStore::clear(void)
 {
-    std::vector<std::vector<float> > tract_data;
-    std::vector<uint16_t> cluster;
-    std::string report,pid;
-    tipl::vector<3> vs;
-    tipl::geometry<3> geo;
-    unsigned int color = default_tract_color;
-    if(!TinyTrack::load_from_file(tt_file,tract_data,cluster,geo,vs,report,pid,color))
+    file = std::make_shared<TractStoreFile>();
+    open_chunk.clear();
+    cluster.clear();
+    tract_count = 0;
+}
+bool TractStore::flush(void)
+{
+    if(open_chunk.empty())
+        return true;
+    if(!file->write(open_chunk))
     {
-        std::cout << "cannot read file:" << tt_file << std::endl;
+        error_msg = "cannot write to the temporary file ";
+        error_msg += file->file_name;
         return false;
     }
-    std::vector<std::vector<float> > scalar;
-    return TrackVis::save_to_file(trk_file,geo,vs,tract_data,scalar,report,color);
+    open_chunk.clear();
+    return true;
 }
-
-bool trk2tt(const char* trk_file,const char* tt_file)
+size_t TractStore::get_chunk_count(void)
 {
-    TrackVis vis;
-    std::vector<std::vector<float> > loaded_tract_data;
-    std::vector<unsigned int> loaded_tract_cluster;
-    std::string info;
-    tipl::vector<3> vs(1.0f,1.0f,1.0f);
-    tipl::geometry<3> geo;
-    if(!vis.load_from_file(trk_file,loaded_tract_data,loaded_tract_cluster,info,vs))
+    flush();
+    return file->chunk_pos.size();
+}
+bool TractStore::add(std::vector<std::vector<float> >& tracts,uint16_t cluster_id)
+{
+    for(auto& each : tracts)
     {
-        std::cout << "cannot read file:" << trk_file << std::endl;
-        return false;
+        if(each.size() < 3)
+            continue;
+        open_chunk.push_back(std::vector<float>());
+        open_chunk.back().swap(each);
+        cluster.push_back(cluster_id);
+        ++tract_count;
+        if(open_chunk.size() == TinyTrack::tracts_per_chunk && !flush())
+            return false;
     }
-    unsigned int color = default_tract_color;
-    unsigned int new_color = *(uint32_t*)(vis.reserved+440);
-    if(new_color)
-        color = new_color;
-
-    std::copy(vis.voxel_size,vis.voxel_size+3,vs.begin());
-    std::copy(vis.dim,vis.dim+3,geo.begin());
-    for(size_t index = 0;index < loaded_tract_data.size();++index)
-        for(size_t i = 0;i < loaded_tract_data[index].size();i += 3)
-        {
-            loaded_tract_data[index][i] /= vs[0];
-            loaded_tract_data[index][i+1] /= vs[1];
-            loaded_tract_data[index][i+2] /= vs[2];
-        }
-    std::string p_id;
-    std::vector<uint16_t> cluster(loaded_tract_cluster.begin(),loaded_tract_cluster.end());
-    return TinyTrack::save_to_file(tt_file,geo,vs,loaded_tract_data,cluster,info,p_id,color);
+    tracts.clear();
+    return true;
 }
-//---------------------------------------------------------------------------
-void shift_track_for_tck(std::vector<std::vector<float> >& loaded_tract_data,tipl::geometry<3>& geo)
+bool TractStore::load_from_file(const char* file_name)
 {
-    tipl::vector<3> min_xyz(0.0f,0.0f,0.0f),max_xyz(0.0f,0.0f,0.0f);
-    tipl::par_for(loaded_tract_data.size(),[&](size_t i)
+    TractReader reader;
+    reader.chunk_size = TinyTrack::tracts_per_chunk;
+    if(!reader.open(file_name))
     {
-        for(unsigned int k = 0;k < 3;++k)
-        for(size_t j = k;j < loaded_tract_data[i].size();j += 3)
+        error_msg = reader.error_msg;
+        return false;
+    }
+    geo = reader.geo;
+    vs = reader.vs;
+    report = reader.report;
+    parameter_id = reader.parameter_id;
+    std::vector<std::vector<float> > tracts;
+    std::vector<unsigned int> tract_cluster;
+    while(reader.read(tracts,tract_cluster))
+    {
+        if(tract_cluster.size() != tracts.size())
         {
-            if(loaded_tract_data[i][j] < min_xyz[k])
-                min_xyz[k] = loaded_tract_data[i][j];
-            if(loaded_tract_data[i][j] > max_xyz[k])
-                max_xyz[k] = loaded_tract_data[i][j];
+            if(!add(tracts))
+                return false;
+            continue;
+        }
+        for(size_t i = 0;i < tracts.size();)
+        {
+            // keep the cluster of each tract
+            size_t j = i+1;
+            while(j < tracts.size() && tract_cluster[j] == tract_cluster[i])
+                ++j;
+            std::vector<std::vector<float> > same_cluster(std::make_move_iterator(tracts.begin()+int64_t(i)),
+                                                          std::make_move_iterator(tracts.begin()+int64_t(j)));
+            if(!add(same_cluster,uint16_t(tract_cluster[i])))
+                return false;
+            i = j;
         }
-    });
-    for(unsigned int k = 0;k < 3;++k)
-    {
-        geo[k] = uint32_t(max_xyz[k]-min_xyz[k]+2);
-        min_xyz[k] -= 1;
     }
-    tipl::par_for(loaded_tract_data.size(),[&](size_t i)
+    if(!reader.error_msg.empty())
     {
-        for(unsigned int k = 0;k < 2;++k)
-        for(size_t j = k;j < loaded_tract_data[i].size();j += 3)
-            loaded_tract_data[i][j] = max_xyz[k] - loaded_tract_data[i][j];
-        for(size_t j = 2;j < loaded_tract_data[i].size();j += 3)
-            loaded_tract_data[i][j] -= min_xyz[2];
-    });
+        error_msg = reader.error_msg;
+        return false;
+    }
+    return flush();
 }
-bool load_fib_from_tracks(const char* file_name,tipl::image<float,3>& I,tipl::vector<3>& vs)
+std::shared_ptr<const std::vector<std::vector<float> > > TractStore::get_chunk(size_t chunk)
 {
-    tipl::geometry<3> geo;
-    std::vector<std::vector<float> > loaded_tract_data;
-    if(QString(file_name).endsWith("tck"))
+    if(!flush() || chunk >= file->chunk_pos.size())
+        return std::shared_ptr<const std::vector<std::vector<float> > >();
+    auto tracts = file->read(chunk);
+    if(!tracts.get())
+        error_msg = "cannot read the temporary file";
+    return tracts;
+}
+bool TractStore::get_tract(size_t index,std::vector<float>& tract)
+{
+    if(index >= tract_count || !flush())
+        return false;
+    const auto& chunk_tract_index = file->chunk_tract_index;
+    size_t chunk = size_t(std::upper_bound(chunk_tract_index.begin(),chunk_tract_index.end(),index)-chunk_tract_index.begin())-1;
+    auto tracts = get_chunk(chunk);
+    if(!tracts.get())
+        return false;
+    tract = (*tracts)[index-chunk_tract_index[chunk]];
+    return true;
+}
+bool TractStore::filter(std::function<bool(const std::vector<float>&)> pass)
+{
+    if(!flush())
+        return false;
+    auto old_file = file;
+    auto old_cluster = cluster;
+    file = std::make_shared<TractStoreFile>();
+    cluster.clear();
+    tract_count = 0;
+    for(size_t chunk = 0;chunk < old_file->chunk_pos.size();++chunk)
     {
-        Tck tck;
-        tck.vs = tipl::vector<3>(1.0f,1.0f,1.0f);
-        if(!tck.load_from_file(file_name,loaded_tract_data))
+        auto tracts = old_file->read(chunk);
+        if(!tracts.get())
         {
-            std::cout << "cannot read file:" << file_name << std::endl;
+            error_msg = "cannot read the temporary file";
             return false;
         }
-        shift_track_for_tck(loaded_tract_data,geo);
+        std::vector<char> keep(tracts->size());
+        tipl::par_for(tracts->size(),[&](size_t i)
+        {
+            keep[i] = pass((*tracts)[i]);
+        });
+        for(size_t i = 0,index = old_file->chunk_tract_index[chunk];i < tracts->size();++i,++index)
+            if(keep[i])
+            {
+                std::vector<std::vector<float> > tract(1,(*tracts)[i]);
+                if(!add(tract,old_cluster[index]))
+                    return false;
+            }
     }
-    else
-    if(QString(file_name).endsWith("trk.gz") || QString(file_name).endsWith("trk"))
+    return flush();
+}
+bool TractStore::filter_by_roi(std::shared_ptr<RoiMgr> roi_mgr)
+{
+    return filter([&](const std::vector<float>& tract){return pass_roi(*roi_mgr,tract);});
+}
+bool TractStore::save_to_file(const char* file_name)
+{
+    if(!flush())
+        return false;
+    gz_mat_write out(file_name);
+    if (!out)
     {
-        TrackVis vis;
-        std::vector<unsigned int> loaded_tract_cluster;
-        std::string info;
-        if(!vis.load_from_file(file_name,loaded_tract_data,loaded_tract_cluster,info,vs))
+        error_msg = "cannot write to ";
+        error_msg += file_name;
+        return false;
+    }
+    out.write("dimension",geo);
+    out.write("voxel_size",vs);
+    out.write("report",report);
+    if(!parameter_id.empty())
+        out.write("parameter_id",parameter_id);
+    if(std::find_if(cluster.begin(),cluster.end(),[](uint16_t c){return c != 0;}) != cluster.end())
+        out.write("cluster",&cluster[0],cluster.size(),1);
+
+    size_t chunk_count = file->chunk_pos.size();
+    if(!TractModel::chunked_tt)
+    {
+        // version 1: the chunks are decoded and re-encoded tract by tract into blocks of about 128 mb
+        prog_init p("saving ",std::filesystem::path(file_name).filename().string().c_str());
+        std::vector<char> out_buf;
+        size_t block = 0;
+        for(size_t c = 0;check_prog(c,chunk_count);++c)
         {
-            std::cout << "cannot read file:" << file_name << std::endl;
+            auto tracts = get_chunk(c);
+            if(!tracts.get())
+                return false;
+            std::vector<std::vector<int32_t> > track32(tracts->size());
+            std::vector<size_t> pos(tracts->size()+1);
+            tipl::par_for(track32.size(),[&](size_t i)
+            {
+                TinyTrack::to_track32((*tracts)[i],track32[i]);
+                pos[i+1] = TinyTrack::encoded_size(track32[i]);
+            });
+            pos[0] = out_buf.size();
+            for(size_t i = 1;i < pos.size();++i)
+                pos[i] += pos[i-1];
+            out_buf.resize(pos.back());
+            tipl::par_for(track32.size(),[&](size_t i)
+            {
+                TinyTrack::encode_tract(track32[i],&out_buf[pos[i]]);
+            });
+            if(out_buf.size() > 134217728 || c+1 == chunk_count) // 128 mb
+            {
+                out.write(TinyTrack::block_name(block++).c_str(),&out_buf[0],uint32_t(out_buf.size()),1);
+                out_buf.clear();
+            }
+        }
+        if(prog_aborted())
             return false;
+        TractSpatialIndex::remove(file_name);
+        return true;
+    }
+    // version 2: the chunks are already encoded, and are copied to blocks of at most 128 mb
+    size_t block_limit = std::min<size_t>(134217728,std::max<size_t>(memory_budget/4,size_t(1) << 20));
+    std::vector<uint32_t> chunk_info(chunk_count*3); // block, offset in block, tract count
+    std::vector<size_t> block_size;
+    for(size_t c = 0,offset = 0;c < chunk_count;++c)
+    {
+        if(block_size.empty() || offset+file->chunk_bytes[c] > block_limit)
+        {
+            block_size.push_back(0);
+            offset = 0;
         }
-        std::copy(vis.voxel_size,vis.voxel_size+3,vs.begin());
-        std::copy(vis.dim,vis.dim+3,geo.begin());
+        chunk_info[c*3] = uint32_t(block_size.size()-1);
+        chunk_info[c*3+1] = uint32_t(offset);
+        chunk_info[c*3+2] = file->chunk_count[c];
+        offset += file->chunk_bytes[c];
+        block_size.back() = offset;
     }
-    else
-        if(QString(file_name).endsWith("tt.gz"))
+    if(chunk_count)
+        out.write("track_chunk",&chunk_info[0],3,uint32_t(chunk_count));
+    prog_init p("saving ",std::filesystem::path(file_name).filename().string().c_str());
+    for(size_t block = 0,c = 0;check_prog(block,block_size.size());++block)
+    {
+        std::vector<char> out_buf(block_size[block]),buf;
         {
-            std::vector<unsigned short> loaded_tract_cluster;
-            std::string report,pid;
-            unsigned int color;
-            if(!TinyTrack::load_from_file(file_name,loaded_tract_data,loaded_tract_cluster,geo,vs,report,pid,color))
+            std::lock_guard<std::mutex> lock_guard(file->lock);
+            for(;c < chunk_count && chunk_info[c*3] == block;++c)
             {
-                std::cout << "cannot read file:" << file_name << std::endl;
-                return false;
+                if(!file->read_bytes(c,buf))
+                {
+                    error_msg = "cannot read the temporary file";
+                    return false;
+                }
+                std::copy(buf.begin(),buf.end(),out_buf.begin()+chunk_info[c*3+1]);
             }
         }
-    else
-        return false;
-    I.clear();
-    I.resize(geo);
-    tipl::par_for(loaded_tract_data.size(),[&](size_t i)
+        out.write((std::string("track_v2_")+std::to_string(block)).c_str(),&out_buf[0],uint32_t(out_buf.size()),1);
+    }
+    if(TractModel::spatial_index || std::filesystem::exists(TractSpatialIndex::file_name(file_name)))
     {
-        for(size_t j = 0;j < loaded_tract_data[i].size();j += 3)
+        auto bgeo = TractSpatialIndex::block_geo(geo);
+        std::vector<std::vector<uint32_t> > chunk_blocks(chunk_count);
+        for(size_t c = 0;c < chunk_count;++c)
         {
-            int x = int(std::round(loaded_tract_data[i][j]));
-            int y = int(std::round(loaded_tract_data[i][j+1]));
-            int z = int(std::round(loaded_tract_data[i][j+2]));
-            if(geo.is_valid(x,y,z))
-                I[tipl::pixel_index<3>(x,y,z,geo).index()]++;
+            auto tracts = get_chunk(c);
+            if(!tracts.get())
+                return false;
+            for(const auto& t : *tracts)
+                TractSpatialIndex::add_blocks(t,bgeo,chunk_blocks[c]);
+            TractSpatialIndex::unique(chunk_blocks[c]);
         }
-    });
+        if(!TractModel::spatial_index)
+            TractSpatialIndex::remove_if_stale(file_name,geo,chunk_info,chunk_blocks);
+        else
+        if(!TractSpatialIndex::save(file_name,geo,chunk_info,chunk_blocks))
+            std::cout << "cannot save spatial index for " << file_name << std::endl;
+    }
+    return true;
+}
+bool TractReader::open(std::shared_ptr<TractStore> store)
+{
+    pending.clear();
+    pending_cluster.clear();
+    pending_pos = 0;
+    read_count = 0;
+    error_msg.clear();
+    chunk_info.clear();
+    chunk_selected.clear();
+    file_name.clear();
+    geo = store->geo;
+    vs = store->vs;
+    report = store->report;
+    parameter_id = store->parameter_id;
+    fill = [this,store,cur = size_t(0),chunk_count = store->get_chunk_count(),tract_index = size_t(0)]
+           (std::vector<std::vector<float> >& tracts,std::vector<unsigned int>& tract_cluster) mutable
+    {
+        if(cur >= chunk_count)
+            return false;
+        auto chunk = store->get_chunk(cur++);
+        if(!chunk.get())
+        {
+            error_msg = store->error_msg;
+            return false;
+        }
+        tracts = *chunk;
+        tract_cluster.assign(store->cluster.begin()+int64_t(tract_index),
+                             store->cluster.begin()+int64_t(tract_index+tracts.size()));
+        tract_index += tracts.size();
+        return true;
+    };
     return true;
 }
 //---------------------------------------------------------------------------
+bool TractModel::spatial_index = false;
+bool TractModel::chunked_tt = false;
+size_t TractModel::undo_memory_limit = size_t(1024) << 20;
 void TractModel::add(const TractModel& rhs)
 {
-    for(unsigned int index = 0;index < rhs.redo_size.size();++index)
-        redo_size.push_back(std::make_pair(rhs.redo_size[index].first + tract_data.size(),
-                                           rhs.redo_size[index].second));
     tract_data.insert(tract_data.end(),rhs.tract_data.begin(),rhs.tract_data.end());
     tract_color.insert(tract_color.end(),rhs.tract_color.begin(),rhs.tract_color.end());
-    tract_tag.insert(tract_tag.end(),rhs.tract_tag.begin(),rhs.tract_tag.end());
-    deleted_tract_data.insert(deleted_tract_data.end(),
-                              rhs.deleted_tract_data.begin(),
-                              rhs.deleted_tract_data.end());
-    deleted_tract_color.insert(deleted_tract_color.end(),
-                               rhs.deleted_tract_color.begin(),
-                               rhs.deleted_tract_color.end());
-    deleted_tract_tag.insert(deleted_tract_tag.end(),
-                               rhs.deleted_tract_tag.begin(),
-                               rhs.deleted_tract_tag.end());
-    deleted_count.insert(deleted_count.begin(),
-                         rhs.deleted_count.begin(),
-                         rhs.deleted_count.end());
-    is_cut.insert(is_cut.end(),rhs.is_cut.begin(),rhs.is_cut.end());
+    // the edit history of rhs is not carried over
+    tract_tag.resize(tract_data.size());
+    ++tract_version;
 }
 //---------------------------------------------------------------------------
 bool TractModel::load_from_file(const char* file_name_,bool append)
@@ -744,18 +1977,14 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
         tract_cluster.clear();
 
     loaded_tract_data.swap(tract_data);
+    ++tract_version;
     tract_color.clear();
     tract_color.resize(tract_data.size());
     if(color)
         std::fill(tract_color.begin(),tract_color.end(),color);
     tract_tag.clear();
     tract_tag.resize(tract_data.size());
-    deleted_tract_data.clear();
-    deleted_tract_color.clear();
-    deleted_tract_tag.clear();
-    deleted_count.clear();
-    is_cut.clear();
-    redo_size.clear();
+    journal.reset();
     return true;
 }
 
@@ -1444,6 +2673,7 @@ void TractModel::resample(float new_step)
         new_tracts.push_back(tract_data[i][tract_data[i].size()-1]);
         new_tracts.swap(tract_data[i]);
     });
+    ++tract_version;
 }
 //---------------------------------------------------------------------------
 void TractModel::get_tract_points(std::vector<tipl::vector<3,float> >& points)
@@ -1456,138 +2686,571 @@ void TractModel::get_tract_points(std::vector<tipl::vector<3,float> >& points)
         }
 }
 //---------------------------------------------------------------------------
+// runs of consecutive tract points on the same slice, where a slice is std::round(dir*point),
+// grouped by slice and ordered by tract, used by get_in_slice_tracts. Only every skip-th tract is indexed.
+struct TractSliceIndex{
+    size_t version = 0;
+    unsigned int skip = 1;
+    tipl::vector<3> dir;
+    int first_slice = 0;
+    std::vector<size_t> slice_offset;   // runs of slice s are in [slice_offset[s-first_slice],slice_offset[s-first_slice+1])
+    std::vector<std::pair<unsigned int,unsigned int> > run;    // tract index and its first point in the slice
+    int slice_of(const float* p) const
+    {
+        return int(std::round(dir[0]*p[0]+dir[1]*p[1]+dir[2]*p[2]));
+    }
+    void build(const std::vector<std::vector<float> >& tract_data,bool parallel)
+    {
+        // contiguous chunks of tracts are counted and filled in parallel, which keeps runs ordered by tract
+        size_t chunk_count = parallel ? std::max<size_t>(1,std::min<size_t>(std::thread::hardware_concurrency(),tract_data.size())) : 1;
+        size_t chunk_size = (tract_data.size()+chunk_count-1)/chunk_count;
+        auto for_each_chunk = [&](auto fun)
+        {
+            if(parallel)
+                tipl::par_for(chunk_count,fun);
+            else
+                fun(size_t(0));
+        };
+        auto for_each_run = [&](size_t chunk,auto fun)
+        {
+            for(size_t i = chunk*chunk_size;i < std::min(tract_data.size(),(chunk+1)*chunk_size);++i)
+            {
+                if(i % skip)
+                    continue;
+                int prev = 0;
+                for(size_t j = 0;j < tract_data[i].size();j += 3)
+                {
+                    int cur = slice_of(&tract_data[i][j]);
+                    if(!j || cur != prev)
+                        fun(uint32_t(i),uint32_t(j),cur);
+                    prev = cur;
+                }
+            }
+        };
+        std::vector<int> chunk_min(chunk_count,std::numeric_limits<int>::max()),chunk_max(chunk_count,std::numeric_limits<int>::min());
+        for_each_chunk([&](size_t chunk)
+        {
+            for_each_run(chunk,[&](unsigned int,unsigned int,int s)
+            {
+                chunk_min[chunk] = std::min(chunk_min[chunk],s);
+                chunk_max[chunk] = std::max(chunk_max[chunk],s);
+            });
+        });
+        first_slice = *std::min_element(chunk_min.begin(),chunk_min.end());
+        int last_slice = *std::max_element(chunk_max.begin(),chunk_max.end());
+        slice_offset.clear();
+        run.clear();
+        if(first_slice > last_slice)
+            return;
+        size_t slice_count = size_t(last_slice-first_slice+1);
+        std::vector<std::vector<size_t> > count(chunk_count,std::vector<size_t>(slice_count));
+        for_each_chunk([&](size_t chunk)
+        {
+            for_each_run(chunk,[&](unsigned int,unsigned int,int s){++count[chunk][size_t(s-first_slice)];});
+        });
+        slice_offset.resize(slice_count+1);
+        for(size_t s = 0,offset = 0;s < slice_count;++s)
+        {
+            slice_offset[s] = offset;
+            for(size_t chunk = 0;chunk < chunk_count;++chunk)
+            {
+                size_t c = count[chunk][s];
+                count[chunk][s] = offset;
+                offset += c;
+            }
+            slice_offset[s+1] = offset;
+        }
+        run.resize(slice_offset.back());
+        for_each_chunk([&](size_t chunk)
+        {
+            for_each_run(chunk,[&](unsigned int i,unsigned int j,int s)
+            {
+                run[count[chunk][size_t(s-first_slice)]++] = std::make_pair(i,j);
+            });
+        });
+    }
+};
 void TractModel::get_in_slice_tracts(unsigned char dim,int pos,
                                      tipl::matrix<4,4,float>* pT,
                                      std::vector<std::vector<tipl::vector<2,float> > >& lines,
                                      std::vector<unsigned int>& colors,
-                                     unsigned int max_count)
+                                     unsigned int max_count,
+                                     bool build_parallel)
 {
+    if(dim > 2 || tract_data.empty())
+        return;
+    // the slice of a point is std::round(dir*point) == pos
+    tipl::vector<3> dir,shift;
+    float scale = 1.0f;
+    bool simple_transform = false;
+    dir[dim] = 1.0f;
+    if(pT)
+    {
+        auto& T = *pT;
+        simple_transform = (T[1]*T[2]*T[4]*T[6]*T[8]*T[9] == 0.0f);
+        if(simple_transform)
+        {
+            scale = T[0];
+            shift = tipl::vector<3>(T[3],T[7],T[11]);
+            dir[dim] = scale;
+        }
+        else
+            dir = tipl::vector<3>(&T[0]+dim*4);
+        pos -= T[dim*4+3];
+    }
 
-    std::vector<tipl::vector<2,float> > line;
-    auto add_line = [&](unsigned int index)
+    unsigned int skip = std::max<unsigned int>(1,uint32_t(tract_data.size())/std::max<unsigned int>(1,max_count));
+    auto& index = slice_index[dim];
+    if(!index.get() || index->version != tract_version || index->skip != skip ||
+       index->dir[0] != dir[0] || index->dir[1] != dir[1] || index->dir[2] != dir[2])
     {
-        if(line.empty() || index >= tract_color.size())
-            return;
-        lines.push_back(std::move(line));
-        colors.push_back(tract_color[index]);
-        line.clear();
-    };
-    unsigned int skip = std::max<unsigned int>(1,uint32_t(tract_data.size())/max_count);
-    if(!pT) // native space
+        index = std::make_shared<TractSliceIndex>();
+        index->dir = dir;
+        index->skip = skip;
+        index->build(tract_data,build_parallel);
+        index->version = tract_version;
+    }
+    if(pos < index->first_slice || size_t(pos-index->first_slice)+1 >= index->slice_offset.size())
+        return;
+
+    for(size_t r = index->slice_offset[size_t(pos-index->first_slice)];
+               r < index->slice_offset[size_t(pos-index->first_slice)+1];++r)
     {
-        for (unsigned int index = 0;index < tract_data.size();index += skip,add_line(index))
-            for (unsigned int j = 0;j < tract_data[index].size();j += 3)
+        unsigned int i = index->run[r].first;
+        if(i >= tract_color.size())
+            continue;
+        const auto& tract = tract_data[i];
+        std::vector<tipl::vector<2,float> > line;
+        for(size_t j = index->run[r].second;j < tract.size() && index->slice_of(&tract[j]) == pos;j += 3)
+        {
+            tipl::vector<3> t(&tract[j]);
+            if(pT)
             {
-                if(int(std::round(tract_data[index][j+dim])) == pos)
+                if(simple_transform)
                 {
-                    tipl::vector<2,float> p;
-                    tipl::space2slice(dim,tract_data[index][j],
-                                          tract_data[index][j+1],
-                                          tract_data[index][j+2],p[0],p[1]);
-                    line.push_back(p);
+                    t *= scale;
+                    t += shift;
                 }
                 else
-                    add_line(index);
+                    t.to(*pT);
             }
+            tipl::vector<2,float> p;
+            tipl::space2slice(dim,t[0],t[1],t[2],p[0],p[1]);
+            line.push_back(p);
+        }
+        lines.push_back(std::move(line));
+        colors.push_back(tract_color[i]);
     }
-    else
+}
+//---------------------------------------------------------------------------
+// bounding volume hierarchy over pieces of tracts, used by select() to skip tracts away from the stroke
+struct TractSelectIndex{
+    static const size_t piece_size = 32;    // points per leaf, plus the last point of the previous leaf
+    static const size_t fan_out = 8;        // children per node
+    size_t version = 0;
+    std::vector<float> tract_box;           // min x,y,z and max x,y,z of each tract
+    std::vector<unsigned int> leaf_tract;
+    std::vector<std::vector<float> > box;   // box[0]: leaves in Morton order, box[i+1]: union of fan_out nodes in box[i]
+    static uint32_t expand_bits(uint32_t v)
     {
-        auto& T = *pT;
-        if(T[1]*T[2]*T[4]*T[6]*T[8]*T[9] == 0.0f) // simple transform
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v <<  8)) & 0x0300F00F;
+        v = (v | (v <<  4)) & 0x030C30C3;
+        v = (v | (v <<  2)) & 0x09249249;
+        return v;
+    }
+    static void merge(float* to,const float* from)
+    {
+        for(int d = 0;d < 3;++d)
+        {
+            to[d] = std::min(to[d],from[d]);
+            to[d+3] = std::max(to[d+3],from[d+3]);
+        }
+    }
+    void build(const std::vector<std::vector<float> >& tract_data)
+    {
+        const float empty_box[6] = {std::numeric_limits<float>::max(),std::numeric_limits<float>::max(),std::numeric_limits<float>::max(),
+                                    std::numeric_limits<float>::lowest(),std::numeric_limits<float>::lowest(),std::numeric_limits<float>::lowest()};
+        std::vector<size_t> leaf_offset(tract_data.size()+1);
+        for(size_t i = 0;i < tract_data.size();++i)
+            leaf_offset[i+1] = leaf_offset[i] + (tract_data[i].size()/3+piece_size-1)/piece_size;
+        size_t leaf_count = leaf_offset.back();
+        std::vector<float> leaf_box(leaf_count*6);
+        std::vector<unsigned int> tract_of_leaf(leaf_count);
+        tract_box.resize(tract_data.size()*6);
+        tipl::par_for(tract_data.size(),[&](size_t i)
         {
-            float scale = T[0];
-            tipl::vector<3,float> shift(T[3],T[7],T[11]);
-            pos -= shift[dim];
-            for (unsigned int index = 0;index < tract_data.size();index += skip,add_line(index))
-            for (unsigned int j = 0;j < tract_data[index].size();j += 3)
+            std::copy(empty_box,empty_box+6,&tract_box[i*6]);
+            for(size_t j = 0,leaf = leaf_offset[i];leaf < leaf_offset[i+1];++leaf)
             {
-                if(int(std::round(tract_data[index][j+dim]*scale)) == pos)
-                {
-                    tipl::vector<3> t(&tract_data[index][j]);
-                    t *= scale;
-                    t += shift;
-                    tipl::vector<2,float> p;
-                    tipl::space2slice(dim,t[0],t[1],t[2],p[0],p[1]);
-                    line.push_back(p);
-                }
-                else
-                    add_line(index);
+                float* b = &leaf_box[leaf*6];
+                std::copy(empty_box,empty_box+6,b);
+                // leaves overlap by one point so that each line segment is in a leaf
+                for(size_t k = (j ? j-3 : j),end = std::min(j+piece_size*3,tract_data[i].size());k < end;k += 3)
+                    for(int d = 0;d < 3;++d)
+                    {
+                        b[d] = std::min(b[d],tract_data[i][k+d]);
+                        b[d+3] = std::max(b[d+3],tract_data[i][k+d]);
+                    }
+                j = std::min(j+piece_size*3,tract_data[i].size());
+                tract_of_leaf[leaf] = uint32_t(i);
+                merge(&tract_box[i*6],b);
+            }
+        });
+        // sort leaves by the Morton code of their centers so that nearby leaves share nodes
+        float range_box[6];
+        std::copy(empty_box,empty_box+6,range_box);
+        for(size_t i = 0;i < tract_data.size();++i)
+            if(!tract_data[i].empty())
+                merge(range_box,&tract_box[i*6]);
+        std::vector<std::pair<uint32_t,uint32_t> > code(leaf_count);
+        tipl::par_for(leaf_count,[&](size_t leaf)
+        {
+            const float* b = &leaf_box[leaf*6];
+            uint32_t c = 0;
+            for(int d = 0;d < 3;++d)
+            {
+                float w = range_box[d+3]-range_box[d];
+                float x = w > 0.0f ? ((b[d]+b[d+3])*0.5f-range_box[d])/w : 0.0f;
+                c |= expand_bits(uint32_t(std::max(0.0f,std::min(1023.0f,x*1024.0f)))) << d;
             }
+            code[leaf] = std::make_pair(c,uint32_t(leaf));
+        });
+        std::sort(code.begin(),code.end());
+        box.clear();
+        box.push_back(std::vector<float>(leaf_count*6));
+        leaf_tract.resize(leaf_count);
+        tipl::par_for(leaf_count,[&](size_t i)
+        {
+            std::copy(&leaf_box[code[i].second*6],&leaf_box[code[i].second*6]+6,&box[0][i*6]);
+            leaf_tract[i] = tract_of_leaf[code[i].second];
+        });
+        while(box.back().size() > fan_out*6)
+        {
+            const std::vector<float>& child = box.back();
+            size_t child_count = child.size()/6;
+            std::vector<float> parent(((child_count+fan_out-1)/fan_out)*6);
+            tipl::par_for(parent.size()/6,[&](size_t i)
+            {
+                std::copy(empty_box,empty_box+6,&parent[i*6]);
+                for(size_t j = i*fan_out;j < std::min(child_count,i*fan_out+fan_out);++j)
+                    merge(&parent[i*6],&child[j*6]);
+            });
+            box.push_back(std::move(parent));
         }
-        else
-        // more complicated transformation
+    }
+    // get tracts having a leaf that passes fun(box)
+    template<typename fun_type>
+    void query(fun_type&& fun,std::vector<unsigned int>& tracts) const
+    {
+        tracts.clear();
+        std::vector<std::pair<size_t,size_t> > stack;
+        for(size_t i = 0;i < box.back().size()/6;++i)
+            stack.push_back(std::make_pair(box.size()-1,i));
+        while(!stack.empty())
         {
-            tipl::vector<3,float> rotate(&T[0]+dim*4);
-            pos -= T[dim*4+3];
-            for (unsigned int index = 0;index < tract_data.size();index += skip,add_line(index))
-            for (unsigned int j = 0;j < tract_data[index].size();j += 3)
+            auto node = stack.back();
+            stack.pop_back();
+            if(!fun(&box[node.first][node.second*6]))
+                continue;
+            if(node.first == 0)
             {
-                tipl::vector<3> t(&tract_data[index][j]);
-                if(int(std::round(rotate*t)) == pos)
-                {
-                    t.to(T);
-                    tipl::vector<2,float> p;
-                    tipl::space2slice(dim,t[0],t[1],t[2],p[0],p[1]);
-                    line.push_back(p);
-                }
-                else
-                    add_line(index);
+                tracts.push_back(leaf_tract[node.second]);
+                continue;
             }
+            for(size_t j = node.second*fan_out;j < std::min(box[node.first-1].size()/6,node.second*fan_out+fan_out);++j)
+                stack.push_back(std::make_pair(node.first-1,j));
         }
+        std::sort(tracts.begin(),tracts.end());
+        tracts.erase(std::unique(tracts.begin(),tracts.end()),tracts.end());
     }
-}
-//---------------------------------------------------------------------------
+};
+
 void TractModel::select(float select_angle,
                         const std::vector<tipl::vector<3,float> >& dirs,
                         const tipl::vector<3,float>& from_pos,std::vector<unsigned int>& selected)
 {
     selected.resize(tract_data.size());
     std::fill(selected.begin(),selected.end(),0);
-    for(int i = 1;i < dirs.size();++i)
-    {
-        tipl::vector<3,float> from_dir = dirs[i-1];
-        tipl::vector<3,float> to_dir = (i+1 < dirs.size() ? dirs[i+1] : dirs[i]);
-        tipl::vector<3,float> z_axis = from_dir.cross_product(to_dir);
-        z_axis.normalize();
-        float view_angle = from_dir*to_dir;
-
-        float select_angle_cos = std::cos(select_angle*3.141592654/180);
-        unsigned int total_track_number = tract_data.size();
-        for (unsigned int index = 0;index < total_track_number;++index)
-        {
-            float angle = 0.0;
-            const float* ptr = &*tract_data[index].begin();
-            const float* end = ptr + tract_data[index].size();
-            for (;ptr < end;ptr += 3)
+    if(dirs.size() < 2 || tract_data.empty())
+        return;
+    if(!select_index.get() || select_index->version != tract_version)
+    {
+        select_index = std::make_shared<TractSelectIndex>();
+        select_index->build(tract_data);
+        select_index->version = tract_version;
+    }
+    struct stroke_segment{
+        tipl::vector<3,float> from_dir,to_dir,z_axis;
+        float view_angle;
+    };
+    std::vector<stroke_segment> segments(dirs.size()-1);
+    for(size_t i = 1;i < dirs.size();++i)
+    {
+        auto& s = segments[i-1];
+        s.from_dir = dirs[i-1];
+        s.to_dir = (i+1 < dirs.size() ? dirs[i+1] : dirs[i]);
+        s.z_axis = s.from_dir.cross_product(s.to_dir);
+        s.z_axis.normalize();
+        s.view_angle = s.from_dir*s.to_dir;
+    }
+    float select_angle_cos = std::cos(select_angle*3.141592654/180);
+
+    // a tract is selected at its first point that crosses the plane of the stroke segment
+    // and lies within the view angle of both directions
+    auto select_in_tract = [&](const stroke_segment& s,size_t index)->unsigned int
+    {
+        float angle = 0.0;
+        const float* ptr = &*tract_data[index].begin();
+        const float* end = ptr + tract_data[index].size();
+        for (;ptr < end;ptr += 3)
+        {
+            tipl::vector<3,float> p(ptr);
+            p -= from_pos;
+            float next_angle = s.z_axis*p;
+            if ((angle < 0.0 && next_angle >= 0.0) ||
+                    (angle > 0.0 && next_angle <= 0.0))
             {
-                tipl::vector<3,float> p(ptr);
-                p -= from_pos;
-                float next_angle = z_axis*p;
-                if ((angle < 0.0 && next_angle >= 0.0) ||
-                        (angle > 0.0 && next_angle <= 0.0))
-                {
 
-                    p.normalize();
-                    if (p*from_dir > view_angle &&
-                            p*to_dir > view_angle)
+                p.normalize();
+                if (p*s.from_dir > s.view_angle &&
+                        p*s.to_dir > s.view_angle)
+                {
+                    if(select_angle != 0.0)
                     {
-                        if(select_angle != 0.0)
-                        {
-                            tipl::vector<3,float> p1(ptr),p2(ptr-3);
-                            p1 -= p2;
-                            p1.normalize();
-                            if(std::abs(p1*z_axis) < select_angle_cos)
-                                continue;
-                        }
-                        selected[index] = ptr - &*tract_data[index].begin();
-                        break;
+                        tipl::vector<3,float> p1(ptr),p2(ptr-3);
+                        p1 -= p2;
+                        p1.normalize();
+                        if(std::abs(p1*s.z_axis) < select_angle_cos)
+                            continue;
                     }
-
+                    return uint32_t(ptr - &*tract_data[index].begin());
                 }
-                angle = next_angle;
+
+            }
+            angle = next_angle;
+        }
+        return 0;
+    };
+
+    // conservative box test: the selected point is inside both view cones,
+    // and the line segment ending at it, or at the first of the skipped points before it, crosses the plane
+    auto cross_plane = [&](size_t i,const float* b)
+    {
+        tipl::vector<3,double> center((b[0]+b[3])*0.5,(b[1]+b[4])*0.5,(b[2]+b[5])*0.5);
+        center -= tipl::vector<3,double>(from_pos);
+        double c = tipl::vector<3,double>(segments[i].z_axis)*center;
+        double r = (std::fabs(segments[i].z_axis[0])*(b[3]-b[0])+std::fabs(segments[i].z_axis[1])*(b[4]-b[1])+std::fabs(segments[i].z_axis[2])*(b[5]-b[2]))*0.5;
+        double margin = 1.0e-4*(std::fabs(c)+r)+1.0e-3;
+        return !(c-r > margin || c+r < -margin);
+    };
+
+    struct view_cone{
+        tipl::vector<3,double> dir;
+        double cos_angle,sin_angle;
+    };
+    std::vector<std::vector<view_cone> > cones(segments.size());
+    for(size_t i = 0;i < segments.size();++i)
+        for(const auto& dir : {segments[i].from_dir,segments[i].to_dir})
+        {
+            view_cone c;
+            c.dir = tipl::vector<3,double>(dir);
+            double dir_length = c.dir.length();
+            double cos_cone = double(segments[i].view_angle)/dir_length;
+            // no use of the cone test for a wide view angle
+            if(!(cos_cone > 0.0 && cos_cone < 1.0))
+                continue;
+            c.dir /= dir_length;
+            double angle = std::acos(cos_cone) + 0.001;
+            c.cos_angle = std::cos(angle);
+            c.sin_angle = std::sin(angle);
+            cones[i].push_back(c);
+        }
+    auto in_cones = [&](size_t i,const float* b)
+    {
+        tipl::vector<3,double> center((b[0]+b[3])*0.5,(b[1]+b[4])*0.5,(b[2]+b[5])*0.5);
+        tipl::vector<3,double> half((b[3]-b[0])*0.5,(b[4]-b[1])*0.5,(b[5]-b[2])*0.5);
+        center -= tipl::vector<3,double>(from_pos);
+        double r2 = half*half;
+        double d2 = center*center;
+        if(d2 <= r2)
+            return true;
+        double d = std::sqrt(d2);
+        double sin_sphere = std::sqrt(r2)/d;
+        double cos_sphere = std::sqrt(1.0-sin_sphere*sin_sphere);
+        for(const auto& c : cones[i])
+        {
+            // cos of the cone angle widened by the angle the bounding sphere subtends
+            double cos_limit = c.cos_angle*cos_sphere-c.sin_angle*sin_sphere;
+            if(c.cos_angle*sin_sphere+c.sin_angle*cos_sphere < 0.0)// wider than 180 degrees
+                continue;
+            if(center*c.dir < cos_limit*d)
+                return false;
+        }
+        return true;
+    };
+    std::vector<std::vector<unsigned int> > candidates(segments.size());
+    tipl::par_for(segments.size(),[&](size_t i)
+    {
+        select_index->query([&](const float* b){return cross_plane(i,b) && in_cones(i,b);},candidates[i]);
+    });
+    // later segments overwrite earlier ones: test the candidate segments of each tract backward
+    std::vector<std::pair<uint32_t,uint32_t> > tests;
+    for(size_t i = 0;i < candidates.size();++i)
+        for(auto index : candidates[i])
+            tests.push_back(std::make_pair(index,uint32_t(segments.size()-1-i)));
+    std::sort(tests.begin(),tests.end());
+    std::vector<size_t> group;
+    for(size_t i = 0;i < tests.size();++i)
+        if(i == 0 || tests[i].first != tests[i-1].first)
+            group.push_back(i);
+    group.push_back(tests.size());
+    tipl::par_for(group.size()-1,[&](size_t g)
+    {
+        for(size_t i = group[g];i < group[g+1];++i)
+            if((selected[tests[i].first] = select_in_tract(segments[segments.size()-1-tests[i].second],tests[i].first)))
+                break;
+    });
+}
+// one deletion or cut in the undo/redo history
+struct TractEdit{
+    bool is_cut = false;
+    size_t count = 0;                           // tracts deleted or cut
+    // deletion: the deleted tracts, appended back at undo
+    // cut: the points clipped from each tract, the tracts are rebuilt with their pieces at undo
+    std::vector<std::vector<float> > tracts;
+    std::vector<unsigned int> color,tag;        // of the deleted or cut tracts
+    std::vector<unsigned int> layout;           // cut: lengths of clipped, piece, clipped, ..., clipped points
+    std::vector<unsigned int> piece_count;      // cut: pieces of each tract
+    uint32_t first_serial = 0;                  // cut: tag of the first piece
+    size_t tail = 0;                            // products of the edit are at or after this index
+    size_t shift = 0;                           // tracts removed by the later edits, which moves the products forward
+    size_t memory = 0;                          // bytes held by tracts
+    int64_t spill_pos = -1;                     // position of tracts in the spill file
+};
+
+struct TractEditJournal{
+    std::vector<TractEdit> undo_list,redo_list;
+    size_t version = 0;         // tract_version after the last edit, tracts at known positions if unchanged
+    size_t deleted_count = 0;
+    size_t memory = 0;
+    size_t spilled = 0;         // undo_list[0..spilled) checked for spilling
+    std::string spill_file_name;
+    std::fstream spill;
+    int64_t spill_end = 0;
+    ~TractEditJournal(void)
+    {
+        if(spill.is_open())
+            spill.close();
+        if(!spill_file_name.empty())
+            std::remove(spill_file_name.c_str());
+    }
+    void add(TractEdit&& edit,bool is_redo)
+    {
+        if(!is_redo)
+            redo_list.clear();
+        memory += edit.memory;
+        if(!edit.is_cut)
+            deleted_count += edit.count;
+        undo_list.push_back(std::move(edit));
+        // move the oldest history to the disk, the latest edit stays in memory
+        for(;memory > TractModel::undo_memory_limit && spilled+1 < undo_list.size();++spilled)
+            if(undo_list[spilled].memory && undo_list[spilled].spill_pos < 0 && !write(undo_list[spilled]))
+                break;
+    }
+    bool write(TractEdit& edit)
+    {
+        if(!spill.is_open())
+        {
+            spill_file_name = QDir::tempPath().toStdString() + "/dsi_studio_undo_" +
+                    std::to_string(uintptr_t(this)) + "_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".bin";
+            spill.open(spill_file_name.c_str(),std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+            if(!spill)
+            {
+                std::cout << "cannot write undo history to " << spill_file_name << std::endl;
+                return false;
             }
         }
+        spill.seekp(spill_end);
+        uint64_t count = edit.tracts.size();
+        spill.write(reinterpret_cast<const char*>(&count),sizeof(count));
+        for(const auto& tract : edit.tracts)
+        {
+            uint64_t size = tract.size();
+            spill.write(reinterpret_cast<const char*>(&size),sizeof(size));
+            if(size)
+                spill.write(reinterpret_cast<const char*>(&tract[0]),int64_t(size*sizeof(float)));
+        }
+        if(!spill)
+            return false;
+        edit.spill_pos = spill_end;
+        spill_end = spill.tellp();
+        std::vector<std::vector<float> >().swap(edit.tracts);
+        memory -= edit.memory;
+        return true;
+    }
+    // get the tracts of an edit leaving the history
+    bool read(TractEdit& edit)
+    {
+        if(edit.spill_pos < 0)
+        {
+            memory -= edit.memory;
+            return true;
+        }
+        spill.seekg(edit.spill_pos);
+        uint64_t count = 0;
+        spill.read(reinterpret_cast<char*>(&count),sizeof(count));
+        edit.tracts.resize(count);
+        for(auto& tract : edit.tracts)
+        {
+            uint64_t size = 0;
+            spill.read(reinterpret_cast<char*>(&size),sizeof(size));
+            tract.resize(size);
+            if(size)
+                spill.read(reinterpret_cast<char*>(&tract[0]),int64_t(size*sizeof(float)));
+        }
+        // the last spilled edit is always read first, its space is reused
+        spill_end = edit.spill_pos;
+        edit.spill_pos = -1;
+        return bool(spill);
+    }
+    TractEdit pop_undo(void)
+    {
+        TractEdit edit = std::move(undo_list.back());
+        undo_list.pop_back();
+        spilled = std::min(spilled,undo_list.size());
+        if(!edit.is_cut)
+            deleted_count -= edit.count;
+        // tracts removed by this edit, or by undoing it, move the products of the earlier edits forward
+        if(!undo_list.empty())
+            undo_list.back().shift += edit.shift + edit.count +
+                std::accumulate(edit.piece_count.begin(),edit.piece_count.end(),size_t(0));
+        return edit;
     }
+};
+
+TractEditJournal& TractModel::get_journal(void)
+{
+    if(!journal.get())
+        journal = std::make_shared<TractEditJournal>();
+    return *journal;
+}
+//---------------------------------------------------------------------------
+size_t TractModel::get_deleted_track_count(void) const
+{
+    return journal.get() ? journal->deleted_count : 0;
+}
+//---------------------------------------------------------------------------
+void TractModel::release_deleted_tracts(std::vector<std::vector<float> >& released_tracks)
+{
+    released_tracks.clear();
+    if(!journal.get())
+        return;
+    for(auto& edit : journal->undo_list)
+        if(!edit.is_cut && journal->read(edit))
+            for(auto& tract : edit.tracts)
+                released_tracks.push_back(std::move(tract));
+    journal.reset();
 }
 //---------------------------------------------------------------------------
 void TractModel::release_tracts(std::vector<std::vector<float> >& released_tracks)
@@ -1602,34 +3265,39 @@ void TractModel::clear(void)
     tract_data.clear();
     tract_color.clear();
     tract_tag.clear();
-    redo_size.clear();
+    journal.reset();
+    ++tract_version;
 }
 //---------------------------------------------------------------------------
-void TractModel::erase_empty(void)
+void TractModel::erase_empty(size_t from)
 {
-    tract_color.erase(std::remove_if(tract_color.begin(),tract_color.end(),
+    if(from >= tract_data.size())
+        return;
+    tract_color.erase(std::remove_if(tract_color.begin()+int64_t(from),tract_color.end(),
                         [&](const unsigned int& data){return tract_data[&data-&tract_color[0]].empty();}), tract_color.end());
-    tract_tag.erase(std::remove_if(tract_tag.begin(),tract_tag.end(),
+    tract_tag.erase(std::remove_if(tract_tag.begin()+int64_t(from),tract_tag.end(),
                         [&](const unsigned int& data){return tract_data[&data-&tract_tag[0]].empty();}), tract_tag.end());
-    tract_data.erase(std::remove_if(tract_data.begin(),tract_data.end(),
+    tract_data.erase(std::remove_if(tract_data.begin()+int64_t(from),tract_data.end(),
                         [&](const std::vector<float>& data){return data.empty();}), tract_data.end() );
+    ++tract_version;
 }
 //---------------------------------------------------------------------------
 void TractModel::delete_tracts(const std::vector<unsigned int>& tracts_to_delete)
 {
     if (tracts_to_delete.empty())
         return;
+    TractEdit edit;
+    edit.count = tracts_to_delete.size();
     for (unsigned int index = 0;index < tracts_to_delete.size();++index)
     {
-        deleted_tract_data.push_back(std::move(tract_data[tracts_to_delete[index]]));
-        deleted_tract_color.push_back(tract_color[tracts_to_delete[index]]);
-        deleted_tract_tag.push_back(tract_tag[tracts_to_delete[index]]);
+        edit.memory += tract_data[tracts_to_delete[index]].size()*sizeof(float);
+        edit.tracts.push_back(std::move(tract_data[tracts_to_delete[index]]));
+        edit.color.push_back(tract_color[tracts_to_delete[index]]);
+        edit.tag.push_back(tract_tag[tracts_to_delete[index]]);
     }
     erase_empty();
-    deleted_count.push_back(tracts_to_delete.size());
-    is_cut.push_back(0);
-    // no redo once track deleted
-    redo_size.clear();
+    get_journal().add(std::move(edit),false);
+    journal->version = tract_version;
     saved = tract_data.empty();
 }
 //---------------------------------------------------------------------------
@@ -1734,11 +3402,10 @@ void TractModel::delete_repeated(float d)
             track_to_delete.push_back(uint32_t(i));
     delete_tracts(track_to_delete);
 }
-void TractModel::delete_branch(void)
+std::shared_ptr<RoiMgr> TractModel::get_trunk_roi(std::vector<tipl::vector<3,short> >& p1,
+                                                  std::vector<tipl::vector<3,short> >& p2) const
 {
     const float resolution_ratio = 1.0f;
-    std::vector<tipl::vector<3,short> > p1,p2;
-    to_end_point_voxels(p1,p2,resolution_ratio);
     tipl::image<unsigned char, 3>mask;
     ROIRegion r1(geo,vs,trans_to_mni),r2(geo,vs,trans_to_mni);
     r1.resolution_ratio = resolution_ratio;
@@ -1758,7 +3425,13 @@ void TractModel::delete_branch(void)
     std::shared_ptr<RoiMgr> roi_mgr(new RoiMgr(handle));
     roi_mgr->setRegions(r1.get_region_voxels_raw(),r1.resolution_ratio,2,"end1");
     roi_mgr->setRegions(r2.get_region_voxels_raw(),r2.resolution_ratio,2,"end2");
-    filter_by_roi(roi_mgr);
+    return roi_mgr;
+}
+void TractModel::delete_branch(void)
+{
+    std::vector<tipl::vector<3,short> > p1,p2;
+    to_end_point_voxels(p1,p2,1.0f);
+    filter_by_roi(get_trunk_roi(p1,p2));
 }
 //---------------------------------------------------------------------------
 void TractModel::delete_by_length(float length)
@@ -1784,33 +3457,68 @@ void TractModel::cut(float select_angle,const std::vector<tipl::vector<3,float>
 {
     std::vector<unsigned int> selected;
     select(select_angle,dirs,from_pos,selected);
-    std::vector<std::vector<float> > new_tract;
-    std::vector<unsigned int> new_tract_color;
-
-    std::vector<unsigned int> tract_to_delete;
+    std::vector<unsigned int> tract_to_cut;
+    std::vector<std::vector<std::pair<unsigned int,unsigned int> > > keep_range;
     for (unsigned int index = 0;index < selected.size();++index)
         if (selected[index] && selected[index] < tract_data[index].size() &&
             tract_data[index].size() > 6)
         {
-            new_tract.push_back(std::vector<float>(tract_data[index].begin(),tract_data[index].begin()+selected[index]));
-            new_tract_color.push_back(tract_color[index]);
-            new_tract.push_back(std::vector<float>(tract_data[index].begin() + selected[index],tract_data[index].end()));
-            new_tract_color.push_back(tract_color[index]);
-            tract_to_delete.push_back(index);
+            tract_to_cut.push_back(index);
+            keep_range.push_back({std::make_pair(0u,selected[index]),
+                                  std::make_pair(selected[index],uint32_t(tract_data[index].size()))});
         }
-    if(tract_to_delete.empty())
+    if(tract_to_cut.empty())
         return;
-    delete_tracts(tract_to_delete);
-    is_cut.back() = cur_cut_id;
+    cut_tracts(tract_to_cut,keep_range);
+}
+
+// replace tracts by their pieces, keep_range has the [begin,end) of the pieces in floats
+void TractModel::cut_tracts(const std::vector<unsigned int>& tracts_to_cut,
+                            const std::vector<std::vector<std::pair<unsigned int,unsigned int> > >& keep_range,
+                            bool is_redo)
+{
+    auto& j = get_journal();
+    TractEdit edit;
+    edit.is_cut = true;
+    edit.count = tracts_to_cut.size();
+    edit.first_serial = tag_serial;
+    std::vector<std::vector<float> > new_tract;
+    std::vector<unsigned int> new_tract_color;
+    for(size_t i = 0;i < tracts_to_cut.size();++i)
+    {
+        auto& tract = tract_data[tracts_to_cut[i]];
+        std::vector<float> clipped;
+        unsigned int pos = 0;
+        for(const auto& range : keep_range[i])
+        {
+            edit.layout.push_back(range.first-pos);
+            edit.layout.push_back(range.second-range.first);
+            clipped.insert(clipped.end(),tract.begin()+pos,tract.begin()+range.first);
+            new_tract.push_back(std::vector<float>(tract.begin()+range.first,tract.begin()+range.second));
+            new_tract_color.push_back(tract_color[tracts_to_cut[i]]);
+            pos = range.second;
+        }
+        edit.layout.push_back(uint32_t(tract.size())-pos);
+        clipped.insert(clipped.end(),tract.begin()+pos,tract.end());
+        edit.piece_count.push_back(uint32_t(keep_range[i].size()));
+        edit.color.push_back(tract_color[tracts_to_cut[i]]);
+        edit.tag.push_back(tract_tag[tracts_to_cut[i]]);
+        edit.memory += clipped.size()*sizeof(float);
+        edit.tracts.push_back(std::move(clipped));
+        tract.clear();
+    }
+    erase_empty();
+    edit.tail = tract_data.size();
     for (unsigned int index = 0;index < new_tract.size();++index)
     {
         tract_data.push_back(std::move(new_tract[index]));
         tract_color.push_back(new_tract_color[index]);
-        tract_tag.push_back(cur_cut_id);
+        tract_tag.push_back(tag_serial++);
     }
-    ++cur_cut_id;
-    redo_size.clear();
-
+    ++tract_version;
+    j.add(std::move(edit),is_redo);
+    j.version = tract_version;
+    saved = false;
 }
 
 void get_cut_points(const std::vector<std::vector<float> >& tract_data,
@@ -1856,199 +3564,295 @@ void TractModel::cut_by_slice(unsigned int dim, unsigned int pos,bool greater,co
         get_cut_points(tract_data,dim,pos,greater,has_cut);
     else
         get_cut_points(tract_data,dim,pos,greater,*T,has_cut);
-    std::vector<std::vector<float> > new_tract;
-    std::vector<unsigned int> new_tract_color;
-    std::vector<unsigned int> tract_to_delete;
+    // only tracts with cut points are changed, each keeps its pieces of at least two points
+    std::vector<unsigned int> tract_to_cut;
+    std::vector<std::vector<std::pair<unsigned int,unsigned int> > > keep_range;
     for(unsigned int i = 0;i < tract_data.size();++i)
     {
+        if(std::find(has_cut[i].begin(),has_cut[i].end(),true) == has_cut[i].end())
+            continue;
+        std::vector<std::pair<unsigned int,unsigned int> > range;
         bool adding = false;
-        for(unsigned int j = 0,t = 0;j < tract_data[i].size();j += 3,++t)
+        unsigned int from = 0;
+        for(unsigned int t = 0;t < has_cut[i].size();++t)
         {
             if(has_cut[i][t])
             {
                 if(!adding)
                     continue;
                 adding = false;
+                if(t-from >= 2)
+                    range.push_back(std::make_pair(from*3,t*3));
             }
             if(!adding)
             {
-                new_tract.push_back(std::vector<float>());
-                new_tract_color.push_back(tract_color[i]);
+                from = t;
                 adding = true;
             }
-            new_tract.back().push_back(tract_data[i][j]);
-            new_tract.back().push_back(tract_data[i][j+1]);
-            new_tract.back().push_back(tract_data[i][j+2]);
         }
-        tract_to_delete.push_back(i);
+        if(adding && has_cut[i].size()-from >= 2)
+            range.push_back(std::make_pair(from*3,uint32_t(has_cut[i].size()*3)));
+        tract_to_cut.push_back(i);
+        keep_range.push_back(std::move(range));
     }
-    delete_tracts(tract_to_delete);
-    is_cut.back() = cur_cut_id;
-    for (unsigned int index = 0;index < new_tract.size();++index)
-    if(new_tract[index].size() >= 6)
-        {
-            tract_data.push_back(std::move(new_tract[index]));
-            tract_color.push_back(new_tract_color[index]);
-            tract_tag.push_back(cur_cut_id);
-        }
-    ++cur_cut_id;
-    redo_size.clear();
+    if(tract_to_cut.empty())
+        return;
+    cut_tracts(tract_to_cut,keep_range);
 }
 //---------------------------------------------------------------------------
 void TractModel::filter_by_roi(std::shared_ptr<RoiMgr> roi_mgr)
 {
     std::vector<unsigned int> tracts_to_delete;
     for (unsigned int index = 0;index < tract_data.size();++index)
-    if(tract_data[index].size() >= 6)
-    {
-        if(!roi_mgr->have_include(&(tract_data[index][0]),tract_data[index].size()) ||
-           !roi_mgr->fulfill_end_point(tipl::vector<3,float>(tract_data[index][0],
-                                                             tract_data[index][1],
-                                                             tract_data[index][2]),
-                                      tipl::vector<3,float>(tract_data[index][tract_data[index].size()-3],
-                                                             tract_data[index][tract_data[index].size()-2],
-                                                             tract_data[index][tract_data[index].size()-1])))
-        {
+        if(!pass_roi(*roi_mgr,tract_data[index]))
             tracts_to_delete.push_back(index);
-            continue;
-        }
-        if(!roi_mgr->exclusive.empty())
-        {
-            for(unsigned int i = 0;i < tract_data[index].size();i+=3)
-                if(roi_mgr->is_excluded_point(tipl::vector<3,float>(tract_data[index][i],
-                                                                    tract_data[index][i+1],
-                                                                    tract_data[index][i+2])))
-                {
-                    tracts_to_delete.push_back(index);
-                    break;
-                }
-        }
-    }
     delete_tracts(tracts_to_delete);
 }
 //---------------------------------------------------------------------------
 void TractModel::reconnect_track(float distance,float angular_threshold)
 {
-    if(distance >= 2.0f)
-        reconnect_track(distance*0.5f,angular_threshold);
-    std::vector<std::vector<uint32_t> > endpoint_map(geo.size());
-    for (unsigned int index = 0;index < tract_data.size();++index)
-        if(tract_data[index].size() > 6)
-        {
-            tipl::vector<3,float> end1(&tract_data[index][0]);
-            tipl::vector<3,float> end2(&tract_data[index][tract_data[index].size()-3]);
-            end1 /= distance;
-            end2 /= distance;
-            end1.round();
-            end2.round();
-            if(geo.is_valid(end1))
-                endpoint_map[tipl::pixel_index<3>(end1[0],end1[1],end1[2],geo).index()].push_back(index);
-            if(geo.is_valid(end2))
-                endpoint_map[tipl::pixel_index<3>(end2[0],end2[1],end2[2],geo).index()].push_back(index);
-        }
-    tipl::par_for(endpoint_map.size(),[&](size_t index)
-    {
-        if(endpoint_map[index].size() <= 1)
+    if(distance <= 0.0f)
+        return;
+    // scales from fine to coarse, e.g. 1.25, 2.5, 5
+    std::vector<float> scales(1,distance);
+    while(scales.back() >= 2.0f)
+        scales.push_back(scales.back()*0.5f);
+    std::reverse(scales.begin(),scales.end());
+
+    // endpoint 2i is the beginning of tract i and 2i+1 is its end, the directions point into the tract
+    const uint32_t no_match = std::numeric_limits<uint32_t>::max();
+    size_t endpoint_count = tract_data.size()*2;
+    std::vector<tipl::vector<3,float> > end_pos(endpoint_count),end_dir(endpoint_count);
+    std::vector<uint32_t> match(endpoint_count,no_match);
+    std::vector<char> active(endpoint_count);
+    tipl::par_for(tract_data.size(),[&](size_t i)
+    {
+        const auto& t = tract_data[i];
+        if(t.size() <= 6)
             return;
-        std::set<uint32_t> sorted_list(endpoint_map[index].begin(),endpoint_map[index].end());
-        endpoint_map[index] = std::vector<uint32_t>(sorted_list.begin(),sorted_list.end());
+        end_pos[i*2] = &t[0];
+        end_dir[i*2] = &t[3];
+        end_pos[i*2+1] = &t[t.size()-3];
+        end_dir[i*2+1] = &t[t.size()-6];
+        for(size_t e = i*2;e <= i*2+1;++e)
+        {
+            end_dir[e] -= end_pos[e];
+            end_dir[e].normalize();
+            active[e] = 1;
+        }
     });
-    // 0: track1 beg
-    // 1: track1 end
-    // 2: track2 beg
-    // 3: track2 end
-    const int compare_pair[4][2] = {{0,2},{0,3},{1,2},{1,3}}; // for checking which end to connect
-    for (size_t pos = 0;pos < geo.size();++pos)
-        if(endpoint_map[pos].size() >= 2)
-        {
-            std::vector<uint32_t>& track_list = endpoint_map[pos];
-            std::map<float,std::tuple<uint32_t,uint32_t,uint32_t> > merge_list;
-            for(uint32_t i = 0;i < track_list.size();++i)
-                for(uint32_t j = i+1;j < track_list.size();++j)
-                {
-                    uint32_t t1 = track_list[i];
-                    uint32_t t2 = track_list[j];
-                    if(tract_data[t1].size() <= 6 || tract_data[t2].size() <= 6)
-                        continue;
-                    tipl::vector<3,float> end[4],dir[4];
-                    end[0] = &tract_data[t1][0];  // 0: track1 beg
-                    end[1] = &tract_data[t1][tract_data[t1].size()-3]; // 1: track1 end
-                    end[2] = &tract_data[t2][0];  // 2: track2 beg
-                    end[3] = &tract_data[t2][tract_data[t2].size()-3]; // 3: track2 end
-                    dir[0] = &tract_data[t1][3];
-                    dir[1] = &tract_data[t1][tract_data[t1].size()-6];
-                    dir[2] = &tract_data[t2][3];
-                    dir[3] = &tract_data[t2][tract_data[t2].size()-6];
-                    for(uint32_t k = 0;k < 4;++k)
-                    {
-                        dir[k] -= end[k];
-                        dir[k].normalize();
-                    }
-                    for(uint32_t k = 0;k < 4;++k)
-                    {
-                        int p1 = compare_pair[k][0];
-                        int p2 = compare_pair[k][1];
-                        if(std::fabs(end[p1][0]-end[p2][0]) > distance)
-                            continue;
-                        tipl::vector<3> dis_end = end[p1]-end[p2];
-                        float dis = float(dis_end.length());
-                        if(dis > distance)
-                            continue;
-                        float angle = -(dir[p1]*dir[p2]);
-                        if(angle < angular_threshold)
-                            continue;
-                        dis_end.normalize();
-                        float angle1 = dis_end*dir[p1];
-                        if(angle1 < angular_threshold)
-                            continue;
-                        float angle2 = -dis_end*dir[p2];
-                        if(angle2 < angular_threshold)
-                            continue;
-                        merge_list[dis*angle*angle1*angle2] = std::make_tuple(i,j,k);
-                        break;
-                    }
-                }
-            std::vector<char> merged(track_list.size());
-            for(auto& iter : merge_list)
+
+    // tracts joined by accepted pairs, a pair within a chain would close a loop
+    std::vector<uint32_t> chain(tract_data.size());
+    for(uint32_t i = 0;i < chain.size();++i)
+        chain[i] = i;
+    auto find_chain = [&](uint32_t t)
+    {
+        while(chain[t] != t)
+            t = chain[t] = chain[chain[t]];
+        return t;
+    };
+
+    // sparse endpoint grid: endpoints sorted once by the Morton code of their cells at the finest scale,
+    // the cells of a coarser scale are then runs of the same list sharing a code prefix
+    const int level_count = int(scales.size());
+    const int64_t max_cell = (int64_t(1) << 21)-1;
+    tipl::vector<3,float> origin(std::numeric_limits<float>::max(),std::numeric_limits<float>::max(),std::numeric_limits<float>::max());
+    for(size_t e = 0;e < endpoint_count;++e)
+        if(active[e])
+            for(int d = 0;d < 3;++d)
+                origin[d] = std::min(origin[d],end_pos[e][d]);
+    auto expand_bits = [](uint64_t v)
+    {
+        v &= 0x1FFFFF;
+        v = (v | (v << 32)) & 0x1F00000000FFFF;
+        v = (v | (v << 16)) & 0x1F0000FF0000FF;
+        v = (v | (v << 8)) & 0x100F00F00F00F00F;
+        v = (v | (v << 4)) & 0x10C30C30C30C30C3;
+        v = (v | (v << 2)) & 0x1249249249249249;
+        return v;
+    };
+    auto cell_key = [&](int64_t x,int64_t y,int64_t z)
+    {
+        return expand_bits(uint64_t(x)) | (expand_bits(uint64_t(y)) << 1) | (expand_bits(uint64_t(z)) << 2);
+    };
+    auto fine_cell = [&](const tipl::vector<3,float>& p,int d)
+    {
+        // offset so that the neighbors of cells at all scales stay positive
+        return std::min<int64_t>(max_cell-(int64_t(1) << level_count),
+                    int64_t(std::floor((p[d]-origin[d])/scales.front()))+(int64_t(1) << level_count));
+    };
+    std::vector<std::pair<uint64_t,uint32_t> > grid_endpoint;
+    for(size_t e = 0;e < endpoint_count;++e)
+        if(active[e])
+            grid_endpoint.push_back(std::make_pair(0,uint32_t(e)));
+    tipl::par_for(grid_endpoint.size(),[&](size_t i)
+    {
+        const auto& p = end_pos[grid_endpoint[i].second];
+        grid_endpoint[i].first = cell_key(fine_cell(p,0),fine_cell(p,1),fine_cell(p,2));
+    });
+    std::sort(grid_endpoint.begin(),grid_endpoint.end());
+
+    struct candidate_pair{
+        float score;
+        uint32_t e1,e2;
+        bool operator<(const candidate_pair& rhs) const
+        {return std::tie(score,e1,e2) < std::tie(rhs.score,rhs.e1,rhs.e2);}
+    };
+    for(int level = 0;level < level_count;++level)
+    {
+        float scale = scales[size_t(level)];
+        // endpoints already connected at the finer scales are no longer free
+        grid_endpoint.erase(std::remove_if(grid_endpoint.begin(),grid_endpoint.end(),
+                    [&](const std::pair<uint64_t,uint32_t>& e){return match[e.second] != no_match;}),grid_endpoint.end());
+        std::vector<tipl::vector<3,float> > grid_pos(grid_endpoint.size());
+        for(size_t i = 0;i < grid_endpoint.size();++i)
+            grid_pos[i] = end_pos[grid_endpoint[i].second];
+        std::vector<size_t> cell_begin;
+        for(size_t i = 0;i < grid_endpoint.size();++i)
+            if(i == 0 || (grid_endpoint[i].first >> (3*level)) != (grid_endpoint[i-1].first >> (3*level)))
+                cell_begin.push_back(i);
+        cell_begin.push_back(grid_endpoint.size());
+        // open addressing hash table of the occupied cells
+        const uint64_t empty_cell = std::numeric_limits<uint64_t>::max();
+        int hash_bits = 1;
+        while((size_t(1) << hash_bits) < cell_begin.size()*2)
+            ++hash_bits;
+        std::vector<std::pair<uint64_t,size_t> > grid(size_t(1) << hash_bits,std::make_pair(empty_cell,size_t(0)));
+        auto hash = [&](uint64_t key){return size_t((key*0x9E3779B97F4A7C15ull) >> (64-hash_bits));};
+        for(size_t c = 0;c+1 < cell_begin.size();++c)
+        {
+            uint64_t key = grid_endpoint[cell_begin[c]].first >> (3*level);
+            size_t h = hash(key);
+            while(grid[h].first != empty_cell)
+                h = (h+1) & (grid.size()-1);
+            grid[h] = std::make_pair(key,c);
+        }
+        auto find_cell = [&](uint64_t key)
+        {
+            for(size_t h = hash(key);grid[h].first != empty_cell;h = (h+1) & (grid.size()-1))
+                if(grid[h].first == key)
+                    return grid[h].second;
+            return cell_begin.size();
+        };
+
+        auto get_score = [&](size_t i,size_t j,float& score)
+        {
+            tipl::vector<3,float> dis_end = grid_pos[i]-grid_pos[j];
+            if(std::fabs(dis_end[0]) > scale)
+                return false;
+            float dis = float(dis_end.length());
+            if(dis > scale)
+                return false;
+            const auto& dir1 = end_dir[grid_endpoint[i].second];
+            const auto& dir2 = end_dir[grid_endpoint[j].second];
+            float angle = -(dir1*dir2);
+            if(angle < angular_threshold)
+                return false;
+            float angle1 = 1.0f,angle2 = 1.0f;
+            if(dis > 0.0f)
+            {
+                dis_end.normalize();
+                angle1 = dis_end*dir1;
+                if(angle1 < angular_threshold)
+                    return false;
+                angle2 = -dis_end*dir2;
+                if(angle2 < angular_threshold)
+                    return false;
+            }
+            score = dis*angle*angle1*angle2;
+            return true;
+        };
+        std::vector<std::vector<candidate_pair> > cell_candidates(cell_begin.size()-1);
+        tipl::par_for(cell_candidates.size(),[&](size_t c)
+        {
+            const auto& p = end_pos[grid_endpoint[cell_begin[c]].second];
+            int64_t x = fine_cell(p,0) >> level,y = fine_cell(p,1) >> level,z = fine_cell(p,2) >> level;
+            uint64_t own_key = grid_endpoint[cell_begin[c]].first >> (3*level);
+            // cells are as large as the scale, so only the adjacent cells need to be checked
+            for(int64_t dz = -1;dz <= 1;++dz)
+            for(int64_t dy = -1;dy <= 1;++dy)
+            for(int64_t dx = -1;dx <= 1;++dx)
             {
-                uint32_t i = std::get<0>(iter.second);
-                uint32_t j = std::get<1>(iter.second);
-                uint32_t k = std::get<2>(iter.second);
-                if(merged[i] || merged[j])
+                uint64_t key = cell_key(x+dx,y+dy,z+dz);
+                // each pair of cells is visited once
+                if(key < own_key)
                     continue;
-                merged[i] = 1;
-                merged[j] = 1;
-                uint32_t t1 = track_list[i];
-                uint32_t t2 = track_list[j];
-                // reverse track
-                if(k == 1)// k = 1: track1 beg connects tract2 end
-                {
-                    tract_data[t2].insert(tract_data[t2].end(),tract_data[t1].begin(),tract_data[t1].end());
-                    tract_data[t1].clear();
+                size_t to_cell = find_cell(key);
+                if(to_cell == cell_begin.size())
                     continue;
-                }
-
-                if(k == 0 || k == 3)
-                {
-                    auto rt = ((k == 0) ? t1 : t2);
-                    float* beg1 = &tract_data[rt][0];
-                    float* end1 = &tract_data[rt][tract_data[rt].size()-3];
-                    while(beg1 < end1)
+                size_t to_begin = cell_begin[to_cell],to_end = cell_begin[to_cell+1];
+                for(size_t i = cell_begin[c];i < cell_begin[c+1];++i)
+                    for(size_t j = (key == own_key ? i+1 : to_begin);j < to_end;++j)
                     {
-                        std::swap(beg1[0],end1[0]);
-                        std::swap(beg1[1],end1[1]);
-                        std::swap(beg1[2],end1[2]);
-                        beg1 += 3;
-                        end1 -= 3;
+                        uint32_t e1 = grid_endpoint[i].second;
+                        uint32_t e2 = grid_endpoint[j].second;
+                        float score;
+                        if(e1/2 != e2/2 && get_score(i,j,score))
+                            cell_candidates[c].push_back(candidate_pair{score,std::min(e1,e2),std::max(e1,e2)});
                     }
+            }
+        });
+        std::vector<candidate_pair> candidates;
+        for(auto& each : cell_candidates)
+            candidates.insert(candidates.end(),each.begin(),each.end());
+        std::sort(candidates.begin(),candidates.end());
+        for(const auto& each : candidates)
+        {
+            if(match[each.e1] != no_match || match[each.e2] != no_match)
+                continue;
+            uint32_t c1 = find_chain(each.e1/2),c2 = find_chain(each.e2/2);
+            if(c1 == c2)
+                continue;
+            chain[c2] = c1;
+            match[each.e1] = each.e2;
+            match[each.e2] = each.e1;
+        }
+    }
+
+    // concatenate each chain into the tract at its first free end
+    std::vector<uint32_t> chain_start(tract_data.size(),no_match);
+    for(uint32_t t = 0;t < tract_data.size();++t)
+        if((match[t*2] == no_match) != (match[t*2+1] == no_match))
+        {
+            auto& start = chain_start[find_chain(t)];
+            start = std::min(start,t);
+        }
+    chain_start.erase(std::remove(chain_start.begin(),chain_start.end(),no_match),chain_start.end());
+    tipl::par_for(chain_start.size(),[&](size_t i)
+    {
+        uint32_t t = chain_start[i];
+        uint32_t in = (match[t*2] == no_match ? t*2 : t*2+1);
+        std::vector<float> new_tract;
+        std::vector<uint32_t> members;
+        while(true)
+        {
+            const auto& data = tract_data[t];
+            new_tract.insert(new_tract.end(),data.begin(),data.end());
+            if(in != t*2)
+            {
+                float* beg1 = &new_tract[new_tract.size()-data.size()];
+                float* end1 = &new_tract[new_tract.size()-3];
+                while(beg1 < end1)
+                {
+                    std::swap(beg1[0],end1[0]);
+                    std::swap(beg1[1],end1[1]);
+                    std::swap(beg1[2],end1[2]);
+                    beg1 += 3;
+                    end1 -= 3;
                 }
-                // k = 0: track1 beg connects tract2 beg (track1 reversed)
-                // k = 2: track1 end connects tract2 beg
-                // k = 3: track1 end connects tract2 end (track2 reversed)
-                tract_data[t1].insert(tract_data[t1].end(),tract_data[t2].begin(),tract_data[t2].end());
-                tract_data[t2].clear();
             }
+            members.push_back(t);
+            uint32_t out = in^1;
+            if(match[out] == no_match)
+                break;
+            in = match[out];
+            t = in/2;
         }
+        for(auto m : members)
+            tract_data[m].clear();
+        tract_data[chain_start[i]].swap(new_tract);
+    });
     erase_empty();
 }
 //---------------------------------------------------------------------------
@@ -2267,55 +4071,135 @@ bool TractModel::trim(void)
 //---------------------------------------------------------------------------
 void TractModel::clear_deleted(void)
 {
-    deleted_count.clear();
-    deleted_tract_data.clear();
-    deleted_tract_color.clear();
-    deleted_tract_tag.clear();
-    redo_size.clear();
+    journal.reset();
 }
 
 void TractModel::undo(void)
 {
-    if (deleted_count.empty())
+    if (!journal.get() || journal->undo_list.empty())
+        return;
+    auto& j = *journal;
+    bool in_place = (j.version == tract_version);
+    // tracts changed outside of the history, the redo positions are lost
+    if(!in_place)
+        j.redo_list.clear();
+    TractEdit edit = j.pop_undo();
+    if(!j.read(edit))
+    {
+        std::cout << "cannot read the undo history from " << j.spill_file_name << std::endl;
+        journal.reset();
         return;
-    redo_size.push_back(std::make_pair((unsigned int)tract_data.size(),deleted_count.back()));
-    for (unsigned int index = 0;index < deleted_count.back();++index)
-    {
-        tract_data.push_back(std::move(deleted_tract_data.back()));
-        tract_color.push_back(deleted_tract_color.back());
-        tract_tag.push_back(deleted_tract_tag.back());
-        deleted_tract_data.pop_back();
-        deleted_tract_color.pop_back();
-        deleted_tract_tag.pop_back();
-    }
-    // handle the cut situation
-    if(is_cut.back())
-    {
-        for(int i = 0;i < tract_tag.size();++i)
-            if(tract_tag[i] == is_cut.back())
-                tract_data[i].clear();
-        erase_empty();
-    }
-    is_cut.pop_back();
-    deleted_count.pop_back();
+    }
+    size_t restore_pos = tract_data.size();
+    if(edit.is_cut)
+    {
+        // the pieces are tagged with serial numbers, and they are after edit.tail unless the tracts were changed outside of the history
+        size_t piece_total = std::accumulate(edit.piece_count.begin(),edit.piece_count.end(),size_t(0));
+        size_t from = in_place && edit.tail > edit.shift ? edit.tail-edit.shift : 0;
+        std::vector<std::vector<float> > pieces(piece_total);
+        size_t found = 0,last_found = 0;
+        for(size_t i = from;i < tract_data.size();++i)
+            if(tract_tag[i] >= edit.first_serial && tract_tag[i]-edit.first_serial < piece_total)
+            {
+                pieces[tract_tag[i]-edit.first_serial].swap(tract_data[i]);
+                ++found;
+                last_found = i;
+            }
+        erase_empty(from);
+        // the tracts restored by the later undo move forward, unless the pieces were among them
+        for(auto& each : j.redo_list)
+            if(found && last_found >= each.tail)
+            {
+                j.redo_list.clear();
+                break;
+            }
+        for(auto& each : j.redo_list)
+            each.tail -= found;
+        restore_pos = tract_data.size();
+        for(size_t i = 0,piece = 0,l = 0;i < edit.count;++i)
+        {
+            const auto& clipped = edit.tracts[i];
+            std::vector<float> tract;
+            tract.reserve(clipped.size());
+            auto clipped_pos = clipped.begin();
+            for(unsigned int k = 0;k < edit.piece_count[i];++k,++piece,l += 2)
+            {
+                tract.insert(tract.end(),clipped_pos,clipped_pos+edit.layout[l]);
+                clipped_pos += edit.layout[l];
+                tract.insert(tract.end(),pieces[piece].begin(),pieces[piece].end());
+            }
+            tract.insert(tract.end(),clipped_pos,clipped_pos+edit.layout[l]);
+            ++l;
+            tract_data.push_back(std::move(tract));
+            tract_color.push_back(edit.color[i]);
+            tract_tag.push_back(edit.tag[i]);
+        }
+    }
+    else
+    {
+        for (size_t index = 0;index < edit.count;++index)
+        {
+            tract_data.push_back(std::move(edit.tracts[index]));
+            tract_color.push_back(edit.color[index]);
+            tract_tag.push_back(edit.tag[index]);
+        }
+    }
+    // keep only what is needed to redo the edit on the restored tracts
+    std::vector<std::vector<float> >().swap(edit.tracts);
+    edit.memory = 0;
+    edit.tail = restore_pos;
+    edit.shift = 0;
+    j.redo_list.push_back(std::move(edit));
     saved = false;
+    ++tract_version;
+    j.version = tract_version;
 }
 
 
 //---------------------------------------------------------------------------
 void TractModel::redo(void)
 {
-    if(redo_size.empty())
+    if(!journal.get() || journal->redo_list.empty())
+        return;
+    auto& j = *journal;
+    // the restored tracts are no longer at known positions
+    if(j.version != tract_version || j.redo_list.back().tail+j.redo_list.back().count > tract_data.size())
+    {
+        j.redo_list.clear();
+        return;
+    }
+    TractEdit edit = std::move(j.redo_list.back());
+    j.redo_list.pop_back();
+    if(edit.is_cut)
+    {
+        std::vector<unsigned int> tract_to_cut(edit.count);
+        std::vector<std::vector<std::pair<unsigned int,unsigned int> > > keep_range(edit.count);
+        for(size_t i = 0,l = 0;i < edit.count;++i)
+        {
+            tract_to_cut[i] = uint32_t(edit.tail+i);
+            unsigned int pos = 0;
+            for(unsigned int k = 0;k < edit.piece_count[i];++k,l += 2)
+            {
+                pos += edit.layout[l];
+                keep_range[i].push_back(std::make_pair(pos,pos+edit.layout[l+1]));
+                pos += edit.layout[l+1];
+            }
+            ++l;
+        }
+        cut_tracts(tract_to_cut,keep_range,true);
         return;
-    std::vector<unsigned int> redo_tracts(redo_size.back().second);
-    for (unsigned int index = 0;index < redo_tracts.size();++index)
-        redo_tracts[index] = redo_size.back().first + index;
-    redo_size.pop_back();
-    // keep redo because delete tracts will clear redo
-    std::vector<std::pair<unsigned int,unsigned int> > keep_redo;
-    keep_redo.swap(redo_size);
-    delete_tracts(redo_tracts);
-    keep_redo.swap(redo_size);
+    }
+    edit.tracts.resize(edit.count);
+    for (size_t index = 0;index < edit.count;++index)
+    {
+        edit.memory += tract_data[edit.tail+index].size()*sizeof(float);
+        edit.tracts[index].swap(tract_data[edit.tail+index]);
+    }
+    erase_empty(edit.tail);
+    ++tract_version;
+    j.add(std::move(edit),true);
+    j.version = tract_version;
+    saved = tract_data.empty();
 }
 //---------------------------------------------------------------------------
 void TractModel::add_tracts(std::vector<std::vector<float> >& new_tracks)
@@ -2336,6 +4220,7 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract,tipl::rg
         tract_tag.push_back(0);
     }
     saved = false;
+    ++tract_version;
 }
 
 void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract, unsigned int length_threshold,tipl::rgb color)
@@ -2350,10 +4235,17 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract, unsigne
         tract_tag.push_back(0);
     }
     saved = false;
+    ++tract_version;
 }
 //---------------------------------------------------------------------------
 void TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
                                  const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    accumulate_density_map(tract_data,mapping,transformation,endpoint);
+}
+// also used by TractReader, one chunk of tracts at a time
+void accumulate_density_map(const std::vector<std::vector<float> >& tract_data,tipl::image<unsigned int,3>& mapping,
+                            const tipl::matrix<4,4,float>& transformation,bool endpoint)
 {
     tipl::geometry<3> geo = mapping.geometry();
     tipl::par_for(tract_data.size(),[&](unsigned int i)
@@ -2615,7 +4507,7 @@ inline tipl::vector<3,short> get_rounded_voxel(const float* ptr,float ratio)
     return tipl::vector<3,short>(p[0],p[1],p[2]);
 }
 void TractModel::to_end_point_voxels(std::vector<tipl::vector<3,short> >& points1,
-                               std::vector<tipl::vector<3,short> >& points2,float ratio)
+                               std::vector<tipl::vector<3,short> >& points2,float ratio) const
 {
     std::vector<char> dir;
     get_tract_dir(tract_data,dir);
@@ -2649,7 +4541,7 @@ void TractModel::to_end_point_voxels(std::vector<tipl::vector<3,short> >& points
 }
 
 void TractModel::to_end_point_voxels(std::vector<tipl::vector<3,short> >& points1,
-                        std::vector<tipl::vector<3,short> >& points2,float ratio,float end_dis)
+                        std::vector<tipl::vector<3,short> >& points2,float ratio,float end_dis) const
 {
     std::vector<char> dir;
     get_tract_dir(tract_data,dir);
@@ -2712,98 +4604,214 @@ void TractModel::to_end_point_voxels(std::vector<tipl::vector<3,short> >& points
 }
 
 
-void TractModel::get_quantitative_info(std::shared_ptr<fib_data> handle,std::string& result)
+inline uint64_t voxel_key(const tipl::vector<3,short>& p)
+{
+    return (uint64_t(uint16_t(p[0])) << 32) | (uint64_t(uint16_t(p[1])) << 16) | uint64_t(uint16_t(p[2]));
+}
+inline tipl::vector<3,short> key_voxel(uint64_t key)
+{
+    return tipl::vector<3,short>(short(uint16_t(key >> 32)),short(uint16_t(key >> 16)),short(uint16_t(key)));
+}
+// remove duplicated voxels once the list has doubled since the last compaction
+inline void compact_voxel_keys(std::vector<uint64_t>& keys,size_t& unique_size)
+{
+    if(keys.size() < 2*unique_size+(1 << 16))
+        return;
+    std::sort(keys.begin(),keys.end());
+    keys.erase(std::unique(keys.begin(),keys.end()),keys.end());
+    unique_size = keys.size();
+}
+// merge sorted voxel lists from each thread into one sorted list without duplicates
+void merge_voxel_keys(std::vector<std::vector<uint64_t> >& keys)
+{
+    tipl::par_for(keys.size(),[&](size_t i)
+    {
+        std::sort(keys[i].begin(),keys[i].end());
+        keys[i].erase(std::unique(keys[i].begin(),keys[i].end()),keys[i].end());
+    });
+    for(size_t i = 1;i < keys.size();++i)
+    {
+        std::vector<uint64_t> merged;
+        merged.reserve(keys[0].size()+keys[i].size());
+        std::set_union(keys[0].begin(),keys[0].end(),keys[i].begin(),keys[i].end(),std::back_inserter(merged));
+        merged.swap(keys[0]);
+        std::vector<uint64_t>().swap(keys[i]);
+    }
+    keys.resize(1);
+}
+void TractModel::get_quantitative_info(std::shared_ptr<fib_data> handle,std::string& result) const
 {
     if(tract_data.empty())
         return;
     std::ostringstream out;
     std::vector<std::string> titles;
     std::vector<float> data;
+    std::vector<unsigned int> index_list;
+    for(unsigned int i = 0;i < handle->view_item.size();++i)
+        if(handle->view_item[i].name != "color")
+            index_list.push_back(i);
+    std::vector<float> mean_values(index_list.size());
     {
         const float resolution_ratio = 2.0f;
         float voxel_volume = vs[0]*vs[1]*vs[2];
         const float PI = 3.14159265358979323846f;
-        float tract_volume, trunk_volume, tract_area, tract_length, span, curl, bundle_diameter;
-        tipl::image<unsigned char, 3> volume;
+        float tract_volume, trunk_volume, tract_area = 0.0f, tract_length, span, curl, bundle_diameter;
 
 
         titles.push_back("number of tracts");
         data.push_back(tract_data.size());
 
-        // mean length
+        // end points at the resolution ratio, and at the voxel size for the trunk
+        std::vector<tipl::vector<3,short> > endpoint1,endpoint2,trunk_end1,trunk_end2;
+        to_end_point_voxels(endpoint1,endpoint2,resolution_ratio);
+        to_end_point_voxels(trunk_end1,trunk_end2,1.0f);
+        auto roi_mgr = get_trunk_roi(trunk_end1,trunk_end2);
+
+        // one pass over the tracts for the length, voxels, and mean index values
+        // each thread reduces to its own accumulator
+        struct reducer{
+            double sum_length = 0.0,sum_end_dis = 0.0;
+            // voxels of all tracts and of the trunk that delete_branch keeps
+            std::vector<uint64_t> voxels,trunk_voxels;
+            size_t voxels_unique = 0,trunk_voxels_unique = 0;
+            std::vector<double> sum_index;
+            std::vector<size_t> index_count;
+        };
+        std::vector<reducer> reducers(std::thread::hardware_concurrency());
+        for(auto& each : reducers)
+        {
+            each.sum_index.resize(index_list.size());
+            each.index_count.resize(index_list.size());
+        }
+        tipl::par_for2(tract_data.size(),[&](size_t i,size_t thread)
         {
-            float sum_length = 0.0f;
-            float sum_end_dis = 0.0f;
-            for (unsigned int i = 0;i < tract_data.size();++i)
+            auto& r = reducers[thread];
+            const auto& tract = tract_data[i];
+            float length = 0.0f;
+            for (size_t j = 3;j < tract.size();j += 3)
+                length += float(tipl::vector<3,float>(
+                    vs[0]*(tract[j]-tract[j-3]),
+                    vs[1]*(tract[j+1]-tract[j-2]),
+                    vs[2]*(tract[j+2]-tract[j-1])).length());
+            r.sum_length += double(length);
+            r.sum_end_dis += (tipl::vector<3,float>(&tract[0])-tipl::vector<3,float>(&tract[tract.size()-3])).length();
+
+            // voxels passed by the tract, the same sampling as to_voxel
+            if(tract.size() >= 6)
             {
-                float length = 0.0;
-                for (unsigned int j = 3;j < tract_data[i].size();j += 3)
+                size_t begin = r.voxels.size();
+                float voxel_length_2 = 0.5f/resolution_ratio;
+                float step_size = float((tipl::vector<3>(&tract[0])-tipl::vector<3>(&tract[3])).length());
+                for (size_t j = 3;j < tract.size();j += 3)
+                {
+                    tipl::vector<3> dir(&tract[j]);
+                    dir -= tipl::vector<3>(&tract[j-3]);
+                    for(float d = 0.0;d < step_size;d += voxel_length_2)
+                    {
+                        tipl::vector<3> cur(dir);
+                        cur *= d/step_size;
+                        cur += tipl::vector<3>(&tract[j-3]);
+                        cur *= resolution_ratio;
+                        cur.round();
+                        uint64_t key = voxel_key(tipl::vector<3,short>(cur));
+                        if(r.voxels.size() == begin || r.voxels.back() != key)
+                            r.voxels.push_back(key);
+                    }
+                }
+                std::sort(r.voxels.begin()+int64_t(begin),r.voxels.end());
+                r.voxels.erase(std::unique(r.voxels.begin()+int64_t(begin),r.voxels.end()),r.voxels.end());
+                if(roi_mgr->have_include(&tract[0],uint32_t(tract.size())) &&
+                   roi_mgr->fulfill_end_point(tipl::vector<3,float>(&tract[0]),
+                                              tipl::vector<3,float>(&tract[tract.size()-3])))
                 {
-                    length += float(tipl::vector<3,float>(
-                        vs[0]*(tract_data[i][j]-tract_data[i][j-3]),
-                        vs[1]*(tract_data[i][j+1]-tract_data[i][j-2]),
-                        vs[2]*(tract_data[i][j+2]-tract_data[i][j-1])).length());
+                    r.trunk_voxels.insert(r.trunk_voxels.end(),r.voxels.begin()+int64_t(begin),r.voxels.end());
+                    compact_voxel_keys(r.trunk_voxels,r.trunk_voxels_unique);
+                }
+                compact_voxel_keys(r.voxels,r.voxels_unique);
+            }
 
+            std::vector<float> values;
+            for(size_t k = 0;k < index_list.size();++k)
+            {
+                get_tract_data(handle,uint32_t(i),index_list[k],values);
+                r.sum_index[k] += std::accumulate(values.begin(),values.end(),0.0);
+                r.index_count[k] += values.size();
+            }
+        });
+        {
+            double sum_length = 0.0,sum_end_dis = 0.0;
+            std::vector<double> sum_index(index_list.size());
+            std::vector<size_t> index_count(index_list.size());
+            for(const auto& each : reducers)
+            {
+                sum_length += each.sum_length;
+                sum_end_dis += each.sum_end_dis;
+                for(size_t k = 0;k < index_list.size();++k)
+                {
+                    sum_index[k] += each.sum_index[k];
+                    index_count[k] += each.index_count[k];
                 }
-                sum_length += length;
-                sum_end_dis += float((tipl::vector<3,float>(&tract_data[i][0])-
-                                    tipl::vector<3,float>(&tract_data[i][tract_data[i].size()-3])).length());
             }
-            tract_length = sum_length/float(tract_data.size());
-            span = sum_end_dis/float(tract_data.size());
-            curl = sum_length/sum_end_dis;
-
+            tract_length = float(sum_length/double(tract_data.size()));
+            span = float(sum_end_dis/double(tract_data.size()));
+            curl = float(sum_length/sum_end_dis);
+            for(size_t k = 0;k < index_list.size();++k)
+                mean_values[k] = index_count[k] ? float(sum_index[k]/double(index_count[k])) : 0.0f;
         }
 
-
+        // volume of all tracts and of the trunk
         {
-            std::vector<tipl::vector<3,short> > points;
-            to_voxel(points,resolution_ratio);
+            std::vector<std::vector<uint64_t> > all_voxels(reducers.size()),trunk_voxels(reducers.size());
+            for(size_t thread = 0;thread < reducers.size();++thread)
+            {
+                all_voxels[thread].swap(reducers[thread].voxels);
+                trunk_voxels[thread].swap(reducers[thread].trunk_voxels);
+            }
+            merge_voxel_keys(all_voxels);
+            merge_voxel_keys(trunk_voxels);
+            const auto& points = all_voxels[0];
             tract_volume = points.size()*voxel_volume/resolution_ratio/resolution_ratio/resolution_ratio;
+            trunk_volume = trunk_voxels[0].size()*voxel_volume/resolution_ratio/resolution_ratio/resolution_ratio;
             bundle_diameter = 2.0f*float(std::sqrt(tract_volume/tract_length/PI));
 
-
-            // now next convert point list to volume
-            tipl::vector<3,short> max_value(points[0]), min_value(points[0]);
-            tipl::bounding_box_mt(points,max_value,min_value);
-
-            max_value += tipl::vector<3,short>(1, 1, 1);
-            min_value -= tipl::vector<3,short>(1, 1, 1);
-
-            tipl::geometry<3> geo(max_value[0] - min_value[0],
-                                  max_value[1] - min_value[1],
-                                  max_value[2] - min_value[2]);
-
-            volume.resize(geo);
-            tipl::par_for(points.size(),[&](unsigned int index)
+            // surface area
+            if(!points.empty())
             {
-                tipl::vector<3,short> point(points[index]);
-                point -= min_value;
-                volume[tipl::pixel_index<3>(point[0], point[1], point[2],geo).index()] = 1;
-            });
-
-            delete_branch();
-            to_voxel(points,resolution_ratio);
-            undo();
-            trunk_volume = points.size()*voxel_volume/resolution_ratio/resolution_ratio/resolution_ratio;
-
-        }
-        // surface area
-        {
-            tipl::image<unsigned char, 3> edge;
-            tipl::morphology::edge(volume,edge);
-            size_t num = 0;
-            for(size_t i = 0;i < edge.size();++i)
-                if(edge[i])
-                    ++num;
-            tract_area = float(num)*vs[0]*vs[1]/resolution_ratio/resolution_ratio;
-
+                tipl::vector<3,short> max_value(key_voxel(points[0])), min_value(max_value);
+                for(auto key : points)
+                {
+                    auto p = key_voxel(key);
+                    for(unsigned char d = 0;d < 3;++d)
+                    {
+                        max_value[d] = std::max(max_value[d],p[d]);
+                        min_value[d] = std::min(min_value[d],p[d]);
+                    }
+                }
+                max_value += tipl::vector<3,short>(1, 1, 1);
+                min_value -= tipl::vector<3,short>(1, 1, 1);
+
+                tipl::geometry<3> geo(max_value[0] - min_value[0],
+                                      max_value[1] - min_value[1],
+                                      max_value[2] - min_value[2]);
+                tipl::image<unsigned char, 3> volume(geo);
+                tipl::par_for(points.size(),[&](size_t index)
+                {
+                    tipl::vector<3,short> point(key_voxel(points[index]));
+                    point -= min_value;
+                    volume[tipl::pixel_index<3>(point[0], point[1], point[2],geo).index()] = 1;
+                });
+                tipl::image<unsigned char, 3> edge;
+                tipl::morphology::edge(volume,edge);
+                size_t num = 0;
+                for(size_t i = 0;i < edge.size();++i)
+                    if(edge[i])
+                        ++num;
+                tract_area = float(num)*vs[0]*vs[1]/resolution_ratio/resolution_ratio;
+            }
         }
         // end points
         float end_area1,end_area2,radius1,radius2;
         {
-            std::vector<tipl::vector<3,short> > endpoint1,endpoint2;
-            to_end_point_voxels(endpoint1,endpoint2,resolution_ratio);
             // end point surface 1 and 2
             end_area1 = float(endpoint1.size())*vs[0]*vs[1]/resolution_ratio/resolution_ratio;
             end_area2 = float(endpoint2.size())*vs[0]*vs[1]/resolution_ratio/resolution_ratio;
@@ -2858,24 +4866,9 @@ void TractModel::get_quantitative_info(std::shared_ptr<fib_data> handle,std::str
         data.push_back(PI*radius2*radius2/end_area2);        titles.push_back("irregularity of end region 2");
     }
 
-    // output mean and std of each index
-    {
-        std::vector<float> mean_values(handle->view_item.size());
-        tipl::par_for(handle->view_item.size(),[&](size_t data_index)
-        {
-            if(handle->view_item[data_index].name == "color")
-                return;
-            get_tracts_data(handle,uint32_t(data_index),mean_values[data_index]);
-        });
-
-        for(size_t data_index = 0;data_index < handle->view_item.size();++data_index)
-        {
-            if(handle->view_item[data_index].name == "color")
-                continue;
-            data.push_back(mean_values[data_index]);
-        }
-        handle->get_index_list(titles);
-    }
+    // output mean of each index
+    data.insert(data.end(),mean_values.begin(),mean_values.end());
+    handle->get_index_list(titles);
 
 
     for(unsigned int index = 0;index < data.size() && index < titles.size();++index)
@@ -2906,25 +4899,97 @@ void TractModel::get_quantitative_info(std::shared_ptr<fib_data> handle,std::str
     result = out.str();
 }
 
-tipl::vector<3> TractModel::get_report(std::shared_ptr<fib_data> handle,
-                            unsigned int profile_dir,float band_width,const std::string& index_name,
-                            std::vector<float>& values,
-                            std::vector<float>& data_profile,
-                            std::vector<float>& data_ci1,
-                            std::vector<float>& data_ci2)
+// Poisson(1) weight of a tract in a bootstrap sample, fixed by the tract and sample index
+inline unsigned int bootstrap_weight(uint64_t tract,uint64_t sample)
+{
+    // cumulative probability of Poisson(1)
+    static const double cdf[] = {0.36787944,0.73575888,0.91969860,0.98101184,0.99634015,
+                                 0.99940582,0.99991676,0.99998975,0.99999887,0.99999989};
+    uint64_t x = (tract << 20) ^ sample;
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    double u = double(x >> 11)*(1.0/9007199254740992.0);
+    unsigned int k = 0;
+    while(k < 10 && u >= cdf[k])
+        ++k;
+    return k;
+}
+
+tipl::vector<3> TractModel::get_profiles(std::shared_ptr<fib_data> handle,
+                                         std::vector<TractProfile>& profiles,
+                                         float band_width,unsigned int bootstrap) const
 {
     tipl::vector<3> avg_dir;
-    if(tract_data.empty())
+    if(tract_data.empty() || profiles.empty())
         return avg_dir;
-    unsigned int profile_on_length = 0;// 1 :along tract 2: mean value
-    if(profile_dir > 2)
+
+    // each thread keeps bootstrap sums of every profile, so requests exceeding 512 mb in total
+    // are split into several passes over the tracts
+    if(bootstrap && profiles.size() > 1)
     {
-        profile_on_length = profile_dir-2;
-        profile_dir = 0;
+        auto boot_memory = [&](const TractProfile& profile)
+        {
+            size_t width = profile.profile_dir <= 2 ? size_t(geo[profile.profile_dir]+1)*2 :
+                           (profile.profile_dir == 3 ? 100 : 0);
+            return width*bootstrap*sizeof(double)*std::thread::hardware_concurrency();
+        };
+        size_t memory = 0;
+        for(const auto& profile : profiles)
+            memory += boot_memory(profile);
+        if(memory > 536870912)
+        {
+            for(size_t from = 0,to = 0;from < profiles.size();from = to)
+            {
+                for(memory = 0;to < profiles.size() && (to == from || memory+boot_memory(profiles[to]) <= 536870912);++to)
+                    memory += boot_memory(profiles[to]);
+                std::vector<TractProfile> group(std::make_move_iterator(profiles.begin()+int64_t(from)),
+                                                std::make_move_iterator(profiles.begin()+int64_t(to)));
+                avg_dir = get_profiles(handle,group,band_width,bootstrap);
+                std::move(group.begin(),group.end(),profiles.begin()+int64_t(from));
+            }
+            return avg_dir;
+        }
     }
-    float detail = profile_on_length ? 1.0 : 2.0;
-    size_t profile_width = size_t((geo[profile_dir]+1)*detail);
 
+    // each index is sampled once along a tract and shared by all its profiles
+    std::vector<unsigned int> index_list;
+    std::vector<size_t> profile_index(profiles.size());
+    std::vector<size_t> profile_width(profiles.size());
+    std::vector<float> detail(profiles.size());
+    for(size_t p = 0;p < profiles.size();++p)
+    {
+        auto& profile = profiles[p];
+        profile.position.clear();
+        profile.mean.clear();
+        profile.ci1.clear();
+        profile.ci2.clear();
+        unsigned int index_num = handle->get_name_index(profile.index_name);
+        if(index_num == handle->view_item.size() || profile.profile_dir > 4)
+        {
+            profile_index[p] = size_t(-1);
+            continue;
+        }
+        profile_index[p] = size_t(std::find(index_list.begin(),index_list.end(),index_num)-index_list.begin());
+        if(profile_index[p] == index_list.size())
+            index_list.push_back(index_num);
+        detail[p] = profile.profile_dir > 2 ? 1.0f : 2.0f;
+        if(profile.profile_dir <= 2)
+            profile_width[p] = size_t((geo[profile.profile_dir]+1)*detail[p]);
+        // along tract profile
+        if(profile.profile_dir == 3)
+            profile_width[p] = 100;
+        // mean value of each tract
+        if(profile.profile_dir == 4)
+            profile_width[p] = tract_data.size();
+        profile.mean.resize(profile_width[p]);
+        profile.position.resize(profile_width[p]);
+        for(size_t j = 0;j < profile_width[p];++j)
+            profile.position[j] = float(j)/detail[p];
+    }
+    if(index_list.empty())
+        return avg_dir;
 
     std::vector<float> weighting(uint32_t(1.0f+band_width*3.0f));
     for(size_t index = 0;index < weighting.size();++index)
@@ -2932,97 +4997,223 @@ tipl::vector<3> TractModel::get_report(std::shared_ptr<fib_data> handle,
         float x = index;
         weighting[index] = std::exp(-x*x/2.0f/band_width/band_width);
     }
-    // along tract profile
-    if(profile_on_length == 1)
-        profile_width = 100;
-    // mean value of each tract
-    if(profile_on_length == 2)
-        profile_width = tract_data.size();
-
-    values.resize(profile_width);
-    data_profile.resize(profile_width);
 
+    std::vector<char> dir;
+    avg_dir = get_tract_dir(tract_data,dir);
+
+    // one pass over the tracts, each thread accumulates the profile sums and bootstrap sums
+    // without bootstrap, the tracts are profiled block by block and each bin keeps only
+    // its lowest and highest 2.5% values for the 95% range
+    struct reducer{
+        std::vector<std::vector<double> > sum;
+        std::vector<std::vector<double> > boot_sum;
+        std::vector<double> boot_weight;
+    };
+    std::vector<reducer> reducers(std::thread::hardware_concurrency());
+    for(auto& each : reducers)
     {
-        std::vector<std::vector<float> > data;
-        get_tracts_data(handle,index_name,data);
-
+        each.sum.resize(profiles.size());
+        each.boot_sum.resize(profiles.size());
+        each.boot_weight.resize(bootstrap);
+        for(size_t p = 0;p < profiles.size();++p)
+            if(profile_index[p] != size_t(-1) && profiles[p].profile_dir != 4)
+            {
+                each.sum[p].resize(profile_width[p]);
+                each.boot_sum[p].resize(profile_width[p]*bootstrap);
+            }
+    }
+    size_t ci_size = std::max<size_t>(1,size_t(float(tract_data.size())*0.025f));
+    // the profiles of a block take at most 128 mb
+    size_t total_width = 0;
+    for(size_t p = 0;p < profiles.size();++p)
+        if(profile_index[p] != size_t(-1) && profiles[p].profile_dir != 4)
+            total_width += profile_width[p];
+    size_t block_size = bootstrap ? tract_data.size() :
+                        std::min<size_t>(tract_data.size(),std::clamp<size_t>(134217728/(std::max<size_t>(1,total_width)*sizeof(float)),1,4096));
+    std::vector<std::vector<float> > tract_profile(profiles.size());
+    // ci_low[p][j] is a max-heap of the lowest values, ci_high[p][j] a min-heap of the highest
+    std::vector<std::vector<std::vector<float> > > ci_low(profiles.size()),ci_high(profiles.size());
+    if(!bootstrap)
+        for(size_t p = 0;p < profiles.size();++p)
+            if(profile_index[p] != size_t(-1) && profiles[p].profile_dir != 4)
+            {
+                tract_profile[p].resize(profile_width[p]*block_size);
+                ci_low[p].resize(profile_width[p]);
+                ci_high[p].resize(profile_width[p]);
+            }
 
-        if(profile_on_length == 2)// list the mean fa value of each tract
-        {
-            data_profile.resize(data.size());
-            for(unsigned int index = 0;index < data_profile.size();++index)
-                data_profile[index] = float(tipl::mean(data[index].begin(),data[index].end()));
-        }
-        else
-        // along tract profile
+    for(size_t block_begin = 0;block_begin < tract_data.size();block_begin += block_size)
+    {
+        size_t block_end = std::min<size_t>(tract_data.size(),block_begin+block_size);
+        tipl::par_for2(block_end-block_begin,[&](size_t block_i,size_t thread)
         {
-            std::vector<char> dir;
-            avg_dir = get_tract_dir(tract_data,dir);
-            std::vector<std::set<float> > profile_upper_ci(profile_width),profile_lower_ci(profile_width);
-            size_t ci_size = std::max<size_t>(1,size_t(float(data.size())*0.025f));
-
-            for(size_t i = 0;i < data.size();++i)
+            size_t i = block_begin+block_i;
+            auto& r = reducers[thread];
+            std::vector<std::vector<float> > data(index_list.size());
+            for(size_t k = 0;k < index_list.size();++k)
+                get_tract_data(handle,uint32_t(i),index_list[k],data[k]);
+            std::vector<unsigned int> weight(bootstrap);
+            for(unsigned int b = 0;b < bootstrap;++b)
+                r.boot_weight[b] += (weight[b] = bootstrap_weight(i,b));
+
+            std::vector<float> line_profile,line_profile_w;
+            for(size_t p = 0;p < profiles.size();++p)
             {
-                std::vector<float> line_profile(profile_width);
-                std::vector<float> line_profile_w(profile_width);
-                if(profile_on_length == 1 && !dir[i])
-                    std::reverse(data[i].begin(),data[i].end());
-                for(size_t j = 0;j < data[i].size();++j)
+                if(profile_index[p] == size_t(-1))
+                    continue;
+                const auto& values = data[profile_index[p]];
+                unsigned int profile_dir = profiles[p].profile_dir;
+                if(profile_dir == 4)// list the mean value of each tract
                 {
-                    size_t pos = profile_on_length ?
-                              size_t(j*profile_width/data[i].size()):
-                              size_t(std::max<int>(0,int(std::round(tract_data[i][j + j + j + profile_dir]*detail))));
-                    if(pos >= profile_width)
-                        pos = profile_width-1;
+                    profiles[p].mean[i] = float(tipl::mean(values.begin(),values.end()));
+                    continue;
+                }
+                size_t width = profile_width[p];
+                bool reversed = (profile_dir == 3 && !dir[i]);
+                line_profile.assign(width,0.0f);
+                line_profile_w.assign(width,0.0f);
+                for(size_t j = 0;j < values.size();++j)
+                {
+                    float value = values[reversed ? values.size()-1-j : j];
+                    size_t pos = profile_dir == 3 ?
+                              size_t(j*width/values.size()):
+                              size_t(std::max<int>(0,int(std::round(tract_data[i][j + j + j + profile_dir]*detail[p]))));
+                    if(pos >= width)
+                        pos = width-1;
 
                     for(size_t k = 0;k < weighting.size();++k)
                     {
-                        float dw = data[i][j]*weighting[k];
+                        float dw = value*weighting[k];
                         float w = weighting[k];
                         if(pos > k && k != 0)
                         {
                             line_profile[pos-k] += dw;
                             line_profile_w[pos-k] += w;
                         }
-                        if(pos+k < data_profile.size())
+                        if(pos+k < width)
                         {
                             line_profile[pos+k] += dw;
                             line_profile_w[pos+k] += w;
                         }
                     }
                 }
-                for(unsigned int j = 0;j < line_profile.size();++j)
+                for(size_t j = 0;j < width;++j)
                 {
                     float value = (line_profile_w[j] == 0.0f ? 0.0f : line_profile[j] / line_profile_w[j]);
+                    r.sum[p][j] += double(value);
+                    if(!bootstrap)
+                        tract_profile[p][j*block_size+block_i] = value;
+                    for(unsigned int b = 0;b < bootstrap;++b)
+                        if(weight[b])
+                            r.boot_sum[p][b*width+j] += double(weight[b])*double(value);
+                }
+            }
+        });
+        if(bootstrap)
+            continue;
+        for(size_t p = 0;p < profiles.size();++p)
+        {
+            if(ci_low[p].empty())
+                continue;
+            tipl::par_for(profile_width[p],[&](size_t j)
+            {
+                auto& low = ci_low[p][j];
+                auto& high = ci_high[p][j];
+                auto values = tract_profile[p].begin()+int64_t(j*block_size);
+                for(size_t k = 0;k < block_end-block_begin;++k)
+                {
+                    float value = values[int64_t(k)];
+                    if(low.size() < ci_size)
+                    {
+                        low.push_back(value);
+                        std::push_heap(low.begin(),low.end());
+                    }
+                    else
+                    if(value < low.front())
+                    {
+                        std::pop_heap(low.begin(),low.end());
+                        low.back() = value;
+                        std::push_heap(low.begin(),low.end());
+                    }
+                    if(high.size() < ci_size)
+                    {
+                        high.push_back(value);
+                        std::push_heap(high.begin(),high.end(),std::greater<float>());
+                    }
+                    else
+                    if(value > high.front())
+                    {
+                        std::pop_heap(high.begin(),high.end(),std::greater<float>());
+                        high.back() = value;
+                        std::push_heap(high.begin(),high.end(),std::greater<float>());
+                    }
+                }
+            });
+        }
+    }
 
-                    if(profile_upper_ci[j].size() < ci_size || value < *profile_upper_ci[j].begin())
-                        profile_upper_ci[j].insert(value);
-                    if(profile_lower_ci[j].size() < ci_size || value > *std::prev(profile_lower_ci[j].end()))
-                        profile_lower_ci[j].insert(value);
-
-                    if(profile_upper_ci[j].size() > ci_size)
-                        profile_upper_ci[j].erase(profile_upper_ci[j].begin());
-
-                    if(profile_lower_ci[j].size() > ci_size)
-                        profile_lower_ci[j].erase(std::prev(profile_lower_ci[j].end()));
-
-                    data_profile[j] += value;
+    std::vector<double> boot_weight(bootstrap);
+    for(const auto& each : reducers)
+        for(unsigned int b = 0;b < bootstrap;++b)
+            boot_weight[b] += each.boot_weight[b];
+    for(size_t p = 0;p < profiles.size();++p)
+    {
+        if(profile_index[p] == size_t(-1) || profiles[p].profile_dir == 4)
+            continue;
+        auto& profile = profiles[p];
+        size_t width = profile_width[p];
+        profile.ci1.resize(width);
+        profile.ci2.resize(width);
+        tipl::par_for(width,[&](size_t j)
+        {
+            double sum = 0.0;
+            for(const auto& each : reducers)
+                sum += each.sum[p][j];
+            profile.mean[j] = float(sum/double(tract_data.size()));
+            if(bootstrap)
+            {
+                // 95% confidence interval of the mean from the bootstrap samples
+                std::vector<float> boot_mean(bootstrap);
+                for(unsigned int b = 0;b < bootstrap;++b)
+                {
+                    double boot_sum = 0.0;
+                    for(const auto& each : reducers)
+                        boot_sum += each.boot_sum[p][b*width+j];
+                    boot_mean[b] = boot_weight[b] == 0.0 ? profile.mean[j] : float(boot_sum/boot_weight[b]);
                 }
+                std::sort(boot_mean.begin(),boot_mean.end());
+                profile.ci1[j] = boot_mean[size_t(0.025f*float(bootstrap-1)+0.5f)];
+                profile.ci2[j] = boot_mean[size_t(0.975f*float(bootstrap-1)+0.5f)];
             }
-            data_ci1.resize(data_profile.size());
-            data_ci2.resize(data_profile.size());
-            for(unsigned int j = 0;j < data_profile.size();++j)
+            else
             {
-                values[j] = float(j)/detail;
-                data_profile[j] /= data.size();
-                data_ci1[j] = *profile_upper_ci[j].begin();
-                data_ci2[j] = *std::prev(profile_upper_ci[j].end());
+                // range covering 95% of the tract profiles
+                profile.ci1[j] = ci_low[p][j].front();
+                profile.ci2[j] = ci_high[p][j].front();
             }
-        }
+        });
     }
     return avg_dir;
 }
 
+tipl::vector<3> TractModel::get_report(std::shared_ptr<fib_data> handle,
+                            unsigned int profile_dir,float band_width,const std::string& index_name,
+                            std::vector<float>& values,
+                            std::vector<float>& data_profile,
+                            std::vector<float>& data_ci1,
+                            std::vector<float>& data_ci2) const
+{
+    std::vector<TractProfile> profiles(1);
+    profiles[0].index_name = index_name;
+    profiles[0].profile_dir = profile_dir;
+    auto avg_dir = get_profiles(handle,profiles,band_width);
+    values.swap(profiles[0].position);
+    data_profile.swap(profiles[0].mean);
+    data_ci1.swap(profiles[0].ci1);
+    data_ci2.swap(profiles[0].ci2);
+    return avg_dir;
+}
+
 
 
 
@@ -3207,11 +5398,21 @@ void TractModel::get_end_list(const std::vector<std::vector<short> >& region_map
 }
 
 
-void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_count,float detail)
+void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_count,float detail,unsigned char order,bool warm_start)
 {
     float param[4] = {0};
+    if(method_id == 3)// QuickBundles: threshold in voxel, point count, order
+    {
+        param[0] = detail/vs[0];
+        param[1] = 12;
+        param[2] = order;
+    }
+    else
     if(method_id)// k-means or EM
+    {
         param[0] = cluster_count;
+        param[1] = (method_id == 2);
+    }
     else
     {
         std::copy(geo.begin(),geo.end(),param);
@@ -3224,17 +5425,25 @@ void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_cou
         c.reset(new TractCluster(param));
         break;
     case 1:
-        c.reset(new FeatureBasedClutering<tipl::ml::k_means<double,unsigned char> >(param));
-        break;
     case 2:
-        c.reset(new FeatureBasedClutering<tipl::ml::expectation_maximization<double,unsigned char> >(param));
+        {
+            auto f = new TractFeatureClustering(param);
+            if(warm_start && tract_cluster.size() == tract_data.size())
+                f->warm_start = tract_cluster;
+            c.reset(f);
+        }
+        break;
+    case 3:
+        c.reset(new QuickBundlesCluster(param));
         break;
+    default:
+        return;
     }
 
     c->add_tracts(tract_data);
     c->run_clustering();
     {
-        cluster_count = method_id ? c->get_cluster_count() : std::min<float>(c->get_cluster_count(),cluster_count);
+        cluster_count = (method_id == 1 || method_id == 2) ? c->get_cluster_count() : std::min<float>(c->get_cluster_count(),cluster_count);
         tract_cluster.resize(tract_data.size());
         std::fill(tract_cluster.begin(),tract_cluster.end(),cluster_count);
         for(int index = 0;index < cluster_count;++index)
@@ -3550,79 +5759,225 @@ bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
     return true;
 
 }
-template<class matrix_type>
-void distance_bin(const matrix_type& bin,tipl::image<float,2>& D)
+// nonzero entries of a square matrix in compressed rows
+struct connectivity_graph{
+    unsigned int n = 0;
+    std::vector<unsigned int> row,col;
+    std::vector<float> w;
+    template<class matrix_type>
+    connectivity_graph(const matrix_type& m):n(uint32_t(m.width())),row(n+1)
+    {
+        for(unsigned int i = 0,index = 0;i < n;++i)
+        {
+            for(unsigned int j = 0;j < n;++j,++index)
+                if(m[index] != 0)
+                {
+                    col.push_back(j);
+                    w.push_back(float(m[index]));
+                }
+            row[i+1] = uint32_t(col.size());
+        }
+    }
+};
+// breadth-first search from one source, the diagonal gets the shortest cycle as in the walk-count method
+void distance_bin(const connectivity_graph& g,unsigned int source,float* D,std::vector<unsigned int>& queue)
 {
-    unsigned int n = bin.width();
-    tipl::image<unsigned int,2> A,Lpath;
-    A = bin;
-    Lpath = bin;
-    D = bin;
-    for(unsigned int l = 2;1;++l)
-    {
-        tipl::image<unsigned int,2> t(A.geometry());
-        tipl::mat::product(Lpath.begin(),A.begin(),t.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        std::swap(Lpath,t);
-        bool con = false;
-        for(unsigned int i = 0;i < D.size();++i)
-            if(Lpath[i] != 0 && D[i] == 0)
+    std::fill(D,D+g.n,std::numeric_limits<float>::max());
+    D[source] = 0.0f;
+    queue.clear();
+    queue.push_back(source);
+    float cycle = std::numeric_limits<float>::max();
+    for(size_t head = 0;head < queue.size();++head)
+    {
+        unsigned int u = queue[head];
+        for(unsigned int e = g.row[u];e < g.row[u+1];++e)
+        {
+            unsigned int v = g.col[e];
+            if(v == source)
+                cycle = std::min<float>(cycle,D[u]+1.0f);
+            else
+            if(D[v] == std::numeric_limits<float>::max())
             {
-                D[i] = l;
-                con = true;
+                D[v] = D[u]+1.0f;
+                queue.push_back(v);
             }
-        if(!con)
-            break;
+        }
+    }
+    D[source] = cycle;
+}
+// Dijkstra from one source with connection lengths in g.w, the diagonal is left infinite
+void distance_wei(const connectivity_graph& g,unsigned int source,float* D)
+{
+    std::fill(D,D+g.n,std::numeric_limits<float>::max());
+    D[source] = 0.0f;
+    std::priority_queue<std::pair<float,unsigned int>,std::vector<std::pair<float,unsigned int> >,
+                        std::greater<std::pair<float,unsigned int> > > heap;
+    heap.push(std::make_pair(0.0f,source));
+    while(!heap.empty())
+    {
+        auto top = heap.top();
+        heap.pop();
+        unsigned int u = top.second;
+        if(top.first > D[u])
+            continue;
+        for(unsigned int e = g.row[u];e < g.row[u+1];++e)
+        {
+            float Duv = D[u]+g.w[e];
+            if(Duv < D[g.col[e]])
+            {
+                D[g.col[e]] = Duv;
+                heap.push(std::make_pair(Duv,g.col[e]));
+            }
+        }
+    }
+    D[source] = std::numeric_limits<float>::max();
+}
+template<class matrix_type>
+void distance_bin(const matrix_type& bin,tipl::image<float,2>& D,bool parallel = true)
+{
+    connectivity_graph g(bin);
+    D.resize(tipl::geometry<2>(g.n,g.n));
+    if(parallel)
+        tipl::par_for(g.n,[&](unsigned int i)
+        {
+            std::vector<unsigned int> queue;
+            distance_bin(g,i,&D[i*g.n],queue);
+        });
+    else
+    {
+        std::vector<unsigned int> queue;
+        for(unsigned int i = 0;i < g.n;++i)
+            distance_bin(g,i,&D[i*g.n],queue);
     }
-    std::replace(D.begin(),D.end(),(float)0,std::numeric_limits<float>::max());
 }
 template<class matrix_type>
-void distance_wei(const matrix_type& W_,tipl::image<float,2>& D)
+void distance_wei(const matrix_type& W,tipl::image<float,2>& D,bool parallel = true)
+{
+    connectivity_graph g(W);
+    for(auto& each : g.w)
+        each = float(1.0/double(each));
+    D.resize(tipl::geometry<2>(g.n,g.n));
+    if(parallel)
+        tipl::par_for(g.n,[&](unsigned int i)
+        {
+            distance_wei(g,i,&D[i*g.n]);
+        });
+    else
+        for(unsigned int i = 0;i < g.n;++i)
+            distance_wei(g,i,&D[i*g.n]);
+}
+// Brandes betweenness summed over all sources, using w as the connection length if weighted
+void betweenness(const connectivity_graph& g,bool weighted,std::vector<float>& bc)
 {
-    tipl::image<float,2> W(W_);
-    for(unsigned int i = 0;i < W.size();++i)
-        W[i] = (W[i] != 0) ? 1.0/W[i]:0;
-    unsigned int n = W.width();
-    D.clear();
-    D.resize(W.geometry());
-    std::fill(D.begin(),D.end(),std::numeric_limits<float>::max());
-    for(unsigned int i = 0,dg = 0;i < n;++i,dg += n + 1)
-        D[dg] = 0;
-    for(unsigned int i = 0,in = 0;i < n;++i,in += n)
-    {
-        std::vector<unsigned char> S(n);
-        tipl::image<float,2> W1(W);
-
-        std::vector<unsigned int> V;
-        V.push_back(i);
-        while(1)
-        {
-            for(unsigned int j = 0;j < V.size();++j)
+    unsigned int thread_count = std::thread::hardware_concurrency();
+    std::vector<std::vector<double> > bc_thread(thread_count,std::vector<double>(g.n));
+    tipl::par_for2(g.n,[&](unsigned int s,unsigned int thread)
+    {
+        std::vector<float> D(g.n,std::numeric_limits<float>::max());
+        std::vector<double> NP(g.n),DP(g.n);
+        std::vector<std::vector<unsigned int> > P(g.n);
+        std::vector<unsigned int> order;// nodes by non-decreasing distance
+        D[s] = 0.0f;
+        NP[s] = 1.0;
+        if(weighted)
+        {
+            std::vector<unsigned char> settled(g.n);
+            std::priority_queue<std::pair<float,unsigned int>,std::vector<std::pair<float,unsigned int> >,
+                                std::greater<std::pair<float,unsigned int> > > heap;
+            heap.push(std::make_pair(0.0f,s));
+            while(!heap.empty())
             {
-                S[V[j]] = 1;
-                for(unsigned int k = V[j];k < W1.size();k += n)
-                    W1[k] = 0;
+                unsigned int u = heap.top().second;
+                heap.pop();
+                if(settled[u])
+                    continue;
+                settled[u] = 1;
+                order.push_back(u);
+                for(unsigned int e = g.row[u];e < g.row[u+1];++e)
+                {
+                    unsigned int v = g.col[e];
+                    if(settled[v])
+                        continue;
+                    float Duv = D[u]+g.w[e];
+                    if(Duv < D[v])
+                    {
+                        D[v] = Duv;
+                        NP[v] = NP[u];
+                        P[v].assign(1,u);
+                        heap.push(std::make_pair(Duv,v));
+                    }
+                    else
+                    if(Duv == D[v])
+                    {
+                        NP[v] += NP[u];
+                        P[v].push_back(u);
+                    }
+                }
             }
-            for(unsigned int j = 0;j < V.size();++j)
+        }
+        else
+        {
+            order.push_back(s);
+            for(size_t head = 0;head < order.size();++head)
             {
-                unsigned int v = V[j];
-                unsigned int vn = v*n;
-                for(unsigned int k = 0;k < n;++k)
-                if(W1[vn+k] > 0)
-                    D[in+k] = std::min<float>(D[in+k],D[in+v]+W1[vn+k]);
+                unsigned int u = order[head];
+                for(unsigned int e = g.row[u];e < g.row[u+1];++e)
+                {
+                    unsigned int v = g.col[e];
+                    if(D[v] == std::numeric_limits<float>::max())
+                    {
+                        D[v] = D[u]+1.0f;
+                        order.push_back(v);
+                    }
+                    if(D[v] == D[u]+1.0f)
+                    {
+                        NP[v] += NP[u];
+                        P[v].push_back(u);
+                    }
+                }
             }
-            float minD = std::numeric_limits<float>::max();
-            for(unsigned int j = 0;j < n;++j)
-                if(S[j] == 0 && minD > D[in+j])
-                    minD = D[in+j];
-            if(minD == std::numeric_limits<float>::max())
-                break;
-            V.clear();
-            for(unsigned int j = 0;j < n;++j)
-                if(D[in+j]  == minD)
-                    V.push_back(j);
         }
+        for(size_t j = order.size()-1;j > 0;--j)
+        {
+            unsigned int w = order[j];
+            bc_thread[thread][w] += DP[w];
+            for(auto v : P[w])
+                DP[v] += (1.0+DP[w])*NP[v]/NP[w];
+        }
+    });
+    bc.resize(g.n);
+    for(unsigned int i = 0;i < g.n;++i)
+    {
+        double sum = 0.0;
+        for(unsigned int t = 0;t < thread_count;++t)
+            sum += bc_thread[t][i];
+        bc[i] = float(sum);
     }
-    std::replace(D.begin(),D.end(),(float)0.0,std::numeric_limits<float>::max());
+}
+// diagonal of (W.^p)^3, sum over closed walks i->j->k->i
+template<class matrix_type>
+void cycle3_diagonal(const matrix_type& W,float p,std::vector<float>& cyc3)
+{
+    connectivity_graph g(W);
+    if(p != 1.0f)
+        for(auto& each : g.w)
+            each = std::pow(each,p);
+    cyc3.resize(g.n);
+    std::vector<float> Wp(size_t(g.n)*g.n);
+    for(unsigned int i = 0;i < g.n;++i)
+        for(unsigned int e = g.row[i];e < g.row[i+1];++e)
+            Wp[i*g.n+g.col[e]] = g.w[e];
+    tipl::par_for(g.n,[&](unsigned int i)
+    {
+        double sum = 0.0;
+        for(unsigned int e = g.row[i];e < g.row[i+1];++e)
+        {
+            unsigned int j = g.col[e];
+            for(unsigned int f = g.row[j];f < g.row[j+1];++f)
+                sum += double(g.w[e])*double(g.w[f])*double(Wp[g.col[f]*g.n+i]);
+        }
+        cyc3[i] = float(sum);
+    });
 }
 template<class matrix_type>
 void inv_dis(const matrix_type& D,matrix_type& e)
@@ -3646,6 +6001,16 @@ void output_node_measures(std::ostream& out,const char* name,const vec_type& dat
 
 void ConnectivityMatrix::network_property(std::string& report)
 {
+    // reports are cached by the matrix content, so that a threshold sweep computes each matrix once
+    for(const auto& cache : network_property_cache)
+        if(cache.geo == matrix_value.geometry() &&
+           cache.overlap_ratio == overlap_ratio &&
+           cache.region_name == region_name &&
+           std::equal(matrix_value.begin(),matrix_value.end(),cache.matrix_value.begin()))
+        {
+            report = cache.report;
+            return;
+        }
     std::ostringstream out;
     size_t n = matrix_value.width();
     tipl::image<unsigned char,2> binary_matrix(matrix_value.geometry());
@@ -3671,37 +6036,35 @@ void ConnectivityMatrix::network_property(std::string& report)
         strength[i] = std::accumulate(norm_matrix.begin()+i*n,norm_matrix.begin()+(i+1)*n,0.0);
     // calculate clustering coefficient
     std::vector<float> cluster_co(n);
-    for(unsigned int i = 0,posi = 0;i < n;++i,posi += n)
-    if(degree[i] >= 2)
+    tipl::par_for(n,[&](unsigned int i)
     {
-        for(unsigned int j = 0,index = 0;j < n;++j)
-            for(unsigned int k = 0;k < n;++k,++index)
-                if(binary_matrix[posi + j] && binary_matrix[posi + k])
-                    cluster_co[i] += binary_matrix[index];
+        if(degree[i] < 2)
+            return;
+        std::vector<unsigned int> neighbor;
+        for(unsigned int j = 0;j < n;++j)
+            if(binary_matrix[i*n+j])
+                neighbor.push_back(j);
+        for(auto j : neighbor)
+            for(auto k : neighbor)
+                cluster_co[i] += binary_matrix[j*n+k];
         float d = degree[i];
         cluster_co[i] /= (d*d-d);
-    }
+    });
     float cc_bin = tipl::mean(cluster_co.begin(),cluster_co.end());
     out << "clustering_coeff_average(binary)\t" << cc_bin << std::endl;
 
     // calculate weighted clustering coefficient
-    tipl::image<float,2> cyc3(norm_matrix.geometry());
+    std::vector<float> cyc3;
     std::vector<float> wcluster_co(n);
     {
-        tipl::image<float,2> root(norm_matrix);
-        // root = W.^ 1/3
-        for(unsigned int j = 0;j < root.size();++j)
-            root[j] = std::pow(root[j],(float)(1.0/3.0));
-        // cyc3 = (W.^1/3)^3
-        tipl::image<float,2> t(root.geometry());
-        tipl::mat::product(root.begin(),root.begin(),t.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        tipl::mat::product(t.begin(),root.begin(),cyc3.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
+        // cyc3 = diag((W.^1/3)^3)
+        cycle3_diagonal(norm_matrix,float(1.0/3.0),cyc3);
         // wcc = diag(cyc3)/(K.*(K-1));
         for(unsigned int i = 0;i < n;++i)
         if(degree[i] >= 2)
         {
             float d = degree[i];
-            wcluster_co[i] = cyc3[i*(n+1)]/(d*d-d);
+            wcluster_co[i] = cyc3[i]/(d*d-d);
         }
     }
     float cc_wei = tipl::mean(wcluster_co.begin(),wcluster_co.end());
@@ -3710,16 +6073,26 @@ void ConnectivityMatrix::network_property(std::string& report)
 
     // transitivity
     {
-        tipl::image<float,2> norm_matrix2(norm_matrix.geometry());
-        tipl::image<float,2> norm_matrix3(norm_matrix.geometry());
-        tipl::mat::product(norm_matrix.begin(),norm_matrix.begin(),norm_matrix2.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        tipl::mat::product(norm_matrix2.begin(),norm_matrix.begin(),norm_matrix3.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        out << "transitivity(binary)\t" << tipl::mat::trace(norm_matrix3.begin(),tipl::dyndim(n,n)) /
-                (std::accumulate(norm_matrix2.begin(),norm_matrix2.end(),0.0) - tipl::mat::trace(norm_matrix2.begin(),tipl::dyndim(n,n))) << std::endl;
+        // trace(W^3)/(sum(W^2)-trace(W^2)) without forming the matrix products
+        std::vector<float> w3;
+        cycle3_diagonal(norm_matrix,1.0f,w3);
+        double sum2 = 0.0,trace2 = 0.0;
+        for(unsigned int j = 0;j < n;++j)
+        {
+            double col_sum = 0.0,row_sum = 0.0;
+            for(unsigned int i = 0;i < n;++i)
+            {
+                col_sum += norm_matrix[i*n+j];
+                row_sum += norm_matrix[j*n+i];
+                trace2 += double(norm_matrix[j*n+i])*double(norm_matrix[i*n+j]);
+            }
+            sum2 += col_sum*row_sum;
+        }
+        out << "transitivity(binary)\t" << std::accumulate(w3.begin(),w3.end(),0.0)/(sum2 - trace2) << std::endl;
         float k = 0;
         for(unsigned int i = 0;i < n;++i)
             k += degree[i]*(degree[i]-1);
-        out << "transitivity(weighted)\t" << (k == 0 ? 0 : tipl::mat::trace(cyc3.begin(),tipl::dyndim(n,n))/k) << std::endl;
+        out << "transitivity(weighted)\t" << (k == 0 ? 0 : float(std::accumulate(cyc3.begin(),cyc3.end(),0.0))/k) << std::endl;
     }
 
     std::vector<float> eccentricity_bin(n),eccentricity_wei(n);
@@ -3767,61 +6140,58 @@ void ConnectivityMatrix::network_property(std::string& report)
     std::vector<float> local_efficiency_bin(n);
     //claculate local efficiency
     {
-        for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
+        tipl::par_for(n,[&](unsigned int i)
         {
+            unsigned int ipos = i*n;
             unsigned int new_n = std::accumulate(binary_matrix.begin()+ipos,
                                                  binary_matrix.begin()+ipos+n,0);
             if(new_n < 2)
-                continue;
+                return;
+            std::vector<unsigned int> neighbor;
+            for(unsigned int j = 0;j < n;++j)
+                if(binary_matrix[ipos+j])
+                    neighbor.push_back(j);
             tipl::image<float,2> newA(tipl::geometry<2>(new_n,new_n));
-            unsigned int pos = 0;
-            for(unsigned int j = 0,index = 0;j < n;++j)
-                for(unsigned int k = 0;k < n;++k,++index)
-                    if(binary_matrix[ipos+j] && binary_matrix[ipos+k])
-                    {
-                        if(pos < newA.size())
-                            newA[pos] = binary_matrix[index];
-                        ++pos;
-                    }
+            for(unsigned int j = 0,pos = 0;j < new_n;++j)
+                for(unsigned int k = 0;k < new_n;++k,++pos)
+                    newA[pos] = binary_matrix[neighbor[j]*n+neighbor[k]];
             tipl::image<float,2> invD;
-            distance_bin(newA,invD);
+            distance_bin(newA,invD,false);
             inv_dis(invD,invD);
             local_efficiency_bin[i] = std::accumulate(invD.begin(),invD.end(),0.0)/(new_n*new_n-new_n);
-        }
+        });
     }
 
     std::vector<float> local_efficiency_wei(n);
     {
-
-        for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
+        tipl::par_for(n,[&](unsigned int i)
         {
+            unsigned int ipos = i*n;
             unsigned int new_n = std::accumulate(binary_matrix.begin()+ipos,
                                                  binary_matrix.begin()+ipos+n,0);
             if(new_n < 2)
-                continue;
+                return;
+            std::vector<unsigned int> neighbor;
+            for(unsigned int j = 0;j < n;++j)
+                if(binary_matrix[ipos+j])
+                    neighbor.push_back(j);
             tipl::image<float,2> newA(tipl::geometry<2>(new_n,new_n));
-            unsigned int pos = 0;
-            for(unsigned int j = 0,index = 0;j < n;++j)
-                for(unsigned int k = 0;k < n;++k,++index)
-                    if(binary_matrix[ipos+j] && binary_matrix[ipos+k])
-                    {
-                        if(pos < newA.size())
-                            newA[pos] = norm_matrix[index];
-                        ++pos;
-                    }
+            for(unsigned int j = 0,pos = 0;j < new_n;++j)
+                for(unsigned int k = 0;k < new_n;++k,++pos)
+                    newA[pos] = norm_matrix[neighbor[j]*n+neighbor[k]];
             std::vector<float> sw;
             for(unsigned int j = 0;j < n;++j)
                 if(binary_matrix[ipos+j])
                     sw.push_back(std::pow(norm_matrix[ipos+j],(float)(1.0/3.0)));
             tipl::image<float,2> invD;
-            distance_wei(newA,invD);
+            distance_wei(newA,invD,false);
             inv_dis(invD,invD);
             float numer = 0.0;
             for(unsigned int j = 0,index = 0;j < new_n;++j)
                 for(unsigned int k = 0;k < new_n;++k,++index)
                     numer += std::pow(invD[index],(float)(1.0/3.0))*sw[j]*sw[k];
             local_efficiency_wei[i] = numer/(new_n*new_n-new_n);
-        }
+        });
     }
 
 
@@ -3920,133 +6290,18 @@ void ConnectivityMatrix::network_property(std::string& report)
 
     // betweenness
     std::vector<float> betweenness_bin(n);
-    {
-
-        tipl::image<unsigned int,2> NPd(binary_matrix),NSPd(binary_matrix),NSP(binary_matrix);
-        for(unsigned int i = 0,dg = 0;i < n;++i,dg += n+1)
-            NSP[dg] = 1;
-        tipl::image<unsigned int,2> L(NSP);
-        unsigned int d = 2;
-        for(;std::find(NSPd.begin(),NSPd.end(),1) != NSPd.end();++d)
-        {
-            tipl::image<unsigned int,2> t(binary_matrix.geometry());
-            tipl::mat::product(NPd.begin(),binary_matrix.begin(),t.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-            t.swap(NPd);
-            for(unsigned int i = 0;i < L.size();++i)
-            {
-                NSPd[i] = (L[i] == 0) ? NPd[i]:0;
-                NSP[i] += NSPd[i];
-                L[i] += (NSPd[i] == 0) ? 0:d;
-            }
-        }
-
-        for(unsigned int i = 0,dg = 0;i < n;++i,dg += n+1)
-            L[dg] = 0;
-        std::replace(NSP.begin(),NSP.end(),0,1);
-        tipl::image<float,2> DP(binary_matrix.geometry());
-        for(--d;d >= 2;--d)
-        {
-            tipl::image<float,2> t(DP),DPd1(binary_matrix.geometry());
-            t += 1.0;
-            for(unsigned int i = 0;i < t.size();++i)
-                if(L[i] != d)
-                    t[i] = 0;
-                else
-                    t[i] /= NSP[i];
-            tipl::mat::product(t.begin(),binary_matrix.begin(),DPd1.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-            for(unsigned int i = 0;i < DPd1.size();++i)
-                if(L[i] != d-1)
-                    DPd1[i] = 0;
-                else
-                    DPd1[i] *= NSP[i];
-            DP += DPd1;
-        }
-
-        for(unsigned int i = 0,index = 0;i < n;++i)
-            for(unsigned int j = 0;j < n;++j,++index)
-                betweenness_bin[j] += DP[index];
-    }
+    betweenness(connectivity_graph(binary_matrix),false,betweenness_bin);
     std::vector<float> betweenness_wei(n);
     {
-        for(unsigned int i = 0;i < n;++i)
+        tipl::image<float,2> G1(norm_matrix);
+        // per suggestion from Mikail Rubinov, the matrix has to be "granulated"
         {
-            std::vector<float> D(n),NP(n);
-            std::fill(D.begin(),D.end(),std::numeric_limits<float>::max());
-            D[i] = 0;
-            NP[i] = 1;
-            std::vector<unsigned char> S(n),Q(n);
-            int q = n-1;
-            std::fill(S.begin(),S.end(),1);
-            tipl::image<unsigned char,2> P(binary_matrix.geometry());
-            tipl::image<float,2> G1(norm_matrix);
-            // per suggestion from Mikail Rubinov, the matrix has to be "granulated"
-            {
-                float eps = max_value*0.001f;
-                for(size_t i = 0;i < G1.size();++i)
-                    if(G1[i] > 0.0f && G1[i] < eps)
-                        G1[i] = eps;
-            }
-            std::vector<unsigned int> V;
-            V.push_back(i);
-            while(q >= V.size())
-            {
-                for(unsigned int j = 0,jpos = 0;j < n;++j,jpos += n)
-                    for(unsigned int k = 0;k < V.size();++k)
-                        G1[jpos+V[k]] = 0;
-                for(unsigned int k = 0;k < V.size();++k)
-                {
-                    S[V[k]] = 0;
-                    Q[q--]=V[k];
-                    unsigned int v_rowk = V[k]*n;
-                    for(unsigned int w = 0,w_row = 0;w < n;++w, w_row += n)
-                        if(G1[v_rowk+w] > 0)
-                        {
-                            float Duw=D[V[k]]+G1[v_rowk+w];
-                            if(Duw < D[w])
-                            {
-                                D[w]=Duw;
-                                NP[w]=NP[V[k]];
-                                std::fill(P.begin()+w_row,P.begin()+w_row+n,0);
-                                P[w_row + V[k]] = 1;
-                            }
-                            else
-                            if(Duw==D[w])
-                            {
-                                NP[w]+=NP[V[k]];
-                                P[w_row+V[k]]=1;
-                            }
-                        }
-                }
-                if(std::find(S.begin(),S.end(),1) == S.end())
-                    break;
-                float minD = std::numeric_limits<float>::max();
-                for(unsigned int j = 0;j < n;++j)
-                    if(S[j] && minD > D[j])
-                        minD = D[j];
-                if(minD == std::numeric_limits<float>::max())
-                {
-                    for(unsigned int j = 0,k = 0;j < n;++j)
-                        if(D[j] == std::numeric_limits<float>::max())
-                            Q[k++] = j;
-                    break;
-                }
-                V.clear();
-                for(unsigned int j = 0;j < n;++j)
-                    if(D[j] == minD)
-                        V.push_back(j);
-            }
-
-            std::vector<float> DP(n);
-            for(unsigned int j = 0;j < n-1;++j)
-            {
-                unsigned int w=Q[j];
-                unsigned int w_row = w*n;
-                betweenness_wei[w] += DP[w];
-                for(unsigned int k = 0;k < n;++k)
-                    if(P[w_row+k])
-                        DP[k] += (1.0+DP[w])*NP[k]/NP[w];
-            }
+            float eps = max_value*0.001f;
+            for(size_t i = 0;i < G1.size();++i)
+                if(G1[i] > 0.0f && G1[i] < eps)
+                    G1[i] = eps;
         }
+        betweenness(connectivity_graph(G1),true,betweenness_wei);
     }
 
 
@@ -4120,4 +6375,13 @@ void ConnectivityMatrix::network_property(std::string& report)
     }
 
     report = out.str();
+    if(network_property_cache.size() >= network_property_cache_size)
+        network_property_cache.erase(network_property_cache.begin());
+    NetworkPropertyCache cache;
+    cache.geo = matrix_value.geometry();
+    cache.matrix_value = std::vector<float>(matrix_value.begin(),matrix_value.end());
+    cache.overlap_ratio = overlap_ratio;
+    cache.region_name = region_name;
+    cache.report = report;
+    network_property_cache.push_back(std::move(cache));
 }
@@ -2,10 +2,23 @@
 #define TRACT_MODEL_HPP
 #include <vector>
 #include <iosfwd>
+#include <functional>
+#include <map>
 #include "tipl/tipl.hpp"
 #include "fib_data.hpp"
 
 class RoiMgr;
+class TractStore;
+struct TractSelectIndex;
+struct TractSliceIndex;
+struct TractEdit;
+struct TractEditJournal;
+// profile of an index along the x, y, z axes (profile_dir 0-2), along the tracts (3), or the mean of each tract (4)
+struct TractProfile{
+    std::string index_name;
+    unsigned int profile_dir = 3;
+    std::vector<float> position,mean,ci1,ci2;
+};
 void initial_LPS_nifti_srow(tipl::matrix<4,4,float>& T,const tipl::geometry<3>& geo,const tipl::vector<3>& vs);
 class TractModel{
 public:
@@ -19,21 +32,32 @@ public:
         tipl::matrix<4,4,float> trans_to_mni;
 private:
         std::vector<std::vector<float> > tract_data;
-        std::vector<std::vector<float> > deleted_tract_data;
         std::vector<unsigned int> tract_color;
-        std::vector<unsigned int> tract_tag;
-        std::vector<unsigned int> deleted_tract_color;
-        std::vector<unsigned int> deleted_tract_tag;
-        std::vector<unsigned int> deleted_count;
-        std::vector<char> is_cut;
-        unsigned int cur_cut_id = 1;
-        std::vector<std::pair<unsigned int,unsigned int> > redo_size;
-        // offset, size
-        void erase_empty(void);
+        std::vector<unsigned int> tract_tag; // pieces from cuts carry serial numbers, 0 otherwise
+        uint32_t tag_serial = 1; // next serial number, kept when the history is reset so that older tags never match a later cut
+        void erase_empty(size_t from = 0);
+private:
+        // undo/redo history of deletions and cuts
+        std::shared_ptr<TractEditJournal> journal;
+        TractEditJournal& get_journal(void);
+        void cut_tracts(const std::vector<unsigned int>& tracts_to_cut,
+                        const std::vector<std::vector<std::pair<unsigned int,unsigned int> > >& keep_range,
+                        bool is_redo = false);
+private:
+        // bumped whenever tract_data changes, invalidates the cached indices
+        size_t tract_version = 0;
+        std::shared_ptr<TractSelectIndex> select_index;
+        std::shared_ptr<TractSliceIndex> slice_index[3];
 private:
         // for loading multiple clusters
         std::vector<unsigned int> tract_cluster;
 public:
+        // write a spatial sidecar index along with tt.gz files
+        static bool spatial_index;
+        // write tt.gz files in chunks (version 2), which earlier releases cannot open
+        static bool chunked_tt;
+        // memory of the undo history in bytes, older history is spilled to a temporary file
+        static size_t undo_memory_limit;
         static bool save_all(const char* file_name,
                              const std::vector<std::shared_ptr<TractModel> >& all,
                              const std::vector<std::string>& name_list);
@@ -47,6 +71,9 @@ public:
         void select_tracts(const std::vector<unsigned int>& tracts_to_select);
         void delete_repeated(float d);
         void delete_branch(void);
+        // the largest end regions, tracts ending in both of them form the trunk
+        std::shared_ptr<RoiMgr> get_trunk_roi(std::vector<tipl::vector<3,short> >& p1,
+                                              std::vector<tipl::vector<3,short> >& p2) const;
         void delete_by_length(float length);
 public:
         TractModel(std::shared_ptr<fib_data> handle):geo(handle->dim),vs(handle->vs),trans_to_mni(handle->trans_to_mni){}
@@ -69,9 +96,12 @@ public:
             trans_to_mni = rhs.trans_to_mni;
             tract_data = rhs.tract_data;
             tract_color = rhs.tract_color;
-            tract_tag = rhs.tract_tag;
+            tract_tag.clear();
+            tract_tag.resize(tract_data.size());
+            journal.reset();
             report = rhs.report;
             saved = true;
+            ++tract_version;
             return *this;
         }
         void add(const TractModel& rhs);
@@ -126,20 +156,23 @@ public:
                                  tipl::matrix<4,4,float>* T,
                                  std::vector<std::vector<tipl::vector<2,float> > >& lines,
                                  std::vector<unsigned int>& colors,
-                                 unsigned int max_count);
+                                 unsigned int max_count,
+                                 bool build_parallel = true);
         void to_voxel(std::vector<tipl::vector<3,short> >& points,float ratio,int id = -1);
         void to_end_point_voxels(std::vector<tipl::vector<3,short> >& points1,
-                                std::vector<tipl::vector<3,short> >& points2,float ratio);
+                                std::vector<tipl::vector<3,short> >& points2,float ratio) const;
         void to_end_point_voxels(std::vector<tipl::vector<3,short> >& points1,
-                                std::vector<tipl::vector<3,short> >& points2,float ratio,float end_dis);
+                                std::vector<tipl::vector<3,short> >& points2,float ratio,float end_dis) const;
 
-        size_t get_deleted_track_count(void) const{return deleted_tract_data.size();}
+        size_t get_deleted_track_count(void) const;
         size_t get_visible_track_count(void) const{return tract_data.size();}
         
         const std::vector<float>& get_tract(unsigned int index) const{return tract_data[index];}
         const std::vector<std::vector<float> >& get_tracts(void) const{return tract_data;}
-        std::vector<std::vector<float> >& get_deleted_tracts(void) {return deleted_tract_data;}
+        void release_deleted_tracts(std::vector<std::vector<float> >& released_tracks);
+        // callers that modify the returned tracts need to call tracts_changed() afterward
         std::vector<std::vector<float> >& get_tracts(void) {return tract_data;}
+        void tracts_changed(void){++tract_version;}
         unsigned int get_tract_color(unsigned int index) const{return tract_color[index];}
         size_t get_tract_length(unsigned int index) const{return tract_data[index].size();}
 
@@ -158,13 +191,18 @@ public:
         static bool export_end_pdi(const char* file_name,
                                const std::vector<std::shared_ptr<TractModel> >& tract_models,float end_distance = 3.0f);
 public:
-        void get_quantitative_info(std::shared_ptr<fib_data> handle,std::string& result);
+        void get_quantitative_info(std::shared_ptr<fib_data> handle,std::string& result) const;
+        // computes all profiles in one pass over the tracts, the bands are the 95% bootstrap
+        // confidence interval of the mean, or the 95% range of the tracts if bootstrap is 0
+        tipl::vector<3> get_profiles(std::shared_ptr<fib_data> handle,
+                        std::vector<TractProfile>& profiles,
+                        float band_width,unsigned int bootstrap = 0) const;
         tipl::vector<3> get_report(std::shared_ptr<fib_data> handle,
                         unsigned int profile_dir,float band_width,const std::string& index_name,
                         std::vector<float>& values,
                         std::vector<float>& data_profile,
                         std::vector<float>& data_ci1,
-                        std::vector<float>& data_ci2);
+                        std::vector<float>& data_ci2) const;
 
 public:
         void get_tract_data(std::shared_ptr<fib_data> handle,
@@ -184,11 +222,87 @@ public:
         void get_end_list(const std::vector<std::vector<short> >& region_map,
                                      std::vector<std::vector<short> >& end_list1,
                                      std::vector<std::vector<short> >& end_list2) const;
-        void run_clustering(unsigned char method_id,unsigned int cluster_count,float param);
+        void run_clustering(unsigned char method_id,unsigned int cluster_count,float param,unsigned char order = 0,bool warm_start = false);
 
 };
 
 
+// reads a tract file (tt.gz, trk, trk.gz, tck, txt, mat) a chunk at a time
+class TractReader{
+private:
+    std::vector<std::vector<float> > pending;
+    std::vector<unsigned int> pending_cluster;
+    size_t pending_pos = 0;
+    // appends the next tracts to pending, returns false at the end of the file
+    std::function<bool(std::vector<std::vector<float> >&,std::vector<unsigned int>&)> fill;
+private: // chunk table of tt.gz files
+    std::string file_name;
+    std::vector<unsigned int> chunk_info;
+    std::vector<size_t> chunk_tract_index;
+    std::vector<char> chunk_selected;
+public:
+    tipl::geometry<3> geo;
+    tipl::vector<3> vs = tipl::vector<3>(1.0f,1.0f,1.0f);
+    std::string report,parameter_id,error_msg;
+    unsigned int color = 0;
+    size_t chunk_size = 4096;
+    size_t read_count = 0;
+public:
+    bool open(const char* file_name);
+    bool open(std::shared_ptr<TractStore> store);
+    bool read(std::vector<std::vector<float> >& tracts,std::vector<unsigned int>& cluster);
+    bool read(std::vector<std::vector<float> >& tracts)
+    {
+        std::vector<unsigned int> cluster;
+        return read(tracts,cluster);
+    }
+public:
+    // reductions over the remaining tracts
+    bool get_density_map(tipl::image<unsigned int,3>& mapping,
+                         const tipl::matrix<4,4,float>& transformation,bool endpoint);
+    bool get_length_histogram(std::vector<size_t>& hist,float bin_size);
+public:
+    // the spatial sidecar index maps coarse voxel blocks to the chunks of a tt.gz file
+    bool save_spatial_index(void);
+    // only reads chunks that may pass all ROIs and end regions, returns false if no index is available
+    bool select_region(std::shared_ptr<RoiMgr> roi_mgr);
+    size_t get_selected_chunk_count(void) const;
+};
+
+// out-of-core tract storage: tracts are kept in encoded chunks (the tt.gz v2 chunk format,
+// 1/32 voxel resolution) in a temporary file, and decoded chunks are paged in on access.
+// it only backs the .tt.gz merge of the ana action and TractReader::open(store),
+// TractModel and the GUI keep their tracts in memory
+struct TractStoreFile;
+class TractStore{
+private:
+    std::shared_ptr<TractStoreFile> file;
+    std::vector<std::vector<float> > open_chunk;
+    size_t tract_count = 0;
+    bool flush(void);
+public:
+    // memory of the decoded chunks kept resident
+    static size_t memory_budget;
+    tipl::geometry<3> geo;
+    tipl::vector<3> vs = tipl::vector<3>(1.0f,1.0f,1.0f);
+    std::string report,parameter_id,error_msg;
+    std::vector<uint16_t> cluster;
+public:
+    TractStore(void);
+    size_t size(void) const{return tract_count;}
+    size_t get_chunk_count(void);
+    void clear(void);
+    // the tracts are moved into the store
+    bool add(std::vector<std::vector<float> >& tracts,uint16_t cluster_id = 0);
+    bool load_from_file(const char* file_name);
+    bool save_to_file(const char* file_name);
+public:
+    std::shared_ptr<const std::vector<std::vector<float> > > get_chunk(size_t chunk);
+    bool get_tract(size_t index,std::vector<float>& tract);
+    // keeps the tracts that pass, one chunk at a time
+    bool filter(std::function<bool(const std::vector<float>&)> pass);
+    bool filter_by_roi(std::shared_ptr<RoiMgr> roi_mgr);
+};
 
 
 class atlas;
@@ -213,6 +327,17 @@ public:
     void save_to_text(std::string& text);
     bool calculate(std::shared_ptr<fib_data> handle,TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold);
     void network_property(std::string& report);
+private:
+    // the last few reports and the inputs they were calculated from
+    struct NetworkPropertyCache{
+        tipl::geometry<2> geo;
+        std::vector<float> matrix_value;
+        float overlap_ratio;
+        std::vector<std::string> region_name;
+        std::string report;
+    };
+    static const size_t network_property_cache_size = 16;
+    std::vector<NetworkPropertyCache> network_property_cache;
 };
 
 
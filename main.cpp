@@ -9,6 +9,8 @@
 #include "mainwindow.h"
 #include "tipl/tipl.hpp"
 #include "mapping/atlas.hpp"
+#include "libs/gzip_interface.hpp"
+#include "libs/tracking/tract_model.hpp"
 #include <iostream>
 #include <iterator>
 #include "program_option.hpp"
@@ -36,6 +38,7 @@ int vis(void);
 int ren(void);
 int cnn(void);
 int qc(void);
+int bench(void);
 int reg(void);
 int atk(void);
 
@@ -163,6 +166,7 @@ void init_application(void)
     QString style = settings.value("styles","Fusion").toString();
     if(style != "default" && !style.isEmpty())
         QApplication::setStyle(style);
+    TractModel::undo_memory_limit = size_t(settings.value("undo_memory_mb",1024).toInt()) << 20;
 
     if(!load_file_name())
         QMessageBox::information(nullptr,"Error",
@@ -199,6 +203,8 @@ int run_action(std::shared_ptr<QApplication> gui)
         return qc();
     if(action == std::string("reg"))
         return reg();
+    if(action == std::string("bench"))
+        return bench();
     if(action == std::string("vis"))
     {
         vis();
@@ -248,6 +254,22 @@ int run_cmd(int ac, char *av[])
             std::cout << "invalid command, use --help for more detail" << std::endl;
             return 1;
         }
+        // write .gz outputs as chunked random-access containers (chunk size in MB)
+        if(po.has("chunk_size"))
+            gz_ostream::chunk_size = size_t(po.get("chunk_size",int(1))) << 20;
+        // write a spatial sidecar index with tt.gz outputs for fast region queries
+        TractModel::spatial_index = po.get("tract_index",0);
+        // tt.gz outputs are version 1 unless chunks are requested, the spatial index requires chunks
+        TractModel::chunked_tt = po.get("tract_chunk",0) || TractModel::spatial_index;
+        // memory kept for the tract undo history before older edits are spilled to disk (in MB)
+        if(po.has("undo_memory"))
+            TractModel::undo_memory_limit = size_t(po.get("undo_memory",int(1024))) << 20;
+        // memory of the decoded tract chunks kept resident by out-of-core operations (in MB)
+        if(po.has("tract_memory"))
+            TractStore::memory_budget = size_t(po.get("tract_memory",int(2048))) << 20;
+        // overlap output compression with the processing of the next file, --async_output=0 writes in place
+        gz_write_behind::instance().enabled = po.get("async_output",1);
+        int result = 0;
         std::string source = po.get("source");
         if(po.get("action") != std::string("atk") && // atk handle * by itself
            (source.find('*') != std::string::npos ||
@@ -263,12 +285,20 @@ int run_cmd(int ac, char *av[])
                 if(run_action(gui) == 1)
                 {
                     std::cout << "Terminated due to error." << std::endl;
-                    return 1;
+                    result = 1;
+                    break;
                 }
             }
         }
         else
-            return run_action(gui);
+            result = run_action(gui);
+        std::string error_msg;
+        if(!gz_write_behind::instance().wait(error_msg))
+        {
+            std::cout << "ERROR: " << error_msg;
+            result = 1;
+        }
+        return result;
     }
     catch(const std::exception& e ) {
         std::cout << e.what() << std::endl;
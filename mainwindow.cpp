@@ -57,6 +57,7 @@ MainWindow::MainWindow(QWidget *parent) :
 
     ui->styles->addItems(QStringList("default") << QStyleFactory::keys());
     ui->styles->setCurrentText(settings.value("styles","Fusion").toString());
+    ui->undo_memory_mb->setValue(settings.value("undo_memory_mb",1024).toInt());
 
     ui->recentFib->setColumnCount(3);
     ui->recentFib->setColumnWidth(0,200);
@@ -316,6 +317,7 @@ void MainWindow::loadFib(QString filename,bool presentation_mode)
         {
             tipl::geometry<3> geo;
             shift_track_for_tck(tracking_windows.back()->tractWidget->tract_models.back()->get_tracts(),geo);
+            tracking_windows.back()->tractWidget->tract_models.back()->tracts_changed();
         }
     }
 
@@ -1197,6 +1199,12 @@ void MainWindow::on_styles_activated(const QString&)
     }
 }
 
+void MainWindow::on_undo_memory_mb_valueChanged(int arg1)
+{
+    settings.setValue("undo_memory_mb",arg1);
+    TractModel::undo_memory_limit = size_t(arg1) << 20;
+}
+
 void MainWindow::on_show_console_clicked()
 {
     #ifdef _WIN32
@@ -65,6 +65,7 @@ private slots:
     void on_clear_src_history_clicked();
     void on_clear_fib_history_clicked();
     void on_styles_activated(const QString &arg1);
+    void on_undo_memory_mb_valueChanged(int arg1);
     void on_show_console_clicked();
 };
 
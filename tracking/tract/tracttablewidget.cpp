@@ -89,13 +89,15 @@ void TractTableWidget::draw_tracts(unsigned char dim,int pos,
     auto iT = cur_tracking_window.current_slice->T;
     iT.inv();
     max_count /= selected_tracts.size();
+    // with several tracts, each worker builds its slice index serially instead of nesting par_for
+    bool build_parallel = (selected_tracts.size() == 1);
 
     tipl::par_for2(selected_tracts.size(),[&](unsigned int index,unsigned int thread)
     {
         if(cur_tracking_window.current_slice->is_diffusion_space)
-            selected_tracts[index]->get_in_slice_tracts(dim,pos,nullptr,lines_threaded[thread],colors_threaded[thread],max_count);
+            selected_tracts[index]->get_in_slice_tracts(dim,pos,nullptr,lines_threaded[thread],colors_threaded[thread],max_count,build_parallel);
         else
-            selected_tracts[index]->get_in_slice_tracts(dim,pos,&iT,lines_threaded[thread],colors_threaded[thread],max_count);
+            selected_tracts[index]->get_in_slice_tracts(dim,pos,&iT,lines_threaded[thread],colors_threaded[thread],max_count,build_parallel);
     });
 
     std::vector<std::vector<tipl::vector<2,float> > > lines(std::move(lines_threaded[0]));
@@ -515,11 +517,23 @@ void TractTableWidget::clustering(int method_id)
     if(!ok)
         return;
     ok = true;
-    double detail = method_id ? 0.0 : QInputDialog::getDouble(this,
+    double detail = 0.0;
+    if(method_id == 0)
+        detail = QInputDialog::getDouble(this,
             "DSI Studio","Clustering detail (mm):",cur_tracking_window.handle->vs[0],0.2,50.0,2,&ok);
+    if(method_id == 3)
+        detail = QInputDialog::getDouble(this,
+            "DSI Studio","Distance threshold (mm):",10.0,0.5,100.0,1,&ok);
     if(!ok)
         return;
-    tract_models[uint32_t(currentRow())]->run_clustering(method_id,n,detail);
+    bool warm_start = false;
+    if((method_id == 1 || method_id == 2) &&
+       tract_models[uint32_t(currentRow())]->get_cluster_info().size() == tract_models[uint32_t(currentRow())]->get_visible_track_count())
+        warm_start = QMessageBox::question(this,"DSI Studio","Start from the current clustering?",
+                                           QMessageBox::Yes|QMessageBox::No,QMessageBox::No) == QMessageBox::Yes;
+    begin_prog("clustering");
+    tract_models[uint32_t(currentRow())]->run_clustering(method_id,n,detail,0,warm_start);
+    check_prog(0,0);
     std::vector<unsigned int> c = tract_models[uint32_t(currentRow())]->get_cluster_info();
     load_cluster_label(c);
     assign_colors();
@@ -825,8 +839,9 @@ void TractTableWidget::deep_learning_train(void)
         for(unsigned int index = 0;check_prog(index,rowCount());++index)
         {
             tipl::image<unsigned char,3> track_map(cur_tracking_window.handle->dim);
-            for(unsigned int i = 0;i < tract_models[index]->get_tracts().size();++i)
-                paint_track_on_volume(track_map,tract_models[index]->get_tracts()[i]);
+            const auto& tract_data = std::as_const(*tract_models[index]).get_tracts();
+            for(unsigned int i = 0;i < tract_data.size();++i)
+                paint_track_on_volume(track_map,tract_data[i]);
             while(tipl::morphology::smoothing_fill(track_map))
                 ;
             tipl::morphology::defragment(track_map);
@@ -856,7 +871,7 @@ void TractTableWidget::deep_learning_train(void)
 
 void TractTableWidget::recog_tracks(void)
 {
-    if(currentRow() >= int(tract_models.size()) || tract_models[uint32_t(currentRow())]->get_tracts().size() == 0)
+    if(currentRow() >= int(tract_models.size()) || tract_models[uint32_t(currentRow())]->get_visible_track_count() == 0)
         return;
     if(!cur_tracking_window.handle->load_track_atlas())
     {
@@ -1146,11 +1161,10 @@ void TractTableWidget::separate_deleted_track(void)
     if(currentRow() >= int(tract_models.size()) || currentRow() == -1)
         return;
     std::vector<std::vector<float> > new_tracks;
-    new_tracks.swap(tract_models[uint32_t(currentRow())]->get_deleted_tracts());
+    // take out the deleted tracks, which also cleans the undo history
+    tract_models[uint32_t(currentRow())]->release_deleted_tracts(new_tracks);
     if(new_tracks.empty())
         return;
-    // clean the deleted tracks
-    tract_models[uint32_t(currentRow())]->clear_deleted();
     item(currentRow(),1)->setText(QString::number(tract_models[uint32_t(currentRow())]->get_visible_track_count()));
     item(currentRow(),2)->setText(QString::number(tract_models[uint32_t(currentRow())]->get_deleted_track_count()));
     // add deleted tracks to a new entry
@@ -55,6 +55,7 @@ public slots:
     void clustering_EM(void){clustering(2);}
     void clustering_kmeans(void){clustering(1);}
     void clustering_hie(void){clustering(0);}
+    void clustering_qb(void){clustering(3);}
     void auto_recognition(void);
     void recognize_rename(void);
     void open_cluster_label(void);